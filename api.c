@@ -0,0 +1,319 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "notion.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "futures.h"
+#include "nstring.h"
+#include "sexpr.h"
+#include "stack.h"
+#include "tokenizer.h"
+#include "util.h"
+
+/* The embedding API from notion.h. A notion is just the vm and global
+	scope that notion.c's main() sets up for the REPL. */
+
+struct notion {
+	vm_heap *vm;
+	scope *global;
+	/* How many registered builtins are running right now. Their caller
+		is holding values we can't see, so no collecting till they return. */
+	atomic_int depth;
+};
+
+/* A C function registered under a name. They hang off the vm so that the
+	trampoline below can find them from just the vm and the name it's
+	called by. */
+typedef struct foreign_fn {
+	char *name;
+	notion_builtin fn;
+	void *data;
+	notion *ctx;
+	struct foreign_fn *next;
+} foreign_fn;
+
+notion* notion_new(void) {
+	notion *ctx = malloc(sizeof(notion));
+	ctx->vm = vm_new();
+	ctx->global = scope_new(GLOBAL_TABLE_SIZE);
+	atomic_init(&ctx->depth, 0);
+	load_built_ins(ctx->global);
+
+	return ctx;
+}
+
+void notion_free(notion *ctx) {
+	/* Anything still running is using the heap we're about to free */
+	futures_drain(ctx->vm);
+
+	foreign_fn *f = ctx->vm->foreign;
+	while (f) {
+		foreign_fn *next = f->next;
+		free(f->name);
+		free(f);
+		f = next;
+	}
+
+	free_built_ins(ctx->global);
+	scope_free(ctx->global);
+	vm_free(ctx->vm);
+	free(ctx->vm);
+	free(ctx);
+}
+
+/* Evaluate everything the tokenizer has in it, stopping at the first
+	error */
+static sexpr* eval_tokens(notion *ctx, tokenizer *tk) {
+	/* A thread that isn't the one main() runs on may never have set up
+		its stack limit, and then deep recursion would just crash */
+	if (stack_limit == 0)
+		stack_init();
+
+	return eval_all(ctx->vm, ctx->global, tk, NULL);
+}
+
+notion_value* notion_eval_string(notion *ctx, const char *src) {
+	tokenizer *tk = tokenizer_new();
+	tokenizer_feed_buffer(tk, src, strlen(src));
+
+	sexpr *result = eval_tokens(ctx, tk);
+	tokenizer_free(tk);
+
+	return result;
+}
+
+notion_value* notion_load_file(notion *ctx, const char *path) {
+	tokenizer *tk = tokenizer_new();
+	if (!start_file(tk, (char*)path)) {
+		tokenizer_free(tk);
+		return sexpr_err(ctx->vm, "File not found.");
+	}
+
+	sexpr *result = eval_tokens(ctx, tk);
+	tokenizer_free(tk);
+
+	return result;
+}
+
+static foreign_fn* find_foreign(vm_heap *vm, const char *name) {
+	foreign_fn *f;
+
+	vm_lock(vm);
+	for (f = vm->foreign; f; f = f->next) {
+		if (strcmp(f->name, name) == 0)
+			break;
+	}
+	vm_unlock(vm);
+
+	return f;
+}
+
+/* Every registered builtin is bound to this, and it looks up which C
+	function to call by the name it was called as */
+static sexpr* builtin_foreign(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	foreign_fn *f = find_foreign(vm, op);
+	if (!f)
+		return sexpr_err(vm, "Unknown foreign function.");
+
+	sexpr **args = malloc((count > 1 ? count - 1 : 1) * sizeof(sexpr*));
+	for (int j = 1; j < count; j++) {
+		args[j - 1] = eval2(vm, env, nodes[j]);
+		if (args[j - 1]->type == LVAL_ERR) {
+			sexpr *err = args[j - 1];
+			free(args);
+			return err;
+		}
+	}
+
+	atomic_fetch_add(&f->ctx->depth, 1);
+	sexpr *result = f->fn(f->ctx, args, count - 1, f->data);
+	atomic_fetch_sub(&f->ctx->depth, 1);
+	free(args);
+
+	return result ? result : sexpr_null();
+}
+
+int notion_register_builtin(notion *ctx, const char *name, notion_builtin fn, void *data) {
+	sexpr *cur = scope_fetch_var(ctx->vm, ctx->global, (char*)name);
+	if (cur->type == LVAL_FUN && cur->builtin && cur->fun != builtin_foreign)
+		return -1;
+
+	/* Registering the same name again just swaps in the new function */
+	vm_lock(ctx->vm);
+	foreign_fn *f;
+	for (f = ctx->vm->foreign; f; f = f->next) {
+		if (strcmp(f->name, name) == 0)
+			break;
+	}
+
+	if (f) {
+		f->fn = fn;
+		f->data = data;
+		vm_unlock(ctx->vm);
+		return 0;
+	}
+
+	f = malloc(sizeof(foreign_fn));
+	f->name = n_strcpy(f->name, (char*)name);
+	f->fn = fn;
+	f->data = data;
+	f->ctx = ctx;
+	f->next = ctx->vm->foreign;
+	ctx->vm->foreign = f;
+	vm_unlock(ctx->vm);
+
+	scope_insert_var(ctx->global, (char*)name, sexpr_fun_builtin(&builtin_foreign, (char*)name));
+
+	return 0;
+}
+
+long notion_collect(notion *ctx) {
+	if (atomic_load(&ctx->depth) > 0)
+		return -1;
+
+	return gc_run(ctx->vm, ctx->global);
+}
+
+/* Protected values live in a list on the vm that the collector marks along
+	with the global scope. Protecting the same value twice means it has to
+	be unprotected twice. */
+void notion_protect(notion *ctx, notion_value *v) {
+	vm_lock(ctx->vm);
+	if (!ctx->vm->roots)
+		ctx->vm->roots = sexpr_list(ctx->vm);
+	sexpr_append(ctx->vm->roots, v);
+	vm_unlock(ctx->vm);
+}
+
+void notion_unprotect(notion *ctx, notion_value *v) {
+	vm_lock(ctx->vm);
+	sexpr *roots = ctx->vm->roots;
+	for (int j = roots ? roots->count - 1 : -1; j >= 0; j--) {
+		if (roots->children[j] == v) {
+			memmove(roots->children + j, roots->children + j + 1,
+				(roots->count - j - 1) * sizeof(sexpr*));
+			roots->count--;
+			break;
+		}
+	}
+	vm_unlock(ctx->vm);
+}
+
+enum notion_type notion_type_of(notion_value *v) {
+	switch (v->type) {
+		case LVAL_NULL:
+			return NOTION_NULL;
+		case LVAL_NUM:
+			return v->num_type == NUM_TYPE_INT ? NOTION_INT : NOTION_DEC;
+		case LVAL_BOOL:
+			return NOTION_BOOL;
+		case LVAL_STR:
+			return NOTION_STRING;
+		case LVAL_SYM:
+			return NOTION_SYMBOL;
+		case LVAL_LIST:
+			return NOTION_LIST;
+		case LVAL_FUN:
+			return NOTION_FUNCTION;
+		case LVAL_ERR:
+			return NOTION_ERROR;
+		default:
+			return NOTION_OTHER;
+	}
+}
+
+int notion_is_error(notion_value *v) {
+	return v->type == LVAL_ERR;
+}
+
+long notion_to_long(notion_value *v) {
+	if (v->type != LVAL_NUM)
+		return 0;
+
+	return v->num_type == NUM_TYPE_INT ? v->i_num : (long)v->d_num;
+}
+
+double notion_to_double(notion_value *v) {
+	if (v->type != LVAL_NUM)
+		return 0.0;
+
+	return v->num_type == NUM_TYPE_INT ? (double)v->i_num : v->d_num;
+}
+
+/* Like Scheme, anything that isn't #f counts as true */
+int notion_to_bool(notion_value *v) {
+	return !(v->type == LVAL_BOOL && !v->bool);
+}
+
+const char* notion_string(notion_value *v, size_t *len) {
+	if (v->type == LVAL_STR) {
+		if (len)
+			*len = v->len;
+		return v->str;
+	}
+
+	if (v->type == LVAL_SYM) {
+		if (len)
+			*len = strlen(v->sym);
+		return v->sym;
+	}
+
+	return NULL;
+}
+
+const char* notion_error(notion_value *v) {
+	return v->type == LVAL_ERR ? v->err : NULL;
+}
+
+int notion_list_length(notion_value *v) {
+	return v->type == LVAL_LIST ? v->count : -1;
+}
+
+notion_value* notion_list_ref(notion_value *v, int j) {
+	if (v->type != LVAL_LIST || j < 0 || j >= v->count)
+		return NULL;
+
+	return v->children[j];
+}
+
+char* notion_describe(notion_value *v) {
+	return sexpr_desc(v);
+}
+
+notion_value* notion_make_null(notion *ctx) {
+	return sexpr_null();
+}
+
+notion_value* notion_make_int(notion *ctx, long n) {
+	sexpr *v = sexpr_num(ctx->vm, NUM_TYPE_INT, 0);
+	v->i_num = n;
+
+	return v;
+}
+
+notion_value* notion_make_double(notion *ctx, double d) {
+	return sexpr_num(ctx->vm, NUM_TYPE_DEC, d);
+}
+
+notion_value* notion_make_bool(notion *ctx, int b) {
+	return sexpr_bool(ctx->vm, b != 0);
+}
+
+notion_value* notion_make_string(notion *ctx, const char *s, size_t len) {
+	return sexpr_str_shared(ctx->vm, nstr_new(s, len), len);
+}
+
+notion_value* notion_make_list(notion *ctx, notion_value **items, int count) {
+	sexpr *v = sexpr_list(ctx->vm);
+	for (int j = 0; j < count; j++)
+		sexpr_append(v, items[j]);
+
+	return v;
+}
+
+notion_value* notion_make_error(notion *ctx, const char *msg) {
+	return sexpr_err(ctx->vm, (char*)msg);
+}
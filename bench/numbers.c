@@ -0,0 +1,210 @@
+/* How fast numbers are read and printed (numconv.h) next to the C library
+	doing the same job. From the top of the repo:
+
+	  make bench-numbers
+	  ./bench/numbers
+
+	It makes up its own input: symbols like a tokenizer sees in code, which
+	mostly aren't numbers, doubles written out in full, and random doubles
+	to print. Each is run a few times and the best is reported. It only
+	does a rough check that the answers are right; tests/numbers.c is
+	where they're properly checked. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../numconv.h"
+
+#define RUNS 5
+#define COUNT 1000000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static double random_double(void) {
+	for (;;) {
+		uint64_t b = rng();
+		double d;
+		memcpy(&d, &b, sizeof d);
+		if (d == d && d - d == 0)
+			return d;
+	}
+}
+
+/* The way the tokenizer used to do it */
+static int libc_parse(const char *s, size_t len, int *is_int, long *i_num, double *d_num) {
+	const char *end = s + len;
+	char *p;
+
+	long a = strtol(s, &p, 10);
+	if (p == end) {
+		*is_int = 1;
+		*i_num = a;
+		return 1;
+	}
+
+	double b = strtod(s, &p);
+	if (p == end) {
+		*is_int = 0;
+		*d_num = b;
+		return 1;
+	}
+
+	return 0;
+}
+
+typedef int (*parse_fn)(const char*, size_t, int*, long*, double*);
+
+/* Texts packed one after another, each with its '\0' */
+typedef struct texts {
+	char *buf;
+	size_t *start;
+	size_t *len;
+	int count;
+} texts;
+
+static double time_parse(parse_fn parse, texts *t, double *sum) {
+	double best = 0;
+
+	for (int r = 0; r < RUNS; r++) {
+		double start = now();
+		double total = 0;
+		for (int j = 0; j < t->count; j++) {
+			int is_int;
+			long i;
+			double d;
+			if (parse(t->buf + t->start[j], t->len[j], &is_int, &i, &d))
+				total += is_int ? i : d;
+		}
+		double elapsed = now() - start;
+		if (r == 0 || elapsed < best)
+			best = elapsed;
+		*sum = total;
+	}
+
+	return best;
+}
+
+static void bench_parse(const char *what, texts *t) {
+	double a, b;
+	double ours = time_parse(num_parse, t, &a);
+	double libc = time_parse(libc_parse, t, &b);
+
+	printf("%-10s num_parse %6.1f M/s   strtol+strtod %6.1f M/s   %.1fx\n", what,
+		t->count / ours / 1e6, t->count / libc / 1e6, libc / ours);
+	if (a != b)
+		printf("  ...but they don't agree!\n");
+}
+
+static void add_text(texts *t, const char *s, size_t *used) {
+	size_t len = strlen(s);
+	memcpy(t->buf + *used, s, len + 1);
+	t->start[t->count] = *used;
+	t->len[t->count++] = len;
+	*used += len + 1;
+}
+
+static texts texts_new(void) {
+	texts t;
+	t.buf = malloc(COUNT * 40);
+	t.start = malloc(COUNT * sizeof(size_t));
+	t.len = malloc(COUNT * sizeof(size_t));
+	t.count = 0;
+
+	return t;
+}
+
+static void texts_free(texts *t) {
+	free(t->buf);
+	free(t->start);
+	free(t->len);
+}
+
+int main(void) {
+	static const char *words[] = { "define", "lambda", "car", "cdr", "x", "list->vector",
+		"-", "...", "null?", "let*", "acc", "1+", "-1", "42", "3.14", "string-append" };
+	size_t used = 0;
+	char buf[40];
+
+	texts code = texts_new();
+	for (int j = 0; j < COUNT; j++)
+		add_text(&code, words[rng() % (sizeof words / sizeof words[0])], &used);
+	bench_parse("code", &code);
+	texts_free(&code);
+
+	used = 0;
+	texts ints = texts_new();
+	for (int j = 0; j < COUNT; j++) {
+		snprintf(buf, sizeof buf, "%ld", (long)(rng() >> (rng() % 64)) - (long)(rng() % 1000));
+		add_text(&ints, buf, &used);
+	}
+	bench_parse("integers", &ints);
+	texts_free(&ints);
+
+	used = 0;
+	texts dbls = texts_new();
+	for (int j = 0; j < COUNT; j++) {
+		snprintf(buf, sizeof buf, "%.17g", random_double());
+		add_text(&dbls, buf, &used);
+	}
+	bench_parse("doubles", &dbls);
+	texts_free(&dbls);
+
+	double *nums = malloc(COUNT * sizeof(double));
+	for (int j = 0; j < COUNT; j++)
+		nums[j] = j % 2 ? random_double() : (double)(rng() % 100000) / 100;
+
+	double ours = 0, libc = 0;
+	size_t chars = 0;
+	for (int r = 0; r < RUNS; r++) {
+		char out[NUM_BUF_SIZE];
+		double start = now();
+		for (int j = 0; j < COUNT; j++)
+			chars += num_format_double(out, nums[j]);
+		double elapsed = now() - start;
+		if (r == 0 || elapsed < ours)
+			ours = elapsed;
+
+		start = now();
+		for (int j = 0; j < COUNT; j++)
+			chars += snprintf(out, sizeof out, "%.17g", nums[j]);
+		elapsed = now() - start;
+		if (r == 0 || elapsed < libc)
+			libc = elapsed;
+	}
+	printf("%-10s num_format_double %6.1f M/s   %%.17g %6.1f M/s   %.1fx\n", "printing",
+		COUNT / ours / 1e6, COUNT / libc / 1e6, libc / ours);
+
+	int wrong = 0;
+	for (int j = 0; j < COUNT; j++) {
+		char out[NUM_BUF_SIZE];
+		num_format_double(out, nums[j]);
+		double back = strtod(out, NULL);
+		if (memcmp(&back, &nums[j], sizeof back) != 0 && wrong++ < 10)
+			printf("  %s doesn't read back as %.17g\n", out, nums[j]);
+	}
+	if (wrong)
+		printf("  %d didn't read back\n", wrong);
+	free(nums);
+
+	return wrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+; Scheme-level loops over boxed numbers versus the f64vector kernels.
+; From the top of the repo:
+;
+;   > (load "bench/numvec.scm")
+;
+; Run it again with NOTION_SIMD=scalar (or sse2) in the environment to see
+; what the AVX2 kernels buy over the plain C loops.
+
+(define (ramp n)
+    (cond ((= n 0) '())
+        (else (cons n (ramp (- n 1))))))
+
+(define (dot a b)
+    (cond ((null? a) 0)
+        (else (+ (* (car a) (car b)) (dot (cdr a) (cdr b))))))
+
+(define (scale l k)
+    (cond ((null? l) '())
+        (else (cons (* k (car l)) (scale (cdr l) k)))))
+
+(define xs (ramp 1000))
+(define v (list->f64vector xs))
+
+(simd-level)
+
+; 1000 elements, boxed vs. unboxed
+(time (dot xs xs))
+(time (f64vector-dot v v))
+(time (null? (scale xs 0.5)))
+(time (f64vector-length (f64vector-scale v 0.5)))
+
+; A million elements is out of reach for the list versions, so these are
+; for comparing the kernels with each other
+(define big (make-f64vector 1000000 1.5))
+(define big2 (f64vector-map + big 0.25))
+(time (f64vector-dot big big2))
+(time (f64vector-sum (f64vector-mul big big2)))
+(time (f64vector-max (f64vector-map max big big2)))
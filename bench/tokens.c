@@ -0,0 +1,64 @@
+/* How fast the tokenizer gets through a file, on its own without the
+	parser. From the top of the repo:
+
+	  make bench-tokens
+	  ./bench/tokens big.scm
+
+	Give it something a few megabytes long so the time isn't all start up.
+	It runs over the file a few times and reports the best. Run it again
+	with NOTION_SIMD=scalar (or sse2) to compare the scan kernels (see
+	scan.h). */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../tokenizer.h"
+
+#define RUNS 5
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double best = 0;
+	long count = 0;
+	size_t bytes = 0;
+
+	for (int r = 0; r < RUNS; r++) {
+		tokenizer *tk = tokenizer_new();
+		if (!start_file(tk, argv[1])) {
+			fprintf(stderr, "%s: File not found.\n", argv[1]);
+			tokenizer_free(tk);
+			return EXIT_FAILURE;
+		}
+		bytes = tk->len;
+
+		double start = now();
+		count = 0;
+		for (token t = next_token(tk); t.type != T_NULL; t = next_token(tk))
+			count++;
+		double elapsed = now() - start;
+
+		tokenizer_free(tk);
+		if (r == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%s scan kernels\n", scan_kernels_get()->name);
+	printf("%ld tokens, %zu bytes in %.3fs\n", count, bytes, best);
+	printf("%.1f million tokens/s, %.1f MB/s\n", count / best / 1e6, bytes / best / 1e6);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,295 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A client for notion --serve (see server.h for the protocol).
+
+	notion-client sock expr ...   sends each expr and prints what comes back
+	notion-client sock            sends whatever is on stdin as one request
+	notion-client -n count [-c connections] sock expr
+	                              sends expr count times, spread over that
+	                              many connections, and reports the latency
+	                              of a request */
+
+typedef struct reply {
+	int status;
+	char *text;
+	size_t len;
+} reply;
+
+typedef struct bench {
+	const char *path;
+	const char *expr;
+	int count;
+	double *latencies; /* In ms, one per request */
+	int failed;
+} bench;
+
+static void usage(void) {
+	fputs("Usage: notion-client sock [expr ...]\n"
+		"       notion-client -n count [-c connections] sock expr\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+static int connect_to(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof addr.sun_path)
+		return -1;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const void *p, size_t n) {
+	const char *s = p;
+	while (n > 0) {
+		ssize_t w = write(fd, s, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return 0;
+		s += w;
+		n -= w;
+	}
+
+	return 1;
+}
+
+static int read_all(int fd, void *p, size_t n) {
+	char *s = p;
+	while (n > 0) {
+		ssize_t r = read(fd, s, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		s += r;
+		n -= r;
+	}
+
+	return 1;
+}
+
+/* Send one request and wait for its reply. Gives back 0 if the connection
+	went away. */
+static int request(int fd, const char *src, size_t len, reply *r) {
+	unsigned char hdr[4] = { len >> 24, len >> 16, len >> 8, len };
+	if (!write_all(fd, hdr, 4) || !write_all(fd, src, len))
+		return 0;
+
+	if (!read_all(fd, hdr, 4))
+		return 0;
+	uint32_t n = (uint32_t)hdr[0] << 24 | (uint32_t)hdr[1] << 16 | (uint32_t)hdr[2] << 8 | hdr[3];
+	if (n == 0)
+		return 0;
+
+	unsigned char status;
+	if (!read_all(fd, &status, 1))
+		return 0;
+
+	r->status = status;
+	r->len = n - 1;
+	r->text = realloc(r->text, r->len + 1);
+	if (!read_all(fd, r->text, r->len))
+		return 0;
+	r->text[r->len] = '\0';
+
+	return 1;
+}
+
+static char* read_stdin(size_t *len) {
+	size_t cap = 4096;
+	char *s = malloc(cap);
+	*len = 0;
+
+	size_t n;
+	while ((n = fread(s + *len, 1, cap - *len, stdin)) > 0) {
+		*len += n;
+		if (*len == cap)
+			s = realloc(s, cap *= 2);
+	}
+
+	return s;
+}
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void* bench_main(void *arg) {
+	bench *b = arg;
+	reply r = { 0, NULL, 0 };
+
+	int fd = connect_to(b->path);
+	if (fd < 0) {
+		b->failed = 1;
+		return NULL;
+	}
+
+	size_t len = strlen(b->expr);
+	for (int j = 0; j < b->count; j++) {
+		double start = now_ms();
+		if (!request(fd, b->expr, len, &r) || r.status != 0) {
+			b->failed = 1;
+			break;
+		}
+		b->latencies[j] = now_ms() - start;
+	}
+
+	close(fd);
+	free(r.text);
+
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* The value below which p percent of the samples fall */
+static double percentile(double *sorted, int n, double p) {
+	int j = (int)(p / 100.0 * n);
+
+	return sorted[j < n ? j : n - 1];
+}
+
+static int run_bench(const char *path, const char *expr, int count, int conns) {
+	if (conns > count)
+		conns = count;
+
+	bench *b = calloc(conns, sizeof(bench));
+	pthread_t *threads = malloc(conns * sizeof(pthread_t));
+	double *all = malloc(count * sizeof(double));
+
+	double start = now_ms();
+	int offset = 0;
+	for (int j = 0; j < conns; j++) {
+		b[j].path = path;
+		b[j].expr = expr;
+		b[j].count = count / conns + (j < count % conns);
+		b[j].latencies = all + offset;
+		offset += b[j].count;
+		pthread_create(&threads[j], NULL, bench_main, &b[j]);
+	}
+
+	int failed = 0;
+	for (int j = 0; j < conns; j++) {
+		pthread_join(threads[j], NULL);
+		failed |= b[j].failed;
+	}
+	double elapsed = now_ms() - start;
+
+	if (failed) {
+		fputs("A request failed or the server couldn't be reached.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	double total = 0;
+	for (int j = 0; j < count; j++)
+		total += all[j];
+	qsort(all, count, sizeof(double), cmp_double);
+
+	printf("%d requests over %d connection%s in %.1f ms (%.0f requests/s)\n",
+		count, conns, conns == 1 ? "" : "s", elapsed, count / (elapsed / 1000.0));
+	printf("latency ms: mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+		total / count, percentile(all, count, 50), percentile(all, count, 90),
+		percentile(all, count, 99), all[count - 1]);
+
+	free(all);
+	free(threads);
+	free(b);
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+	int count = 0;
+	int conns = 1;
+
+	/* A server that's gone away should be an error, not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	int j = 1;
+	for (; j < argc && argv[j][0] == '-'; j++) {
+		if (strcmp(argv[j], "-n") == 0 && j + 1 < argc)
+			count = atoi(argv[++j]);
+		else if (strcmp(argv[j], "-c") == 0 && j + 1 < argc)
+			conns = atoi(argv[++j]);
+		else
+			usage();
+	}
+
+	if (j == argc)
+		usage();
+	const char *path = argv[j++];
+
+	if (count > 0) {
+		if (j != argc - 1 || conns < 1)
+			usage();
+		return run_bench(path, argv[j], count, conns);
+	}
+
+	int fd = connect_to(path);
+	if (fd < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	reply r = { 0, NULL, 0 };
+	int status = EXIT_SUCCESS;
+
+	if (j == argc) {
+		size_t len;
+		char *src = read_stdin(&len);
+		if (!request(fd, src, len, &r)) {
+			fputs("Lost the connection to the server.\n", stderr);
+			status = EXIT_FAILURE;
+		}
+		free(src);
+		if (status == EXIT_SUCCESS) {
+			fprintf(r.status ? stderr : stdout, "%s\n", r.text);
+			status = r.status ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+	}
+
+	for (; j < argc && status == EXIT_SUCCESS; j++) {
+		if (!request(fd, argv[j], strlen(argv[j]), &r)) {
+			fputs("Lost the connection to the server.\n", stderr);
+			status = EXIT_FAILURE;
+			break;
+		}
+		fprintf(r.status ? stderr : stdout, "%s\n", r.text);
+		if (r.status)
+			status = EXIT_FAILURE;
+	}
+
+	close(fd);
+	free(r.text);
+
+	return status;
+}
@@ -52,3 +52,23 @@
             )
         )
 ))
+
+; The classic call/cc example: multiply a list of numbers but bail out
+; straight away when we hit a zero, instead of unwinding all the pending *s
+(define product
+    (lambda (lat)
+        (call/cc
+            (lambda (break)
+                (product&break lat break)
+            )
+        )
+))
+
+(define product&break
+    (lambda (lat break)
+        (cond
+            ((null? lat) 1)
+            ((= (car lat) 0) (break 0))
+            (else (* (car lat) (product&break (cdr lat) break)))
+        )
+))
@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "coro.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "printer.h"
+#include "sexpr.h"
+#include "stack.h"
+
+/* The coroutine that's running right now, NULL when it's the REPL itself */
+static _Thread_local coro *running = NULL;
+static _Thread_local coro *ready_head = NULL;
+static _Thread_local coro *ready_tail = NULL;
+
+static void enqueue(coro *c) {
+	c->next_ready = NULL;
+	if (ready_tail)
+		ready_tail->next_ready = c;
+	else
+		ready_head = c;
+	ready_tail = c;
+}
+
+static coro* dequeue(void) {
+	coro *c = ready_head;
+	if (c) {
+		ready_head = c->next_ready;
+		if (!ready_head)
+			ready_tail = NULL;
+	}
+
+	return c;
+}
+
+static coro* coro_new(vm_heap *vm, scope *env, sexpr *thunk, enum coro_kind kind) {
+	coro *c = malloc(sizeof(coro));
+	c->kind = kind;
+	c->state = CORO_NEW;
+	c->vm = vm;
+	c->thunk = thunk;
+	c->value = NULL;
+	c->ctx = NULL; /* The stack is made when it's first run */
+	c->resumer = NULL;
+	c->calls = NULL;
+	c->escapes = NULL;
+	c->out = NULL;
+	c->next_ready = NULL;
+
+	/* The thunk is called from the global scope, since whatever local
+		scope we're in now may well be gone by the time it runs */
+	c->global = env;
+	while (c->global->parent)
+		c->global = c->global->parent;
+
+	c->self = sexpr_coro(vm, c);
+
+	return c;
+}
+
+void coro_free(coro *c) {
+	if (c->ctx) {
+		free_calls(c->calls);
+		port_release(c->out, NULL);
+		stack_ctx_free(c->ctx);
+	}
+
+	free(c);
+}
+
+static void coro_main(void *arg) {
+	coro *c = arg;
+
+	c->value = apply_fun(c->vm, c->global, c->thunk, NULL, 0);
+	c->state = CORO_DONE;
+	c->calls = NULL;
+	c->escapes = NULL;
+	c->out = NULL;
+
+	/* Never comes back. resume() frees the stack we're on. */
+	stack_ctx_switch(c->ctx, c->resumer);
+}
+
+/* Run c until it yields or finishes. Returns an error, or NULL. */
+static sexpr* resume(vm_heap *vm, coro *c) {
+	if (!c->ctx) {
+		c->ctx = stack_ctx_new(coro_main, c);
+		if (!c->ctx)
+			return sexpr_err(vm, "Couldn't make a stack for the coroutine.");
+	}
+
+	coro *me = running;
+	stack_ctx *here = me ? me->ctx : stack_thread_ctx();
+	struct call_state *calls = live_calls;
+	struct continuation *esc = escapes;
+	port *out = current_port;
+
+	c->resumer = here;
+	c->state = CORO_RUNNING;
+	live_calls = c->calls;
+	escapes = c->escapes;
+	current_port = c->out;
+	running = c;
+
+	stack_ctx_switch(here, c->ctx);
+
+	running = me;
+	live_calls = calls;
+	escapes = esc;
+	current_port = out;
+
+	if (c->state == CORO_DONE) {
+		stack_ctx_free(c->ctx);
+		c->ctx = NULL;
+	}
+
+	return NULL;
+}
+
+/* Called from inside c to go back to whoever resumed it */
+static void suspend(coro *c) {
+	c->calls = live_calls;
+	c->escapes = escapes;
+	c->out = current_port;
+	c->state = CORO_SUSPENDED;
+
+	stack_ctx_switch(c->ctx, c->resumer);
+}
+
+/* Generators and tasks both start out as a function of no arguments */
+static sexpr* eval_thunk(vm_heap *vm, scope *env, sexpr *node) {
+	sexpr *f = eval2(vm, env, node);
+	ASSERT_NOT_ERR(f);
+	ASSERT_TYPE(f, LVAL_FUN, "Expected a function of no arguments.");
+
+	if (!f->builtin && f->params->count > 0)
+		return sexpr_err(vm, "Expected a function of no arguments.");
+
+	return f;
+}
+
+static sexpr* eval_coro(vm_heap *vm, scope *env, sexpr *node, enum coro_kind kind) {
+	sexpr *c = eval2(vm, env, node);
+	ASSERT_NOT_ERR(c);
+
+	if (c->type != LVAL_CORO || c->co->kind != kind)
+		return sexpr_err(vm, kind == CORO_GENERATOR ? "Expected a generator." : "Expected a task.");
+
+	return c;
+}
+
+sexpr* builtin_make_generator(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "make-generator expects a function of no arguments.");
+
+	sexpr *f = eval_thunk(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+
+	return coro_new(vm, env, f, CORO_GENERATOR)->self;
+}
+
+/* (next g) or (next g default) */
+sexpr* builtin_next(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 2, "next expects a generator and an optional default.");
+	ASSERT_PARAM_MAX(count, 3, "next expects a generator and an optional default.");
+
+	sexpr *g = eval_coro(vm, env, nodes[1], CORO_GENERATOR);
+	ASSERT_NOT_ERR(g);
+
+	sexpr *dflt = count == 3 ? eval2(vm, env, nodes[2]) : sexpr_list(vm);
+	ASSERT_NOT_ERR(dflt);
+
+	coro *c = g->co;
+	if (c->state == CORO_DONE)
+		return dflt;
+	if (c->state == CORO_RUNNING)
+		return sexpr_err(vm, "That generator is already running.");
+
+	sexpr *err = resume(vm, c);
+	if (err)
+		return err;
+
+	/* A generator that ended in an error passes it on */
+	if (c->state == CORO_DONE)
+		return c->value->type == LVAL_ERR ? c->value : dflt;
+
+	return c->value;
+}
+
+sexpr* builtin_spawn(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "spawn expects a function of no arguments.");
+
+	sexpr *f = eval_thunk(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+
+	coro *c = coro_new(vm, env, f, CORO_TASK);
+	enqueue(c);
+
+	return c->self;
+}
+
+/* Give every task that's waiting one turn. This is what a yield outside of
+	any coroutine does. */
+static sexpr* run_ready(vm_heap *vm) {
+	coro *last = ready_tail;
+
+	while (ready_head) {
+		coro *c = dequeue();
+		sexpr *err = resume(vm, c);
+		if (err)
+			return err;
+
+		if (c == last)
+			break;
+	}
+
+	return NULL;
+}
+
+/* (yield) or (yield value) */
+sexpr* builtin_yield(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MAX(count, 2, "yield takes at most one value.");
+
+	sexpr *v = count == 2 ? eval2(vm, env, nodes[1]) : sexpr_null();
+	ASSERT_NOT_ERR(v);
+
+	coro *c = running;
+	if (!c) {
+		sexpr *err = run_ready(vm);
+		if (err)
+			return err;
+		return sexpr_null();
+	}
+
+	c->value = v;
+	if (c->kind == CORO_TASK)
+		enqueue(c);
+	suspend(c);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_join(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "join expects a task.");
+
+	sexpr *t = eval_coro(vm, env, nodes[1], CORO_TASK);
+	ASSERT_NOT_ERR(t);
+
+	coro *c = t->co;
+	while (c->state != CORO_DONE) {
+		if (c->state == CORO_RUNNING)
+			return sexpr_err(vm, "A task can't join itself or a task that's waiting on it.");
+
+		/* Inside a task we let the scheduler get on with it. Anywhere else
+			we are the scheduler. */
+		if (running && running->kind == CORO_TASK) {
+			enqueue(running);
+			suspend(running);
+			continue;
+		}
+
+		coro *n = dequeue();
+		if (!n)
+			return sexpr_err(vm, "The task can never finish.");
+
+		sexpr *err = resume(vm, n);
+		if (err)
+			return err;
+	}
+
+	return c->value;
+}
+
+/* To find values held only by a suspended coroutine's C stack, every word
+	on it is checked against the set of addresses of everything on the
+	heap. The set gets built the first time it's needed in a collection. */
+static _Thread_local uintptr_t *index_slots = NULL;
+static _Thread_local unsigned long index_cap = 0;
+static _Thread_local unsigned int index_gen = 0;
+static _Thread_local vm_heap *index_vm = NULL;
+
+static unsigned long ptr_hash(uintptr_t p) {
+	return (unsigned long)((p >> 4) * 0x9e3779b97f4a7c15UL);
+}
+
+static void build_index(vm_heap *vm) {
+	free(index_slots);
+
+	index_cap = 16;
+	while (index_cap < vm->count * 2)
+		index_cap *= 2;
+	index_slots = calloc(index_cap, sizeof(uintptr_t));
+
+	for (sexpr *h = vm->heap; h; h = h->neighbour) {
+		unsigned long j = ptr_hash((uintptr_t)h) & (index_cap - 1);
+		while (index_slots[j])
+			j = (j + 1) & (index_cap - 1);
+		index_slots[j] = (uintptr_t)h;
+	}
+
+	index_vm = vm;
+	index_gen = vm->gc_generation;
+}
+
+static int in_index(uintptr_t p) {
+	if (!p)
+		return 0;
+
+	unsigned long j = ptr_hash(p) & (index_cap - 1);
+	while (index_slots[j]) {
+		if (index_slots[j] == p)
+			return 1;
+		j = (j + 1) & (index_cap - 1);
+	}
+
+	return 0;
+}
+
+static void mark_word(void *data, uintptr_t w) {
+	if (in_index(w))
+		mark_chain(data, (sexpr*)w);
+}
+
+void coro_mark(vm_heap *vm, coro *c) {
+	mark_chain(vm, c->thunk);
+	if (c->value)
+		mark_chain(vm, c->value);
+
+	if (c->state != CORO_SUSPENDED)
+		return;
+
+	mark_calls(vm, c->calls);
+
+	if (index_vm != vm || index_gen != vm->gc_generation)
+		build_index(vm);
+	stack_ctx_scan(c->ctx, mark_word, vm);
+}
+
+void coro_mark_roots(vm_heap *vm) {
+	for (coro *c = ready_head; c; c = c->next_ready) {
+		if (c->vm == vm)
+			mark_chain(vm, c->self);
+	}
+}
+
+void load_coro_built_ins(scope *sc) {
+	scope_insert_var(sc, "make-generator", sexpr_fun_builtin(&builtin_make_generator, "make-generator"));
+	scope_insert_var(sc, "next", sexpr_fun_builtin(&builtin_next, "next"));
+	scope_insert_var(sc, "yield", sexpr_fun_builtin(&builtin_yield, "yield"));
+	scope_insert_var(sc, "spawn", sexpr_fun_builtin(&builtin_spawn, "spawn"));
+	scope_insert_var(sc, "join", sexpr_fun_builtin(&builtin_join, "join"));
+}
@@ -0,0 +1,51 @@
+#ifndef coro_h
+#define coro_h
+
+#include "fwd.h"
+#include "stack.h"
+
+/* Coroutines, all on one OS thread. Each one runs a thunk on a stack of its
+	own (see stack.h) and can stop part way through with yield and carry on
+	later from the same spot. They come in two flavours:
+
+	Generators are pulled on: (next g) runs g until it yields a value, and
+	that's what next hands back. Once the thunk returns, next gives back the
+	default it was passed, or the empty list.
+
+	Tasks are pushed along by a round-robin scheduler: (spawn thunk) puts
+	one on the run queue and (join t) runs queued tasks in turn until t
+	finishes, then gives back whatever its thunk returned. A task that
+	yields goes to the back of the queue. A (yield) outside of any
+	coroutine gives every waiting task one turn.
+
+	Switching between coroutines is a swapcontext, a few hundred ns, most
+	of which is the signal mask system call. */
+
+enum coro_kind { CORO_GENERATOR, CORO_TASK };
+enum coro_state { CORO_NEW, CORO_SUSPENDED, CORO_RUNNING, CORO_DONE };
+
+typedef struct coro {
+	enum coro_kind kind;
+	enum coro_state state;
+	vm_heap *vm;
+	scope *global;
+	sexpr *self; /* The LVAL_CORO that wraps this */
+	sexpr *thunk;
+	sexpr *value; /* Last value yielded, or the thunk's result once done */
+	stack_ctx *ctx;
+	stack_ctx *resumer; /* Where to go back to on a yield */
+
+	/* The evaluator's per-thread state, kept here while switched out */
+	struct call_state *calls;
+	struct continuation *escapes;
+	struct port *out; /* Its current output port */
+
+	struct coro *next_ready; /* Run queue */
+} coro;
+
+void coro_free(coro*);
+void coro_mark(vm_heap*, coro*);
+void coro_mark_roots(vm_heap*);
+void load_coro_built_ins(scope*);
+
+#endif
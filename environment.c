@@ -1,16 +1,27 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "sexpr.h"
+#include "coro.h"
 #include "environment.h"
+#include "futures.h"
+#include "hashcons.h"
+#include "hashtable.h"
+#include "image.h"
+#include "optimize.h"
+#include "memo.h"
 #include "util.h"
 
+/* Below this many s-exprs gc_maybe() doesn't bother */
+#define GC_MIN_THRESHOLD 100000
+
 sym* sym_new(char *name, sexpr* e) {
 	sym *b = malloc(sizeof(sym));
-	b->val = e;
-	b->next = NULL;
+	atomic_init(&b->val, e);
+	atomic_init(&b->next, NULL);
 
 	b->name = n_strcpy(b->name, name);
 
@@ -36,13 +47,32 @@ void sym_free(sym* b) {
 
 scope* scope_new(unsigned int size) {
 	scope *e = malloc(sizeof(scope));
-	e->sym_table = calloc(size, sizeof(sym*));
+	e->sym_table = calloc(size, sizeof(_Atomic(sym*)));
 	e->size = size;
 	e->parent = NULL;
 
 	return e;
 }
 
+/* A new scope with the same bindings as sc. The values themselves are
+	shared, it's only the table that's copied, so a define in one doesn't
+	show up in the other. */
+scope* scope_copy(scope *sc) {
+	scope *c = scope_new(sc->size);
+	c->parent = sc->parent;
+
+	for (unsigned int j = 0; j < sc->size; j++) {
+		_Atomic(sym*) *tail = &c->sym_table[j];
+		for (sym *b = sc->sym_table[j]; b; b = b->next) {
+			sym *n = sym_new(b->name, b->val);
+			atomic_init(tail, n);
+			tail = &n->next;
+		}
+	}
+
+	return c;
+}
+
 void scope_free(scope *sc) {
 	for (unsigned int j = 0; j < sc->size; j++) {
 		if (sc->sym_table[j])
@@ -54,48 +84,63 @@ void scope_free(scope *sc) {
 }
 
 
+/* The same polynomial in 163 as always, just worked out a step at a time
+	and unsigned, so a long name or one with bytes over 127 (which a symbol
+	read back from an image can have) can't make it negative */
 int bt_hash(unsigned int size, char *s) {
-	long h = 0;
-	int len = strlen(s);
+	unsigned long h = 0;
 
-	for (int j = 0; j < len; j++) {
-		h += (long)pow(163, len - (j+1)) * s[j];
-		h %= size;
-	}
+	for (; *s; s++)
+		h = (h * 163 + (unsigned char)*s) % size;
 
 	return h;
 }
 
+/* Only one thread ever adds to a given scope, but others may be reading
+	the global scope at the same time. New entries are filled in before the
+	release store that makes them visible. */
 void scope_insert_var(scope* sc, char *name, sexpr *exp) {
 	unsigned int h = bt_hash(sc->size, name);
-	sym *s = sym_new(name, exp);
+	sym *first = atomic_load_explicit(&sc->sym_table[h], memory_order_relaxed);
 
-	if (sc->sym_table[h] == NULL) {
-		/* Easy case! Just create the new entry and stick it there */
-		sc->sym_table[h] = s;
-	}
-	else {
-		/* A rebinding of the same name in the same scope should free up the
-			previous binding */
-		sym *existing = sc->sym_table[h];
-		while (existing) {
-			if (strcmp(existing->name, name) == 0) {
-				existing->val = s->val;
-				return;
-			}
-
-			existing = existing->next;
+	/* A rebinding of the same name in the same scope just swaps the value */
+	for (sym *existing = first; existing; existing = existing->next) {
+		if (strcmp(existing->name, name) == 0) {
+			atomic_store_explicit(&existing->val, exp, memory_order_release);
+			return;
 		}
+	}
+
+	sym *s = sym_new(name, exp);
+	atomic_init(&s->next, first);
+	atomic_store_explicit(&sc->sym_table[h], s, memory_order_release);
+}
 
-		s->next = sc->sym_table[h];
-		sc->sym_table[h] = s;
+/* Like scope_fetch_var() but it skips the global scope and gives back
+	NULL instead of an error if the name isn't bound locally */
+sexpr* scope_fetch_local(scope *sc, char *key) {
+	for (; sc && sc->parent; sc = sc->parent) {
+		sym *b = sc->sym_table[bt_hash(sc->size, key)];
+		while (b && strcmp(b->name, key) != 0)
+			b = b->next;
+
+		if (b)
+			return b->val;
 	}
+
+	return NULL;
 }
 
-void scope_insert_global_var(scope *sc, char *name, sexpr *exp) {
-	while (sc->parent)
-		sc = sc->parent;
-	scope_insert_var(sc, name, exp);
+/* Not bound in sc. Try its parent, or the image we started from if sc is
+	the global scope. */
+static sexpr* fetch_further(vm_heap *vm, scope *sc, char *key, char *msg) {
+	if (!sc->parent && vm && vm->image) {
+		sexpr *v = image_fetch(vm, sc, key);
+		if (v)
+			return v;
+	}
+
+	return CHECK_PARENT_SCOPE(vm, sc, key, msg);
 }
 
 sexpr* scope_fetch_var(vm_heap *vm, scope *sc, char* key) {
@@ -104,8 +149,7 @@ sexpr* scope_fetch_var(vm_heap *vm, scope *sc, char* key) {
 	if (!sc->sym_table[h]) {
 		char msg[256];
 		snprintf(msg, sizeof msg, "%s'%s'", "Unbound symbol: ", key);
-		sexpr *r = CHECK_PARENT_SCOPE(vm, sc, key, msg);
-		return r;
+		return fetch_further(vm, sc, key, msg);
 	}
 	sym *b = sc->sym_table[h];
 
@@ -119,11 +163,9 @@ sexpr* scope_fetch_var(vm_heap *vm, scope *sc, char* key) {
 	if (!b) {
 		char msg[256];
 		snprintf(msg, sizeof msg, "%s%s", "Unbound symbol: ", key);
-		return CHECK_PARENT_SCOPE(vm, sc, key, msg);
+		return fetch_further(vm, sc, key, msg);
 	}
 
-	b->val->global_scope = sc->parent ? 0 : 1;
-
 	return b->val;
 }
 
@@ -149,18 +191,77 @@ void env_dump(vm_heap *vm, scope* env) {
 vm_heap* vm_new(void) {
 	vm_heap *vm = malloc(sizeof(vm_heap));
 	vm->count = 0;
+	vm->gc_threshold = GC_MIN_THRESHOLD;
 	vm->gc_generation = 0;
 	vm->heap = NULL;
+	vm->hc = NULL;
+	vm->opt = optimizer_new();
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_init(&vm->incoming_lock, NULL);
+	vm->incoming = NULL;
+	vm->incoming_count = 0;
+	atomic_init(&vm->futures_pending, 0);
+	vm->roots = NULL;
+	vm->foreign = NULL;
+	vm->image = NULL;
+	vm->scopes = NULL;
+	vm->scope_count = 0;
+	vm->gray = NULL;
+	vm->gray_len = 0;
+	vm->gray_cap = 0;
+	vm->draining = 0;
 
 	return vm;
 }
 
+_Thread_local tlab *current_tlab = NULL;
+
 void vm_add(vm_heap* vm, sexpr* expr) {
+	tlab *t = current_tlab;
+	if (t) {
+		expr->neighbour = t->head;
+		t->head = expr;
+		if (!t->tail)
+			t->tail = expr;
+		t->count++;
+		return;
+	}
+
 	expr->neighbour = vm->heap;
 	vm->heap = expr;
 	vm->count++;
 }
 
+/* Hand a worker's allocations over to the VM. They join the heap proper
+	at the next collection. */
+void vm_publish(vm_heap *vm, tlab *t) {
+	if (!t->head)
+		return;
+
+	pthread_mutex_lock(&vm->incoming_lock);
+	t->tail->neighbour = vm->incoming;
+	vm->incoming = t->head;
+	vm->incoming_count += t->count;
+	pthread_mutex_unlock(&vm->incoming_lock);
+
+	t->head = t->tail = NULL;
+	t->count = 0;
+}
+
+void vm_lock(vm_heap *vm) {
+	pthread_mutex_lock(&vm->lock);
+}
+
+void vm_unlock(vm_heap *vm) {
+	pthread_mutex_unlock(&vm->lock);
+}
+
 void vm_free(vm_heap *vm) {
 	sexpr *node;
 
@@ -169,51 +270,151 @@ void vm_free(vm_heap *vm) {
 		vm->heap = vm->heap->neighbour;
 		sexpr_free(node);
 	}
+
+	while (vm->incoming) {
+		node = vm->incoming;
+		vm->incoming = vm->incoming->neighbour;
+		sexpr_free(node);
+	}
+
+	free(vm->scopes);
+	free(vm->gray);
+	if (vm->image)
+		image_close(vm->image);
+	if (vm->hc)
+		hc_free(vm->hc);
+	optimizer_free(vm->opt);
+	pthread_mutex_destroy(&vm->lock);
+	pthread_mutex_destroy(&vm->incoming_lock);
 }
 
-void mark_chain(vm_heap* vm, sexpr *chain) {
-	/* Bailing out if it has been marked avoids cycles in the graph of
-		connection objects */
-	if (chain->gen == vm->gc_generation)
-		return;
+/* Scopes other than the one handed to gc_run() whose bindings are live,
+	like the per-connection environments in server.c */
+void vm_add_scope(vm_heap *vm, scope *sc) {
+	vm->scopes = realloc(vm->scopes, (vm->scope_count + 1) * sizeof(scope*));
+	vm->scopes[vm->scope_count++] = sc;
+}
 
-	if (chain->type == LVAL_LIST && chain->count > 0) {
+void vm_remove_scope(vm_heap *vm, scope *sc) {
+	for (int j = 0; j < vm->scope_count; j++) {
+		if (vm->scopes[j] == sc) {
+			vm->scopes[j] = vm->scopes[--vm->scope_count];
+			break;
+		}
+	}
+}
+
+static void mark_children(vm_heap *vm, sexpr *chain) {
+	if (chain->type == LVAL_LIST) {
 		for (int j = 0; j < chain->count; j++)
 			mark_chain(vm, chain->children[j]);
+		if (chain->closure_info)
+			mark_chain(vm, chain->closure_info);
+		if (chain->shares)
+			mark_chain(vm, chain->shares);
 	}
 	else if (chain->type == LVAL_FUN && !chain->builtin) {
 		mark_chain(vm, chain->params);
 		mark_chain(vm, chain->body);
+		if (chain->captured)
+			mark_chain(vm, chain->captured);
+		if (chain->memo)
+			memo_mark(vm, chain->memo);
 	}
+	else if (chain->type == LVAL_HASH)
+		ht_mark(vm, chain->ht);
+	else if (chain->type == LVAL_CONST)
+		mark_chain(vm, chain->datum);
+	else if (chain->type == LVAL_CORO)
+		coro_mark(vm, chain->co);
+	else if (chain->type == LVAL_FUTURE)
+		future_mark(vm, chain->fut);
+}
 
+/* Marks chain and everything reachable from it. Anything marked gets
+	pushed onto vm->gray, and only the outermost call works through it, so
+	the calls that come back in here from mark_children() (and from
+	ht_mark(), coro_mark() and the like) just push and return. */
+void mark_chain(vm_heap* vm, sexpr *chain) {
+	/* Bailing out if it has been marked avoids cycles in the graph of
+		connection objects */
+	if (chain->gen == vm->gc_generation)
+		return;
+
+	/* Hash tables can end up containing themselves, so mark before
+		pushing */
 	chain->gen = vm->gc_generation;
+
+	if (vm->gray_len == vm->gray_cap) {
+		vm->gray_cap = vm->gray_cap ? vm->gray_cap * 2 : 256;
+		vm->gray = realloc(vm->gray, vm->gray_cap * sizeof(sexpr*));
+	}
+	vm->gray[vm->gray_len++] = chain;
+
+	if (vm->draining)
+		return;
+
+	vm->draining = 1;
+	while (vm->gray_len > 0)
+		mark_children(vm, vm->gray[--vm->gray_len]);
+	vm->draining = 0;
+}
+
+void mark_scope(vm_heap *vm, scope *sc) {
+	for (unsigned int j = 0; j < sc->size; j++) {
+		for (sym *s = sc->sym_table[j]; s; s = s->next)
+			mark_chain(vm, s->val);
+	}
 }
 
 /* The garbage collector is a simple mark-and-sweep algorithm. Loop through
 	the symbol table and mark off any s-expressions that are still in use,
 	then loop over the VM's heap linked list and prune any items whose
-	generation count is less than current generation.
+	generation count is less than current generation. Gives back how many
+	were freed, or -1 if it couldn't run just now.
 
 	Note -- built-in functions are stored in the symbol table but they aren't
 	in the heap so they won't be deleted by the garbage collector */
-void gc_run(vm_heap* vm, scope* env) {
+long gc_run(vm_heap* vm, scope* env) {
+	/* Worker threads are still adding to the heap and hold references we
+		can't see */
+	if (atomic_load(&vm->futures_pending) > 0)
+		return -1;
+
+	/* Bring in whatever finished futures allocated */
+	pthread_mutex_lock(&vm->incoming_lock);
+	while (vm->incoming) {
+		sexpr *next = vm->incoming->neighbour;
+		vm->incoming->neighbour = vm->heap;
+		vm->heap = vm->incoming;
+		vm->incoming = next;
+	}
+	vm->count += vm->incoming_count;
+	vm->incoming_count = 0;
+	pthread_mutex_unlock(&vm->incoming_lock);
+
 	vm->gc_generation++;
 
 	/* Need to pass over the entire symbol table and mark which objects
 		are still referenced. Don't bother marking built-ins because we are
 		never going to recycle them. */
-	for (unsigned int j = 0; j < env->size; j++) {
-		sym *s = env->sym_table[j];
+	mark_scope(vm, env);
+	for (int j = 0; j < vm->scope_count; j++)
+		mark_scope(vm, vm->scopes[j]);
+	if (vm->roots)
+		mark_chain(vm, vm->roots);
 
-		while (s) {
-			mark_chain(vm, s->val);
-			s = s->next;
-		}
-	}
+	/* Spawned tasks waiting for their turn are live even if nothing else
+		refers to them */
+	coro_mark_roots(vm);
+
+	/* The hash-consing table doesn't count as a reference, but it has to
+		forget about anything we're about to free */
+	hc_prune(vm);
 
 	sexpr *dead, *prev = NULL;
 	sexpr *h = vm->heap;
-	int swept = 0;
+	long swept = 0;
 	while (h) {
 		if (h->gen < vm->gc_generation) {
 			dead = h;
@@ -234,5 +435,24 @@ void gc_run(vm_heap* vm, scope* env) {
 		}
 	}
 
-	printf("%d s-exprs deleted.\n", swept);
+	return swept;
+}
+
+/* Collect only if the heap has grown enough since last time to be worth
+	it. The threshold is twice what survived the last collection, so the
+	time spent collecting stays in proportion to the time spent allocating.
+	Like gc_run() it's only safe between top-level expressions, since values
+	that are only on the C stack aren't marked. */
+long gc_maybe(vm_heap *vm, scope *env) {
+	if (vm->count < vm->gc_threshold)
+		return 0;
+
+	long swept = gc_run(vm, env);
+	if (swept >= 0) {
+		vm->gc_threshold = vm->count * 2;
+		if (vm->gc_threshold < GC_MIN_THRESHOLD)
+			vm->gc_threshold = GC_MIN_THRESHOLD;
+	}
+
+	return swept;
 }
@@ -1,14 +1,20 @@
 #ifndef environment_h
 #define environment_h
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "fwd.h"
 #include "sexpr.h"
 
+/* Futures (see futures.h) look things up in the global scope while the
+	REPL may be defining new things in it, so bindings are published with
+	atomic stores and readers never need a lock */
 typedef struct sym {
 	int hash_val;
 	char *name;
-	struct sexpr *val;
-	struct sym *next;
+	_Atomic(struct sexpr*) val;
+	_Atomic(struct sym*) next;
 } sym;
 
 sym* sym_new(char*, sexpr*);
@@ -17,15 +23,17 @@ void sym_free(sym*);
 
 /* Not sure if scope or sym_table will be a better name for this in the end */
 struct scope {
-	struct sym **sym_table;
+	_Atomic(struct sym*) *sym_table;
 	scope *parent;
 	unsigned int size;
 };
 
 scope* scope_new(unsigned int size);
+int bt_hash(unsigned int, char*);
+scope* scope_copy(scope*);
 void scope_free(scope*);
 void scope_insert_var(scope*, char*, sexpr*);
-void scope_insert_global_var(scope*, char*, sexpr*);
+sexpr* scope_fetch_local(scope*, char*);
 sexpr* scope_fetch_var(vm_heap*, scope*, char*);
 void env_dump(vm_heap*, scope*);
 
@@ -40,11 +48,73 @@ struct vm_heap {
 	sexpr *heap;
 	unsigned int gc_generation;
 	unsigned long count;
+	/* gc_maybe() collects once count gets this high */
+	unsigned long gc_threshold;
+	struct hc_table *hc; /* Hash-consing table, NULL until it's switched on */
+	struct optimizer *opt;
+
+	/* Held while touching things that are shared between threads and
+		cached on the fly: the optimizer, the hash-consing table and the
+		analysis cached on function bodies. It's recursive since folding a
+		constant can end up back in any of them. */
+	pthread_mutex_t lock;
+
+	/* Worker threads don't add to heap directly. Each future allocates
+		onto a list of its own (see tlab below) which gets handed over here
+		once it's done, and the GC splices it in. */
+	pthread_mutex_t incoming_lock;
+	sexpr *incoming;
+	unsigned long incoming_count;
+
+	/* Futures that haven't finished yet. The GC stays out of the way
+		while there are any. */
+	atomic_long futures_pending;
+
+	/* A list of values an embedding program has asked us to keep alive,
+		and the C functions it has added (see notion.h and api.c) */
+	sexpr *roots;
+	struct foreign_fn *foreign;
+
+	/* The image we started from, if any. Globals that aren't bound yet
+		are looked for in it (see image.h). */
+	struct image *image;
+
+	/* More scopes for the GC to mark, see vm_add_scope() */
+	scope **scopes;
+	int scope_count;
+
+	/* Marked values whose children haven't been marked yet. Marking works
+		through this rather than recursing, so a deeply nested list can't
+		run the GC off the C stack. draining is set while it's being worked
+		through. */
+	sexpr **gray;
+	size_t gray_len;
+	size_t gray_cap;
+	int draining;
 };
 
+/* A thread-local allocation list. While a worker thread is running a
+	future, everything it allocates goes on the future's own list, so there's
+	no contention over vm->heap. */
+typedef struct tlab {
+	sexpr *head;
+	sexpr *tail;
+	unsigned long count;
+} tlab;
+
+extern _Thread_local tlab *current_tlab;
+
 vm_heap* vm_new(void);
 void vm_add(vm_heap*, sexpr*);
-void gc_run(vm_heap*, scope*);
+void vm_publish(vm_heap*, tlab*);
+void vm_lock(vm_heap*);
+void vm_unlock(vm_heap*);
+void vm_add_scope(vm_heap*, scope*);
+void vm_remove_scope(vm_heap*, scope*);
+void mark_chain(vm_heap*, sexpr*);
+void mark_scope(vm_heap*, scope*);
+long gc_run(vm_heap*, scope*);
+long gc_maybe(vm_heap*, scope*);
 void vm_free(vm_heap*);
 
 #endif
@@ -1,33 +1,31 @@
 #include <stdio.h>
 #include <math.h>
+#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "coro.h"
+#include "futures.h"
 #include "evaluator.h"
+#include "fasl.h"
 #include "environment.h"
+#include "hashcons.h"
+#include "hashtable.h"
+#include "image.h"
+#include "interp.h"
+#include "memo.h"
+#include "nstring.h"
+#include "numvec.h"
+#include "optimize.h"
+#include "printer.h"
 #include "sexpr.h"
 #include "parser.h"
+#include "stack.h"
 #include "util.h"
 
 #define CLOSURE_TABLE_SIZE 47
 
-/* I need variable names for things like closures. They need to be unique and
-	they are only used internally so integers should work fine. (An integer
-	isn't an invalid symbol name so they should never conflict with other
-	bound symbols */
-sexpr* gen_private_var_name(vm_heap *vm, scope *sc) {
-	char buffer[50];
-	sexpr *e = sexpr_null();
-
-	while (e->type != LVAL_ERR) {
-		int n = rand();
-		sprintf(buffer, "%d", n);
-		e = scope_fetch_var(vm, sc, buffer);
-	}
-
-	return sexpr_sym(vm, buffer);
-}
-
 int is_zero(sexpr *num) {
 	if (num->num_type == NUM_TYPE_INT)
 		return num->i_num == 0;
@@ -36,6 +34,10 @@ int is_zero(sexpr *num) {
 }
 
 int sexpr_cmp(sexpr *s1, sexpr *s2) {
+	/* Cheap win for shared structure (hash-consed data in particular) */
+	if (s1 == s2)
+		return 1;
+
 	if (s1->type != s2->type)
 		return 0;
 
@@ -71,11 +73,27 @@ int sexpr_cmp(sexpr *s1, sexpr *s2) {
 
 			break;
 		case LVAL_FUN:
-			if (s1->fun != s2->fun)
+			/* User-defined functions all have a NULL fun pointer */
+			if (s1->builtin ? s1->fun != s2->fun : s1 != s2)
 				return 0;
 			break;
 		case LVAL_STR:
-			return strcmp(s1->str, s2->str) == 0 ? 1 : 0;
+			return s1->len == s2->len && memcmp(s1->str, s2->str, s1->len) == 0;
+		case LVAL_NUMVEC:
+			if (s1->num_type != s2->num_type || s1->count != s2->count)
+				return 0;
+			if (s1->num_type == NUM_TYPE_DEC)
+				return memcmp(s1->f64, s2->f64, s1->count * sizeof(double)) == 0;
+			return memcmp(s1->s64, s2->s64, s1->count * sizeof(int64_t)) == 0;
+		case LVAL_STRBUILDER:
+		case LVAL_HASH:
+		case LVAL_CONT:
+		case LVAL_CORO:
+		case LVAL_FUTURE:
+		case LVAL_CHANNEL:
+			return s1 == s2;
+		case LVAL_CONST:
+			return sexpr_cmp(s1->datum, s2->datum);
 		case LVAL_NULL:
 			return 1;
 	}
@@ -96,32 +114,31 @@ int sexpr_cmp(sexpr *s1, sexpr *s2) {
 
 	I could always seek out the global scope when load is called, but tbh
 	I'm not sure which behaviour is correct/better.
+
+	The parsed forms come from the file's fast-load cache when it's fresh
+	(see fasl.h), so usually it's only evaluating that takes any time.
 */
 sexpr* builtin_load(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 2, "Load expects only the filename to be loaded.");
 	ASSERT_TYPE(nodes[1], LVAL_STR, "Filename must be a string constant.");
 
-    tokenizer *tk = tokenizer_new();
-	if (!start_file(tk, nodes[1]->str)) {
-		tokenizer_free(tk);
-		return sexpr_err(vm, "File not found.");
-	}
+	scope *global = env;
+	while (global->parent)
+		global = global->parent;
 
-	parser *p = parser_new(tk);
-	sexpr* ast = get_next_expr(vm, p);
-    while (ast->type != LVAL_NULL)
-    {
-		sexpr *result = eval2(vm, env, ast);
+	char *filename = nstr_cstr(nodes[1]->str, nodes[1]->len);
+	sexpr *forms = fasl_forms(vm, global, filename);
+	free(filename);
+	ASSERT_NOT_ERR(forms);
+
+	for (int j = 0; j < forms->count; j++) {
+		sexpr *ast = forms->children[j];
+		sexpr *result = eval2(vm, env, optimize(vm, env, ast));
 		if (result->type != LVAL_NULL) {
-			sexpr_pprint(result);
-			putchar('\n');
+			out_print(result, 0);
+			out_write("\n", 1);
 		}
-
-		ast = get_next_expr(vm, p);
-    }
-
-	tokenizer_free(tk);
-	parser_free(p);
+	}
 
 	return sexpr_null();
 }
@@ -384,10 +401,12 @@ sexpr* builtin_cdr(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 		return sexpr_err(vm, "cdr is defined only for non-empty lists.");
 	}
 
+	/* Lists don't change once they're built so rather than copying, the
+		result borrows the tail of l's array */
 	sexpr *result = sexpr_list(vm);
-	for (int j = 1; j < l->count; j++) {
-		sexpr_append(result, l->children[j]);
-	}
+	result->children = l->children + 1;
+	result->count = l->count - 1;
+	result->shares = l->shares ? l->shares : l;
 
 	return result;
 }
@@ -407,16 +426,21 @@ sexpr* builtin_car(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 sexpr* builtin_cons(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 3, "cons expects two aruments");
 
-	sexpr *a2 = eval2(vm, env, nodes[2]);
+	/* The head is evaluated first, to match the way eval_user_func()
+		handles (cons x (f ...)) */
+	sexpr *a1 = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(a1);
 
+	sexpr *a2 = eval2(vm, env, nodes[2]);
 	ASSERT_NOT_ERR(a2);
 	ASSERT_TYPE(a2, LVAL_LIST, "The second argument of cons must be a list.");
 
 	sexpr *result = sexpr_list(vm);
-	sexpr_append(result, eval2(vm, env, nodes[1]));
-
+	result->count = a2->count + 1;
+	result->children = malloc(result->count * sizeof(sexpr*));
+	result->children[0] = a1;
 	for (int j = 0; j < a2->count; j++) {
-		sexpr_append(result, a2->children[j]);
+		result->children[j + 1] = a2->children[j];
 	}
 
 	return result;
@@ -443,6 +467,26 @@ sexpr* builtin_numberq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *
 /* eq? as defined in the Little Schemer operates only on non-numeric atoms,
 		but Scheme implementations I've seen accept broader inputs. I'm going to
 		stick to the Little Schemer "standard" for now */
+int sexpr_eq(sexpr *a, sexpr *b) {
+	if (a->type == LVAL_BOOL && b->type == LVAL_BOOL && a->bool == b->bool)
+		return 1;
+	else if (a->type == LVAL_SYM && b->type == LVAL_SYM && strcmp(a->sym, b->sym) == 0)
+		return 1;
+	else if (a->type == LVAL_STR && b->type == LVAL_STR && a->len == b->len
+			&& memcmp(a->str, b->str, a->len) == 0)
+		return 1;
+	else if (a->type == LVAL_NUM && b->type == LVAL_NUM && a->num_type == b->num_type) {
+		if (a->num_type == NUM_TYPE_INT && a->i_num == b->i_num)
+			return 1;
+		else if (a->num_type == NUM_TYPE_DEC && fabs(a->d_num - b->d_num) < 0.0000001)
+			return 1;
+		else
+			return 0;
+	}
+
+	return a == b;
+}
+
 sexpr* builtin_eq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 3, "eq? expects exactly 2 arguments.");
 
@@ -451,24 +495,7 @@ sexpr* builtin_eq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	sexpr *b = eval2(vm, env, nodes[2]);
 	ASSERT_NOT_ERR(b);
 
-	if (a->type == LVAL_BOOL && b->type == LVAL_BOOL && a->bool == b->bool)
-		return sexpr_bool(vm, 1);
-	else if (a->type == LVAL_SYM && b->type == LVAL_SYM && strcmp(a->sym, b->sym) == 0)
-		return sexpr_bool(vm, 1);
-	else if (a->type == LVAL_STR && b->type == LVAL_STR && strcmp(a->str, b->str) == 0)
-		return sexpr_bool(vm, 1);
-	else if (a->type == LVAL_NUM && b->type == LVAL_NUM && a->num_type == b->num_type) {
-		if (a->num_type == NUM_TYPE_INT && a->i_num == b->i_num)
-			return sexpr_bool(vm, 1);
-		else if (a->num_type == NUM_TYPE_DEC && fabs(a->d_num - b->d_num) < 0.0000001)
-			return sexpr_bool(vm, 1);
-		else
-			return sexpr_bool(vm, 0);
-	}
-	else if (a == b)
-		return sexpr_bool(vm, 1);
-	else
-		return sexpr_bool(vm, 0);
+	return sexpr_bool(vm, sexpr_eq(a, b));
 }
 
 sexpr* builtin_eval(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
@@ -480,12 +507,40 @@ sexpr* builtin_eval(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 	return f;
 }
 
+static double wall_ms(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* (time expr) evaluates expr, reports how long it took and hands back the
+	result. Mainly so I can compare approaches without leaving the REPL.
+	Wall clock time is what matters once futures are spreading work over
+	several cores. CPU time is the total over all of them. */
+sexpr* builtin_time(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "time expects just 1 argument");
+
+	double start = wall_ms();
+	clock_t cpu_start = clock();
+	sexpr *result = eval2(vm, env, nodes[1]);
+	double cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+	/* To the current port, so with-output-to-string catches it too */
+	char buf[128];
+	int n = snprintf(buf, sizeof buf, "Elapsed: %.3f ms (CPU %.3f ms)\n",
+		wall_ms() - start, cpu * 1000.0);
+	out_write(buf, n < (int)sizeof buf ? n : sizeof buf - 1);
+
+	return result;
+}
+
 sexpr* builtin_quit(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	return sexpr_err(vm, "<quit>");
 }
 
 sexpr* quote_form(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
-	return nodes[1];
+	return hc_intern(vm, nodes[1]);
 }
 
 int is_quoted_val(sexpr *v) {
@@ -523,23 +578,36 @@ sexpr* build_func_stmt(vm_heap *vm, sexpr *header, sexpr *body, char *name) {
 	return sexpr_fun_user(vm, params, body, name);
 }
 
-sexpr* builtin_if(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+/* if and cond are split in two so that eval_user_func() can evaluate the
+	chosen branch itself, as a tail call. These pick the expression to
+	evaluate next and store it in *next, returning NULL. If there's nothing
+	left to evaluate (an error, or a cond where no test passed) they return
+	the result instead. */
+static sexpr* if_branch(vm_heap *vm, scope *env, sexpr **nodes, int count, sexpr **next) {
 	ASSERT_PARAM_EQ(count, 4, "If is of the form (if <pred> <consequent> <alternate>.");
 
 	sexpr *result = eval2(vm, env, nodes[1]);
 	if (result->type == LVAL_ERR)
 		return result;
-	else if (result->type == LVAL_BOOL) {
-		return result->bool ? eval2(vm, env, nodes[2]) : eval2(vm, env, nodes[3]);
-	}
+	else if (result->type == LVAL_BOOL)
+		*next = result->bool ? nodes[2] : nodes[3];
 	else {
 		// Evidently, a non-boolean value is considered true so:
 		// (if (+ 1 2 3) 17 8) would have 17 for a result
-		return eval2(vm, env, nodes[2]);
+		*next = nodes[2];
 	}
+
+	return NULL;
 }
 
-sexpr* builtin_cond(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+sexpr* builtin_if(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	sexpr *next;
+	sexpr *result = if_branch(vm, env, nodes, count, &next);
+
+	return result ? result : eval2(vm, env, next);
+}
+
+static sexpr* cond_branch(vm_heap *vm, scope *env, sexpr **nodes, int count, sexpr **next) {
 	ASSERT_PARAM_MIN(count, 2, "Cond requires at least one expression.");
 
 	for (int j = 1; j < count; j++) {
@@ -556,7 +624,8 @@ sexpr* builtin_cond(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 
 			if (IS_ELSE_CLAUSE(j, count, cond->children[0]))
 			{
-				return eval2(vm, env, cond->children[1]);
+				*next = cond->children[1];
+				return NULL;
 			}
 
 			sexpr *result = eval2(vm, env, cond->children[0]);
@@ -566,8 +635,10 @@ sexpr* builtin_cond(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 				return sexpr_err(vm, "Invalid boolean test.");
 			}
 
-			if (result->bool)
-				return eval2(vm, env, cond->children[1]);
+			if (result->bool) {
+				*next = cond->children[1];
+				return NULL;
+			}
 		}
 		else
 			return sexpr_err(vm, "Cond tests must be an expression.");
@@ -576,6 +647,27 @@ sexpr* builtin_cond(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op)
 	return sexpr_null();
 }
 
+sexpr* builtin_cond(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	sexpr *next;
+	sexpr *result = cond_branch(vm, env, nodes, count, &next);
+
+	return result ? result : eval2(vm, env, next);
+}
+
+/* (begin e1 e2 ...) evaluates each expression in turn and gives back the
+	value of the last one. Only useful for side effects, which until yield
+	came along there weren't many of. */
+sexpr* builtin_begin(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	sexpr *result = sexpr_null();
+
+	for (int j = 1; j < count; j++) {
+		result = eval2(vm, env, nodes[j]);
+		ASSERT_NOT_ERR(result);
+	}
+
+	return result;
+}
+
 sexpr* builtin_stringq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 2, "String? takes just one paramter.");
 
@@ -590,7 +682,7 @@ sexpr* builtin_stringlen(vm_heap *vm, scope *env, sexpr **nodes, int count, char
 	sexpr *s = eval2(vm, env, nodes[1]);
 	ASSERT_TYPE(s, LVAL_STR, "That was not a string.");
 
-	return sexpr_num(vm, NUM_TYPE_INT, strlen(s->str));
+	return sexpr_num(vm, NUM_TYPE_INT, s->len);
 }
 
 sexpr* builtin_string(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
@@ -602,6 +694,8 @@ sexpr* builtin_string(vm_heap *vm, scope *env, sexpr **nodes, int count, char *o
 	return src;
 }
 
+/* See nstring.h for why this is amortized linear when a string is built
+	up by repeatedly appending onto the end of it */
 sexpr* builtin_stringappend(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 3, "String-append takse just two paramters");
 
@@ -610,35 +704,12 @@ sexpr* builtin_stringappend(vm_heap *vm, scope *env, sexpr **nodes, int count, c
 	sexpr *s2 = eval2(vm, env, nodes[2]);
 	ASSERT_NOT_ERR(s2);
 
-	sexpr *result;
-	if (s1->type != LVAL_STR || s2->type != LVAL_STR) {
-		result = sexpr_err(vm, "String-append requiers two strings.");
-	}
-	else {
-		/* s1 and s2 are strings, but their values could be NULL */
-		int len = 1 + (s1 ? strlen(s1->str) : 0);
-		len += s2 ? strlen(s2->str) : 0;
-
-		/* Competent C coders are probably recoiling in horror
-			from this next bit... */
-		result = sexpr_str(vm, NULL);
-		result->str = malloc(len);
-		result->str[len - 1] = '\0';
-
-		int j = 0;
-		char *c = s1->str;
-		while (c && *c != '\0') {
-			result->str[j++] = *c;
-			++c;
-		}
-		c = s2->str;
-		while (c && *c != '\0') {
-			result->str[j++] = *c;
-			++c;
-		}
-	}
+	if (s1->type != LVAL_STR || s2->type != LVAL_STR)
+		return sexpr_err(vm, "String-append requiers two strings.");
 
-	return result;
+	char *data = nstr_append(s1->str, s1->len, s2->str, s2->len);
+
+	return sexpr_str_shared(vm, data, s1->len + s2->len);
 }
 
 sexpr* builtin_stringcopy(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
@@ -651,63 +722,209 @@ sexpr* builtin_stringcopy(vm_heap *vm, scope *env, sexpr **nodes, int count, cha
 	return sexpr_copy(vm, s1);
 }
 
-int is_local_param(sexpr *params, sexpr* sym) {
-	for (int j = 0; j < params->count; j++) {
-		sexpr *p = params->children[j];
-		if (p->sym && sym->sym && strcmp(p->sym, sym->sym) == 0)
-			return 1;
+sexpr* builtin_make_strbuilder(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 1, "make-string-builder takes no parameters.");
+
+	return sexpr_strbuilder(vm);
+}
+
+/* (string-builder-append! b s ...) adds the strings onto the end of the
+	builder. The builder's block grows by doubling so this is amortized
+	linear in the bytes added. */
+sexpr* builtin_strbuilder_append(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 2, "Expected a string builder.");
+
+	sexpr *b = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(b);
+	ASSERT_TYPE(b, LVAL_STRBUILDER, "Expected a string builder.");
+
+	for (int j = 2; j < count; j++) {
+		sexpr *s = eval2(vm, env, nodes[j]);
+		ASSERT_NOT_ERR(s);
+		ASSERT_TYPE(s, LVAL_STR, "Only strings can be added to a string builder.");
+
+		char *data = nstr_append(b->str, b->len, s->str, s->len);
+		nstr_unref(b->str);
+		b->str = data;
+		b->len += s->len;
+	}
+
+	return sexpr_null();
+}
+
+sexpr* builtin_strbuilder_length(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a string builder.");
+
+	sexpr *b = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(b);
+	ASSERT_TYPE(b, LVAL_STRBUILDER, "Expected a string builder.");
+
+	return sexpr_num(vm, NUM_TYPE_INT, b->len);
+}
+
+/* The builder already holds its contents in one flat block, so the string
+	it produces just shares that block. Later appends to the builder go past
+	the string's length and never disturb it. */
+sexpr* builtin_strbuilder_to_string(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a string builder.");
+
+	sexpr *b = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(b);
+	ASSERT_TYPE(b, LVAL_STRBUILDER, "Expected a string builder.");
+
+	return sexpr_str_shared(vm, nstr_ref(b->str), b->len);
+}
+
+/* Closures
+
+	A function made inside another function's call can refer to that call's
+	parameters after the call has returned, so when the function is built
+	we copy the values of its free variables that live in a local scope
+	into a flat list of (name value name value ...) pairs hung off the
+	function. Calling it puts them into the new local scope alongside the
+	parameters. Nothing is ever reassigned in place (there's no set!), so
+	a copy of the value is as good as a reference to the frame.
+
+	Which variables are free depends only on the parameters and body, so
+	that's worked out once per lambda body and cached on the body (see
+	analyse_body()). Making a closure then only costs a lookup per free
+	variable. */
+
+typedef struct bound_names {
+	sexpr *params;
+	int first; /* Index of the first parameter in params */
+	struct bound_names *outer;
+} bound_names;
+
+static int is_bound(bound_names *b, char *name) {
+	for (; b; b = b->outer) {
+		for (int j = b->first; j < b->params->count; j++) {
+			sexpr *p = b->params->children[j];
+			if (p->type == LVAL_SYM && strcmp(p->sym, name) == 0)
+				return 1;
+		}
 	}
 
 	return 0;
 }
 
-/* Scan for any values that are going to become unbound and thus I need to keep
-	copies of. For instance, the parameters of nested lambda calls. If I find
-	a value stored in a local scope, replace the symbol in the expression with
-	a randomly generated, unique variable name. Then, it lives on the global
-	scope as long as the function exists.
- */
-sexpr* scan_for_closures(vm_heap *vm, scope *env, sexpr *params, sexpr *body) {
-	for (int j = 0; j < body->count; j++) {
-		sexpr *var = body->children[j];
+static int is_head(sexpr *v, char *name) {
+	return v->type == LVAL_LIST && v->count > 0
+		&& v->children[0]->type == LVAL_SYM
+		&& strcmp(v->children[0]->sym, name) == 0;
+}
 
-		if (var->type == LVAL_SYM) {
-			if (is_local_param(params, var))
-				continue;
+static void find_free_vars(sexpr *v, bound_names *bound, sexpr *found) {
+	if (v->type == LVAL_SYM) {
+		if (is_bound(bound, v->sym))
+			return;
 
-			sexpr *f = scope_fetch_var(vm, env, var->sym);
-			if (f->type != LVAL_ERR && !f->global_scope) {
-				sexpr *cv = gen_private_var_name(vm, env);
-				scope_insert_global_var(env, cv->sym, f);
-				body->children[j] = cv;
-			}
+		for (int j = 2; j < found->count; j++) {
+			if (strcmp(found->children[j]->sym, v->sym) == 0)
+				return;
+		}
+		sexpr_append(found, v);
+	}
+	else if (v->type == LVAL_LIST) {
+		if (is_head(v, "quote"))
+			return;
+
+		/* Nested functions bring their own parameters into scope */
+		if (is_head(v, "lambda") && v->count == 3 && v->children[1]->type == LVAL_LIST) {
+			bound_names inner = { v->children[1], 0, bound };
+			find_free_vars(v->children[2], &inner, found);
+			return;
 		}
-		else if (var->type == LVAL_LIST) {
-			body->children[j] = scan_for_closures(vm, env, params, var);
+
+		if (is_head(v, "define") && v->count > 2 && v->children[1]->type == LVAL_LIST) {
+			bound_names inner = { v->children[1], 0, bound };
+			for (int j = 2; j < v->count; j++)
+				find_free_vars(v->children[j], &inner, found);
+			return;
 		}
+
+		for (int j = 0; j < v->count; j++)
+			find_free_vars(v->children[j], bound, found);
+	}
+}
+
+/* Everything lambda and define need to know about a body that doesn't
+	change from one evaluation to the next: the optimized body and its free
+	variables. It's kept as (params optimized-body free-var ...) and cached
+	on the original body, so evaluating the same lambda again costs nothing
+	but the closure itself.
+
+	Futures can be making closures from the same body at the same time, so
+	the analysis happens under the VM's lock and is only published once
+	it's complete. Finding it already cached doesn't need the lock. */
+static sexpr* cached_info(sexpr *params, sexpr *body) {
+	if (body->type != LVAL_LIST)
+		return NULL;
+
+	sexpr *info = atomic_load_explicit(&body->closure_info, memory_order_acquire);
+
+	return info && info->children[0] == params ? info : NULL;
+}
+
+static sexpr* analyse_body(vm_heap *vm, scope *env, sexpr *params, int first, sexpr *body) {
+	sexpr *info = cached_info(params, body);
+	if (info)
+		return info;
+
+	vm_lock(vm);
+
+	info = cached_info(params, body);
+	if (!info) {
+		info = sexpr_list(vm);
+		sexpr_append(info, params);
+		sexpr_append(info, optimize_body(vm, env, params, body));
+
+		bound_names bound = { params, first, NULL };
+		find_free_vars(info->children[1], &bound, info);
+
+		if (body->type == LVAL_LIST)
+			atomic_store_explicit(&body->closure_info, info, memory_order_release);
 	}
 
-	return body;
+	vm_unlock(vm);
+
+	return info;
 }
 
+/* Collect the values of any free variables bound in a local scope.
+	Functions made at the top level have nothing to capture. */
+static sexpr* capture_free_vars(vm_heap *vm, scope *env, sexpr *info) {
+	if (!env->parent)
+		return NULL;
+
+	sexpr *captured = NULL;
+
+	for (int j = 2; j < info->count; j++) {
+		sexpr *val = scope_fetch_local(env, info->children[j]->sym);
+		if (!val)
+			continue;
+
+		if (!captured)
+			captured = sexpr_list(vm);
+		sexpr_append(captured, info->children[j]);
+		sexpr_append(captured, val);
+	}
+
+	return captured;
+}
+
+/* Function bodies and parameter lists are never modified once parsed, so
+	the function just points at the ones in the lambda expression */
 sexpr* builtin_lambda(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
 	ASSERT_PARAM_EQ(count, 3, "Invalid lambda definition.");
+	ASSERT_TYPE(nodes[1], LVAL_LIST, "Invalid lambda definition.");
 
-	/* So function evaluation excepts the paramter list for function
-		calls to include the function name, so gotta add in a dummy
-		value for lambdas */
-	sexpr *params = sexpr_list(vm);
-	sexpr_append(params, sexpr_null());
 	for (int j = 0; j < nodes[1]->count; j++)
-		sexpr_append(params, sexpr_copy(vm, nodes[1]->children[j]));
-	sexpr *body = sexpr_copy(vm, nodes[2]);
-
-	if (params->count == 0)
-		return sexpr_err(vm, "Invalid definition.");
+		ASSERT_TYPE(nodes[1]->children[j], LVAL_SYM, "Paramter names must be symbols.");
 
-	body = scan_for_closures(vm, env, params, body);
-
-	sexpr *lambda = build_func_stmt(vm, params, body, "");
+	sexpr *info = analyse_body(vm, env, nodes[1], 0, nodes[2]);
+	sexpr *lambda = sexpr_fun_user(vm, nodes[1], info->children[1], "");
+	lambda->captured = capture_free_vars(vm, env, info);
 
 	return lambda;
 }
@@ -720,11 +937,19 @@ sexpr* define_fun(vm_heap *vm, scope *sc, sexpr **nodes, int count, char *op)  {
 	sexpr *fun;	
 
 	for (int j = 2; j < count; j++ ) {
-		sexpr *child = nodes[j]->children[0];	
-		if (child->type == LVAL_SYM && strcmp(child->sym, "define") == 0) 
-			fun = define_fun(vm, sc, nodes[j]->children, nodes[j]->count, op);
-		else 
-			fun = build_func_stmt(vm, header, nodes[j], fun_name);
+		sexpr *info = analyse_body(vm, sc, header, 1, nodes[j]);
+		sexpr *body = info->children[1];
+
+		/* The body may be a lone atom, especially once it's been through
+			the optimizer */
+		sexpr *child = body->type == LVAL_LIST && body->count > 0 ? body->children[0] : NULL;
+		if (child && child->type == LVAL_SYM && strcmp(child->sym, "define") == 0) 
+			fun = define_fun(vm, sc, body->children, body->count, op);
+		else {
+			fun = build_func_stmt(vm, header, body, fun_name);
+			if (fun->type != LVAL_ERR)
+				fun->captured = capture_free_vars(vm, sc, info);
+		}
 			
 		if (fun->type == LVAL_ERR)
 			return fun;
@@ -750,83 +975,457 @@ sexpr* define(vm_heap *vm, scope *sc, sexpr **nodes, int count, char *op) {
 		return sexpr_err(vm, "Define: symbol or list expected.");	
 }
 
-sexpr* eval_user_func(vm_heap *vm, scope *sc, sexpr **operands, int count, sexpr *fun) {
-	ASSERT_PARAM_MIN(count - 1, fun->params->count, "Too few paramters passed to function.");
+/* Work out which function the head of a call refers to */
+static sexpr* call_target(vm_heap *vm, scope *sc, sexpr *head) {
+	sexpr *func = sexpr_null();
+	if (head->type == LVAL_SYM) {
+		func = scope_fetch_var(vm, sc, head->sym);
+		while (func->type == LVAL_SYM)
+			func = scope_fetch_var(vm, sc, func->sym);
+	}
+	else if (head->type == LVAL_LIST) {
+		func = eval2(vm, sc, head);
+	}
+	else if (head->type == LVAL_FUN || head->type == LVAL_CONT) {
+		/* Calls put together by apply_fun() */
+		func = head;
+	}
+
+	if (func->type != LVAL_FUN && func->type != LVAL_CONT) {
+		char msg[1024];
+		char *desc = sexpr_desc(func);
+		snprintf(msg, sizeof msg, "%s%s", "Expected function. Instead got: ", desc);
+		sexpr *err = sexpr_err(vm, msg);
+		free(desc);
+		return err;
+	}
+
+	return func;
+}
+
+typedef struct pending_heads {
+	sexpr **items;
+	size_t count;
+	size_t cap;
+} pending_heads;
+
+static void push_head(pending_heads *h, sexpr *v) {
+	if (h->count == h->cap) {
+		h->cap = h->cap ? h->cap * 2 : 16;
+		h->items = realloc(h->items, h->cap * sizeof(sexpr*));
+	}
+
+	h->items[h->count++] = v;
+}
+
+/* Put the heads saved up by tail calls inside cons onto the front of the
+	final result, which is what all those conses would have done */
+static sexpr* finish_heads(vm_heap *vm, pending_heads *h, sexpr *result) {
+	if (h->count == 0 || result->type == LVAL_ERR)
+		return result;
+
+	if (result->type != LVAL_LIST)
+		return sexpr_err(vm, "The second argument of cons must be a list.");
 
+	sexpr *l = sexpr_list(vm);
+	l->count = h->count + result->count;
+	l->children = malloc(l->count * sizeof(sexpr*));
+	memcpy(l->children, h->items, h->count * sizeof(sexpr*));
+	if (result->count > 0)
+		memcpy(l->children + h->count, result->children, result->count * sizeof(sexpr*));
+
+	return l;
+}
+
+/* The things a call to a user function has malloc'd that the GC doesn't
+	know about. They're chained together so escaping through a continuation
+	can free the ones belonging to the calls it jumps out of. */
+typedef struct call_state {
+	scope *frame;
+	scope *binding; /* The scope bind_args() is in the middle of filling */
+	pending_heads heads;
+	struct call_state *below;
+} call_state;
+
+_Thread_local call_state *live_calls = NULL;
+
+/* call/cc hands its function an escape continuation. Calling it while the
+	call/cc is still running abandons whatever is going on and makes the
+	call/cc return the value it was passed. The escape is a longjmp back to
+	the call/cc, so it costs about what the setjmp did.
+
+	These are one-shot escapes rather than full re-entrant continuations:
+	once the call/cc has returned, calling its continuation is an error.
+	Early exits and the collector-style code in continuation.scm only ever
+	need to jump outwards so I haven't missed the rest.
+
+	Anything malloc'd along the way has to be cleaned up by hand before we
+	jump. Local scopes are tracked in live_calls. */
+struct continuation {
+	jmp_buf *env;
+	call_state *calls;
+	stack_seg *seg;
+	sexpr *value;
+	struct continuation *outer;
+};
+
+/* The call/ccs that are still running, innermost first */
+_Thread_local struct continuation *escapes = NULL;
+
+static void release_calls(call_state *top, call_state *to) {
+	for (call_state *st = top; st != to; st = st->below) {
+		if (st->frame)
+			scope_free(st->frame);
+		if (st->binding)
+			scope_free(st->binding);
+		free(st->heads.items);
+	}
+}
+
+static void unwind_calls(call_state *to) {
+	release_calls(live_calls, to);
+	live_calls = to;
+}
+
+/* For a coroutine that's being thrown away part way through */
+void free_calls(call_state *top) {
+	release_calls(top, NULL);
+}
+
+/* The values in a suspended coroutine's local scopes and pending conses
+	are only reachable from its calls */
+void mark_calls(vm_heap *vm, call_state *top) {
+	for (call_state *st = top; st; st = st->below) {
+		if (st->frame)
+			mark_scope(vm, st->frame);
+		if (st->binding)
+			mark_scope(vm, st->binding);
+		for (size_t j = 0; j < st->heads.count; j++)
+			mark_chain(vm, st->heads.items[j]);
+	}
+}
+
+static sexpr* throw_cont(vm_heap *vm, scope *env, sexpr *k, sexpr **operands, int count) {
+	ASSERT_PARAM_MAX(count, 2, "A continuation takes at most one value.");
+
+	sexpr *v = count == 2 ? eval2(vm, env, operands[1]) : sexpr_null();
+	ASSERT_NOT_ERR(v);
+
+	struct continuation *c = escapes;
+	while (c && c != k->k)
+		c = c->outer;
+
+	if (!c)
+		return sexpr_err(vm, "Can only escape to a call/cc that is still running, in the same coroutine.");
+
+	unwind_calls(c->calls);
+	escapes = c;
+	c->value = v;
+	longjmp(*c->env, 1);
+}
+
+sexpr* builtin_callcc(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "call/cc expects a function.");
+
+	sexpr *f = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+	if (f->type != LVAL_FUN && f->type != LVAL_CONT)
+		return sexpr_err(vm, "call/cc expects a function.");
+
+	jmp_buf jb;
+	struct continuation *c = malloc(sizeof(struct continuation));
+	c->env = &jb;
+	c->calls = live_calls;
+	c->seg = stack_current();
+	c->value = NULL;
+	c->outer = escapes;
+	sexpr *k = sexpr_cont(vm, c);
+
+	sexpr *result;
+	port *out = current_port;
+	escapes = c;
+	if (setjmp(jb) == 0)
+		result = apply_fun(vm, env, f, &k, 1);
+	else {
+		/* We may have jumped here from further up a stack segment, and out
+			of with-output-to-strings */
+		stack_unwind_to(c->seg);
+		port_unwind_to(out);
+		result = c->value;
+	}
+	escapes = c->outer;
+
+	return result;
+}
+
+/* Set up a new local scope for a call to fun, with the arguments evaluated
+	in env. On an error, returns NULL and leaves the error in *err. */
+static scope* bind_args(vm_heap *vm, scope *env, scope *global, sexpr **operands,
+			int count, sexpr *fun, sexpr *args, call_state *st, sexpr **err) {
+	if (count - 1 < fun->params->count) {
+		*err = sexpr_err(vm, "Too few paramters passed to function.");
+		return NULL;
+	}
+
+	/* Scoping is lexical: a function sees its parameters, whatever it
+		captured when it was made and then the globals */
 	scope *func_scope = scope_new(CLOSURE_TABLE_SIZE);
-	func_scope->parent = sc;
+	func_scope->parent = global;
+	st->binding = func_scope;
+
+	if (fun->captured) {
+		for (int j = 0; j < fun->captured->count; j += 2)
+			scope_insert_var(func_scope, fun->captured->children[j]->sym,
+				fun->captured->children[j + 1]);
+	}
 
 	/* Map the operands to the function parameters and add them to the
 	 	local scope */
 	for (int j = 0; j < fun->params->count; j++) {
-		sexpr *var;
-		if (operands[j + 1]->type == LVAL_SYM)
-			var = scope_fetch_var(vm, sc, operands[j + 1]->sym);
-		else if (operands[j + 1]->type == LVAL_LIST)
-			var = eval2(vm, sc, operands[j + 1]);
-		else
-			var = operands[j + 1];
+		sexpr *var = eval2(vm, env, operands[j + 1]);
 
-		if (var->type == LVAL_ERR)
-			return var;
+		if (var->type == LVAL_ERR) {
+			scope_free(func_scope);
+			st->binding = NULL;
+			*err = var;
+			return NULL;
+		}
 
+		if (args)
+			sexpr_append(args, var);
 		scope_insert_var(func_scope, fun->params->children[j]->sym, var);
 	}
 
-	sexpr *result = eval2(vm, func_scope, fun->body);
-	scope_free(func_scope);
+	st->binding = NULL;
 
-	return result;
+	return func_scope;
 }
 
-sexpr* eval2(vm_heap *vm, scope *sc, sexpr *v) {
+/* Calls to user-defined functions. Rather than recursing in C for each
+	call, a call in tail position (the body itself, or the branch an if or
+	cond picks) replaces the current function and we go round the loop
+	again, freeing the old scope.
+
+	(cons x (f ...)) isn't a tail call, but it's the shape of nearly every
+	list-building function in The Little Schemer and all that's left to do
+	once (f ...) returns is put x on the front. So x gets evaluated and
+	saved, (f ...) is treated as a tail call and when a result finally turns
+	up all the saved heads are put on the front of it in one go. That's
+	tail recursion modulo cons, and it means those functions run in
+	constant C stack however long the list is.
+
+	Memoized functions have to see their result to cache it, so calls to
+	them are never treated as tail calls. */
+sexpr* eval_user_func(vm_heap *vm, scope *sc, sexpr **operands, int count, sexpr *fun) {
+	scope *global = sc;
+	while (global->parent)
+		global = global->parent;
+
+	call_state st = { NULL, NULL, { NULL, 0, 0 }, live_calls };
+	live_calls = &st;
 	sexpr *result = NULL;
 
-	switch (v->type) {
-		case LVAL_LIST:
-			/* An empty list evals to an empty list */
-			if (v->count == 0)
-				return sexpr_list(vm);
+	while (!result) {
+		/* A memoized function needs its arguments gathered into a list to
+			use as the cache key */
+		sexpr *args = fun->memo ? sexpr_list(vm) : NULL;
+		scope *next = bind_args(vm, st.frame ? st.frame : sc, global, operands,
+						count, fun, args, &st, &result);
+		if (!next)
+			break;
 
-			sexpr *func = sexpr_null();
-			if (v->children[0]->type == LVAL_SYM) {
-				func = scope_fetch_var(vm, sc, v->children[0]->sym);
-				while (func->type == LVAL_SYM)
-					func = scope_fetch_var(vm, sc, func->sym);
+		/* Anything the arguments needed from the old scope has been copied
+			into the new one by now */
+		if (st.frame)
+			scope_free(st.frame);
+		st.frame = next;
+
+		if (args) {
+			result = memo_lookup(fun->memo, args);
+			if (!result) {
+				result = eval2(vm, st.frame, fun->body);
+
+				/* Don't cache errors, they may be down to something other
+					than the arguments (an unbound global that's defined
+					later, say) */
+				if (result->type != LVAL_ERR)
+					memo_store(fun->memo, args, result);
 			}
-			else if (v->children[0]->type == LVAL_LIST) {
-				func = eval2(vm, sc, v->children[0]);
+			break;
+		}
+
+		sexpr *expr = fun->body;
+		while (!result) {
+			if (expr->type != LVAL_LIST || expr->count == 0) {
+				result = eval2(vm, st.frame, expr);
+				break;
 			}
 
-			if (func->type != LVAL_FUN) {
-				char msg[1024];
-				char *desc = sexpr_desc(func);
-				snprintf(msg, sizeof msg, "%s%s", "Expected function. Instead got: ", desc);
-				sexpr *err = sexpr_err(vm, msg);
-				free(desc);
-				return err;
+			sexpr *f = call_target(vm, st.frame, expr->children[0]);
+			if (f->type == LVAL_ERR) {
+				result = f;
+				break;
 			}
-			if (func->builtin) {
-				result = func->fun(vm, sc, v->children, v->count, func->sym);
+
+			if (f->type == LVAL_CONT) {
+				result = throw_cont(vm, st.frame, f, expr->children, expr->count);
+				break;
 			}
-			else {
-				result = eval_user_func(vm, sc, v->children, v->count, func);
+
+			if (!f->builtin && !f->memo) {
+				fun = f;
+				operands = expr->children;
+				count = expr->count;
+				break;
 			}
-			return result;
+
+			/* The last expression of a begin is in tail position too */
+			if (f->fun == &builtin_begin) {
+				if (expr->count == 1) {
+					result = sexpr_null();
+					break;
+				}
+
+				for (int j = 1; j < expr->count - 1 && !result; j++) {
+					sexpr *r = eval2(vm, st.frame, expr->children[j]);
+					if (r->type == LVAL_ERR)
+						result = r;
+				}
+				expr = expr->children[expr->count - 1];
+				continue;
+			}
+
+			if (f->fun == &builtin_if || f->fun == &builtin_cond) {
+				result = f->fun == &builtin_if
+					? if_branch(vm, st.frame, expr->children, expr->count, &expr)
+					: cond_branch(vm, st.frame, expr->children, expr->count, &expr);
+				continue;
+			}
+
+			/* Only look through a cons whose tail is a call to a named user
+				function, so working out the callee has no side effects */
+			if (f->fun == &builtin_cons && expr->count == 3
+					&& expr->children[2]->type == LVAL_LIST
+					&& expr->children[2]->count > 0
+					&& expr->children[2]->children[0]->type == LVAL_SYM) {
+				sexpr *tail = expr->children[2];
+				sexpr *g = call_target(vm, st.frame, tail->children[0]);
+
+				if (g->type == LVAL_FUN && !g->builtin && !g->memo) {
+					sexpr *head = eval2(vm, st.frame, expr->children[1]);
+					if (head->type == LVAL_ERR) {
+						result = head;
+						break;
+					}
+
+					push_head(&st.heads, head);
+					fun = g;
+					operands = tail->children;
+					count = tail->count;
+					break;
+				}
+			}
+
+			result = f->builtin ? f->fun(vm, st.frame, expr->children, expr->count, f->sym)
+						: eval_user_func(vm, st.frame, expr->children, expr->count, f);
+		}
+	}
+
+	live_calls = st.below;
+	if (st.frame)
+		scope_free(st.frame);
+
+	result = finish_heads(vm, &st.heads, result);
+	free(st.heads.items);
+
+	return result;
+}
+
+sexpr* eval2(vm_heap *vm, scope *sc, sexpr *v) {
+	switch (v->type) {
+		case LVAL_LIST:
+			/* An empty list evals to an empty list */
+			if (v->count == 0)
+				return sexpr_list(vm);
+
+			/* Move to a new stack segment before this one runs out */
+			if (stack_low())
+				return eval_on_new_segment(vm, sc, v);
+
+			sexpr *func = call_target(vm, sc, v->children[0]);
+			if (func->type == LVAL_ERR)
+				return func;
+
+			if (func->type == LVAL_CONT)
+				return throw_cont(vm, sc, func, v->children, v->count);
+
+			if (func->builtin)
+				return func->fun(vm, sc, v->children, v->count, func->sym);
+
+			return eval_user_func(vm, sc, v->children, v->count, func);
 		case LVAL_SYM:
 			return scope_fetch_var(vm, sc, v->sym);
+		case LVAL_CONST:
+			return v->datum;
 		case LVAL_ERR:
 		case LVAL_FUN:
 		case LVAL_NUM:
 		case LVAL_BOOL:
 		case LVAL_NULL:
 		case LVAL_STR:
+		case LVAL_NUMVEC:
+		case LVAL_STRBUILDER:
+		case LVAL_HASH:
+		case LVAL_CONT:
+		case LVAL_CORO:
+		case LVAL_FUTURE:
+		case LVAL_CHANNEL:
 			return v;
 	}
 
 	return sexpr_err(vm, "Something hasn't been implemented yet");
 }
 
+/* Call a function value on arguments that have already been evaluated. We
+	build the call as an expression and hand it to eval2, quoting any
+	symbols and lists so they don't get evaluated a second time. */
+sexpr* apply_fun(vm_heap *vm, scope *sc, sexpr *fun, sexpr **args, int n) {
+	sexpr *call = sexpr_list(vm);
+	sexpr_append(call, fun);
+
+	for (int j = 0; j < n; j++) {
+		if (args[j]->type == LVAL_SYM || args[j]->type == LVAL_LIST) {
+			sexpr *q = sexpr_list(vm);
+			sexpr_append(q, sexpr_sym(vm, "quote"));
+			sexpr_append(q, args[j]);
+			sexpr_append(call, q);
+		}
+		else
+			sexpr_append(call, args[j]);
+	}
+
+	return eval2(vm, sc, call);
+}
+
+sexpr* eval_all(vm_heap *vm, scope *env, tokenizer *tk, eval_each each) {
+	parser *p = parser_new(tk);
+	sexpr *result = sexpr_null();
+
+	sexpr *ast = get_next_expr(vm, p);
+	while (ast->type != LVAL_NULL) {
+		result = ast->type == LVAL_ERR ? ast : eval2(vm, env, optimize(vm, env, ast));
+		if (result->type == LVAL_ERR)
+			break;
+		if (each)
+			each(vm, env, result);
+		ast = get_next_expr(vm, p);
+	}
+
+	parser_free(p);
+
+	return result;
+}
+
 void load_built_ins(scope *sc) {
    	scope_insert_var(sc, "car", sexpr_fun_builtin(&builtin_car, "car"));
 	scope_insert_var(sc, "cdr", sexpr_fun_builtin(&builtin_cdr, "cdr"));
@@ -860,10 +1459,43 @@ void load_built_ins(scope *sc) {
 	scope_insert_var(sc, "dump", sexpr_fun_builtin(&builtin_mem_dump, "dump"));
 	scope_insert_var(sc, "cond", sexpr_fun_builtin(&builtin_cond, "cond"));
 	scope_insert_var(sc, "if", sexpr_fun_builtin(&builtin_if, "if"));
+	scope_insert_var(sc, "begin", sexpr_fun_builtin(&builtin_begin, "begin"));
 	scope_insert_var(sc, "string?", sexpr_fun_builtin(&builtin_stringq, "string?"));
 	scope_insert_var(sc, "string-length", sexpr_fun_builtin(&builtin_stringlen, "string-length"));
 	scope_insert_var(sc, "string", sexpr_fun_builtin(&builtin_string, "string"));
 	scope_insert_var(sc, "string-append", sexpr_fun_builtin(&builtin_stringappend, "string-append"));
 	scope_insert_var(sc, "string-copy", sexpr_fun_builtin(&builtin_stringcopy, "string-copy"));
+	scope_insert_var(sc, "make-string-builder", sexpr_fun_builtin(&builtin_make_strbuilder, "make-string-builder"));
+	scope_insert_var(sc, "string-builder-append!", sexpr_fun_builtin(&builtin_strbuilder_append, "string-builder-append!"));
+	scope_insert_var(sc, "string-builder-length", sexpr_fun_builtin(&builtin_strbuilder_length, "string-builder-length"));
+	scope_insert_var(sc, "string-builder->string", sexpr_fun_builtin(&builtin_strbuilder_to_string, "string-builder->string"));
 	scope_insert_var(sc, "load", sexpr_fun_builtin(&builtin_load, "load"));
+	scope_insert_var(sc, "time", sexpr_fun_builtin(&builtin_time, "time"));
+	scope_insert_var(sc, "call/cc", sexpr_fun_builtin(&builtin_callcc, "call/cc"));
+	scope_insert_var(sc, "call-with-current-continuation", sexpr_fun_builtin(&builtin_callcc, "call-with-current-continuation"));
+
+	load_numvec_built_ins(sc);
+	load_memo_built_ins(sc);
+	load_hashcons_built_ins(sc);
+	load_optimize_built_ins(sc);
+	load_hashtable_built_ins(sc);
+	load_stack_built_ins(sc);
+	load_coro_built_ins(sc);
+	load_futures_built_ins(sc);
+	load_interp_built_ins(sc);
+	load_image_built_ins(sc);
+	load_printer_built_ins(sc);
+}
+
+/* The built-ins aren't on the heap, so whoever loaded them has to free them
+	along with the scope. A built-in can be bound to other names as well, as
+	with (define first car), but only its own name owns it. */
+void free_built_ins(scope *sc) {
+	for (unsigned int j = 0; j < sc->size; j++) {
+		for (sym *s = sc->sym_table[j]; s; s = s->next) {
+			sexpr *v = s->val;
+			if (v->type == LVAL_FUN && v->builtin && strcmp(v->sym, s->name) == 0)
+				sexpr_free(v);
+		}
+	}
 }
@@ -5,7 +5,33 @@
 #include "sexpr.h"
 
 sexpr* eval2(vm_heap*, scope*, sexpr*);
+sexpr* define(vm_heap*, scope*, sexpr**, int, char*);
+sexpr* builtin_lambda(vm_heap*, scope*, sexpr**, int, char*);
+sexpr* apply_fun(vm_heap*, scope*, sexpr*, sexpr**, int);
+int sexpr_eq(sexpr*, sexpr*);
+int sexpr_cmp(sexpr*, sexpr*);
 void load_built_ins(scope*);
+void free_built_ins(scope*);
+
+/* How many buckets a global scope gets, wherever one is made */
+#define GLOBAL_TABLE_SIZE 1019
+
+/* Parse and evaluate everything tk has in env, stopping at the first error
+	(a parse error included), and give back the last result. each, if it
+	isn't NULL, is called with every result that isn't an error, between
+	top-level expressions, where it's safe to collect garbage. */
+struct tokenizer;
+typedef void (*eval_each)(vm_heap*, scope*, sexpr*);
+sexpr* eval_all(vm_heap*, scope*, struct tokenizer*, eval_each);
+
+/* Per-thread bookkeeping for the calls in progress and the call/ccs that
+	can be escaped to. Switching coroutines swaps these over. */
+struct call_state;
+struct continuation;
+extern _Thread_local struct call_state *live_calls;
+extern _Thread_local struct continuation *escapes;
+void mark_calls(vm_heap*, struct call_state*);
+void free_calls(struct call_state*);
 
 #define IS_FUNC(f) (f->type == LVAL_LIST && f->count > 0) ? 1 : 0
 #define ASSERT_PRIMITIVE(vm, e, s) sexpr *c = scope_fetch_var(vm, e, s); \
@@ -13,6 +39,7 @@ void load_built_ins(scope*);
                 return sexpr_err(vm, "Scheme primitives cannot be redefined."); }
 
 #define ASSERT_PARAM_MIN(c, e, err) if (c < e) return sexpr_err(vm, err)
+#define ASSERT_PARAM_MAX(c, e, err) if (c > e) return sexpr_err(vm, err)
 #define ASSERT_PARAM_EQ(c, e, err) if (c != e) return sexpr_err(vm, err)
 #define ASSERT_NOT_ERR(e) if (e->type == LVAL_ERR) return e
 #define ASSERT_TYPE(e, t, err) if (e->type != t) return sexpr_err(vm, err)
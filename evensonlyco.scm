@@ -115,3 +115,28 @@
                   (cons car-evens-l cdr-evens-l)
                   (* car-evens-product cdr-evens-product)
                   (+ car-odds-sum cdr-odds-sum))))))))))
+
+; With a generator the evens can be handed out one at a time as the walk
+; finds them, rather than building the whole list up front. (even? above
+; doesn't work in notion since (/ 9 2) is 4.5, so this uses % instead)
+(define evens-walk*
+    (lambda (l)
+        (cond
+            ((null? l) #f)
+            ((atom? (car l))
+                (begin
+                    (cond
+                        ((= (% (car l) 2) 0) (yield (car l)))
+                        (else #f))
+                    (evens-walk* (cdr l))))
+            (else
+                (begin
+                    (evens-walk* (car l))
+                    (evens-walk* (cdr l))))
+        )
+))
+
+(define evens-gen
+    (lambda (l)
+        (make-generator (lambda () (evens-walk* l)))
+))
@@ -0,0 +1,261 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fasl.h"
+#include "environment.h"
+#include "parser.h"
+#include "serialize.h"
+#include "sexpr.h"
+
+typedef struct source {
+	char *text; /* '\0' terminated */
+	size_t len;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} source;
+
+static uint64_t fnv1a(const char *s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t j = 0; j < len; j++) {
+		h ^= (unsigned char)s[j];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int source_stat(const char *path, source *src) {
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return 0;
+
+	src->len = st.st_size;
+	src->mtime_sec = st.st_mtime;
+#ifndef _WIN32
+	src->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+	src->mtime_nsec = 0;
+#endif
+
+	return 1;
+}
+
+static int source_read(const char *path, source *src) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	/* It may have changed since we looked at its size */
+	fseek(f, 0, SEEK_END);
+	src->len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	src->text = malloc(src->len + 1);
+	src->len = fread(src->text, 1, src->len, f);
+	src->text[src->len] = '\0';
+	fclose(f);
+
+	return 1;
+}
+
+static char* cache_path(const char *path) {
+	size_t len = strlen(path);
+	char *p = malloc(len + 6);
+	memcpy(p, path, len);
+	memcpy(p + len, ".fasl", 6);
+
+	return p;
+}
+
+/* Gives back the whole cache file, or NULL if there isn't one or it isn't
+	for this version of the source. src->text is filled in if we had to
+	read the source to find out, and *touch is set if that showed only the
+	source's mtime had changed, so that the header wants bringing up to
+	date. */
+static unsigned char* read_cache(const char *path, source *src, size_t *len, int *touch) {
+	char *cpath = cache_path(path);
+	FILE *f = fopen(cpath, "rb");
+	free(cpath);
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	*touch = 0;
+	unsigned char *data = NULL;
+	if (*len >= sizeof(fasl_header)) {
+		data = malloc(*len);
+		if (fread(data, 1, *len, f) != *len) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+
+	if (!data)
+		return NULL;
+
+	fasl_header hdr;
+	memcpy(&hdr, data, sizeof hdr);
+	int fresh = memcmp(hdr.magic, FASL_MAGIC, sizeof FASL_MAGIC) == 0
+		&& hdr.version == FASL_VERSION;
+
+	if (fresh && (hdr.mtime_sec != src->mtime_sec || hdr.mtime_nsec != src->mtime_nsec
+			|| hdr.size != src->len)) {
+		fresh = source_read(path, src) && hdr.size == src->len
+			&& hdr.hash == fnv1a(src->text, src->len);
+		*touch = fresh;
+	}
+
+	if (!fresh) {
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/* Parse the whole of src into a list of forms. A form that didn't parse
+	is left in the list as an error, for whoever evaluates them to report
+	when they get to it. */
+static sexpr* parse_source(vm_heap *vm, source *src, int *failed) {
+	sexpr *forms = parse_all(vm, src->text, src->len);
+
+	*failed = 0;
+	for (int j = 0; j < forms->count; j++) {
+		if (forms->children[j]->type == LVAL_ERR)
+			*failed = 1;
+	}
+
+	return forms;
+}
+
+/* Write the cache for path by way of a temporary file, so that nobody
+	ever reads half of one. Gives back 0 if it didn't get written. */
+static int save_cache(const char *path, fasl_header *hdr, const unsigned char *data, size_t len) {
+	char *cpath = cache_path(path);
+	size_t plen = strlen(cpath);
+	char *tmp = malloc(plen + 5);
+	memcpy(tmp, cpath, plen);
+	memcpy(tmp + plen, ".tmp", 5);
+
+	int ok = 0;
+	FILE *f = fopen(tmp, "wb");
+	if (f) {
+		fwrite(hdr, sizeof *hdr, 1, f);
+		fwrite(data, 1, len, f);
+		ok = !ferror(f);
+		ok &= fclose(f) == 0;
+		ok = ok && rename(tmp, cpath) == 0;
+		if (!ok)
+			remove(tmp);
+	}
+
+	free(tmp);
+	free(cpath);
+
+	return ok;
+}
+
+/* Not being able to write the cache (a read-only directory, say) isn't an
+	error, it just means parsing again next time. Gives back 0 if it didn't
+	get written. */
+static int write_cache(vm_heap *vm, const char *path, source *src, sexpr *forms) {
+	message m = { NULL, 0, 0 };
+	if (serialize_image(vm, forms, &m))
+		return 0;
+
+	fasl_header hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, FASL_MAGIC, sizeof FASL_MAGIC);
+	hdr.version = FASL_VERSION;
+	hdr.mtime_sec = src->mtime_sec;
+	hdr.mtime_nsec = src->mtime_nsec;
+	hdr.size = src->len;
+	hdr.hash = fnv1a(src->text, src->len);
+
+	int ok = save_cache(path, &hdr, m.data, m.len);
+	free(m.data);
+
+	return ok;
+}
+
+/* The forms in the file at path, from its cache if that's fresh, otherwise
+	parsed and cached for next time. Gives back an error if there's no such
+	file. */
+sexpr* fasl_forms(vm_heap *vm, scope *global, const char *path) {
+	source src = { NULL, 0, 0, 0 };
+	if (!source_stat(path, &src))
+		return sexpr_err(vm, "File not found.");
+
+	size_t len;
+	int touch;
+	unsigned char *data = read_cache(path, &src, &len, &touch);
+	if (data) {
+		/* A cache that's been truncated or scribbled on just gets
+			parsed over */
+		sexpr *forms = deserialize_bytes(vm, global, data + sizeof(fasl_header),
+						len - sizeof(fasl_header));
+		if (forms && forms->type == LVAL_LIST) {
+			/* Someone touched the source without changing it. Save the new
+				mtime so the next load doesn't have to hash it again. */
+			if (touch) {
+				fasl_header hdr;
+				memcpy(&hdr, data, sizeof hdr);
+				hdr.mtime_sec = src.mtime_sec;
+				hdr.mtime_nsec = src.mtime_nsec;
+				save_cache(path, &hdr, data + sizeof hdr, len - sizeof hdr);
+			}
+			free(data);
+			free(src.text);
+			return forms;
+		}
+		free(data);
+		free(src.text);
+		src.text = NULL;
+	}
+
+	if (!src.text && !source_read(path, &src))
+		return sexpr_err(vm, "File not found.");
+
+	int failed;
+	sexpr *forms = parse_source(vm, &src, &failed);
+	if (!failed)
+		write_cache(vm, path, &src, forms);
+	free(src.text);
+
+	return forms;
+}
+
+/* For notion --compile. Gives back an error if the file doesn't parse or
+	its cache couldn't be written, otherwise null. */
+sexpr* fasl_compile(vm_heap *vm, scope *global, const char *path) {
+	source src = { NULL, 0, 0, 0 };
+	if (!source_stat(path, &src) || !source_read(path, &src))
+		return sexpr_err(vm, "File not found.");
+
+	int failed;
+	sexpr *forms = parse_source(vm, &src, &failed);
+	sexpr *result = sexpr_null();
+
+	if (failed) {
+		for (int j = 0; j < forms->count; j++) {
+			if (forms->children[j]->type == LVAL_ERR) {
+				result = forms->children[j];
+				break;
+			}
+		}
+	}
+	else if (!write_cache(vm, path, &src, forms))
+		result = sexpr_err(vm, "Couldn't write the cache file.");
+
+	free(src.text);
+
+	return result;
+}
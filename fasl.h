@@ -0,0 +1,41 @@
+#ifndef fasl_h
+#define fasl_h
+
+#include <stdint.h>
+
+#include "fwd.h"
+
+/* Fast-load caches. The first time load reads foo.scm it saves the parsed
+	forms to foo.scm.fasl, and after that it reads them from there instead
+	of tokenizing and parsing again. notion --compile file ... makes the
+	caches ahead of time.
+
+	A cache says which version of the source it came from: its modification
+	time, its size and a hash of its contents. If the time and size still
+	match, the cache is used as is. If they don't, the source is hashed,
+	and if the hash matches (it was only touched, or copied somewhere) the
+	cache is still good, and gets the new time so it isn't hashed again.
+	Otherwise the source is parsed again and the cache rewritten. So is a
+	cache that turns out to be damaged when it's decoded.
+
+	Only the parse is cached. What the forms mean depends on what's defined
+	when they're evaluated, so the optimizer still runs on them at load
+	time. */
+
+#define FASL_MAGIC "NOTNFSL"
+#define FASL_VERSION 1
+
+typedef struct fasl_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t hash; /* FNV-1a of the source */
+} fasl_header;
+
+sexpr* fasl_forms(vm_heap*, scope*, const char*);
+sexpr* fasl_compile(vm_heap*, scope*, const char*);
+
+#endif
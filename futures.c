@@ -0,0 +1,389 @@
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "futures.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "printer.h"
+#include "sexpr.h"
+#include "stack.h"
+
+/* Workers get a decent sized stack, although deep recursion moves onto
+	segments of its own anyway (see stack.h) */
+#define WORKER_STACK_SIZE (8 * 1024 * 1024)
+/* pmap cuts a list into this many chunks per thread, so that a thread that
+	finishes early has something to steal */
+#define CHUNKS_PER_THREAD 4
+
+typedef struct deque {
+	pthread_mutex_t lock;
+	future **items;
+	unsigned long cap;
+	unsigned long top; /* Where thieves take from */
+	unsigned long bottom; /* Where the owner pushes and pops */
+} deque;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static int worker_count = 0;
+/* One per worker, then one more shared by every thread that isn't */
+static deque *deques = NULL;
+static atomic_long queued;
+
+/* Idle workers and threads waiting on a future sleep on this. It gets
+	broadcast whenever a future is queued or finishes. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_changed = PTHREAD_COND_INITIALIZER;
+
+static _Thread_local int worker_id = -1;
+
+static void deque_push(deque *d, future *f) {
+	pthread_mutex_lock(&d->lock);
+
+	if (d->bottom - d->top == d->cap) {
+		unsigned long cap = d->cap * 2;
+		future **items = malloc(cap * sizeof(future*));
+		for (unsigned long j = d->top; j < d->bottom; j++)
+			items[j % cap] = d->items[j % d->cap];
+		free(d->items);
+		d->items = items;
+		d->cap = cap;
+	}
+
+	d->items[d->bottom++ % d->cap] = f;
+
+	pthread_mutex_unlock(&d->lock);
+}
+
+static future* deque_pop(deque *d) {
+	future *f = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		f = d->items[--d->bottom % d->cap];
+	pthread_mutex_unlock(&d->lock);
+
+	return f;
+}
+
+static future* deque_steal(deque *d) {
+	future *f = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		f = d->items[d->top++ % d->cap];
+	pthread_mutex_unlock(&d->lock);
+
+	return f;
+}
+
+static void wake_all(void) {
+	pthread_mutex_lock(&pool_lock);
+	pthread_cond_broadcast(&pool_changed);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int own_deque(void) {
+	return worker_id >= 0 ? worker_id : worker_count;
+}
+
+/* Our own deque newest first, then everyone else's oldest first */
+static future* find_work(void) {
+	int own = own_deque();
+	future *f = deque_pop(&deques[own]);
+
+	for (int j = 1; !f && j <= worker_count; j++)
+		f = deque_steal(&deques[(own + j) % (worker_count + 1)]);
+
+	if (f)
+		atomic_fetch_sub(&queued, 1);
+
+	return f;
+}
+
+static sexpr* map_chunk(future *f) {
+	sexpr *out = sexpr_list(f->vm);
+
+	for (int j = 0; j < f->item_count; j++) {
+		sexpr *r = apply_fun(f->vm, f->global, f->fn, &f->items[j], 1);
+		if (r->type == LVAL_ERR)
+			return r;
+		sexpr_append(out, r);
+	}
+
+	return out;
+}
+
+/* Run a future we've just claimed */
+static void execute(future *f) {
+	/* A future is a computation of its own. A call/cc from whoever happens
+		to be running it isn't something it can escape to. */
+	struct call_state *calls = live_calls;
+	struct continuation *esc = escapes;
+	port *out = current_port;
+	live_calls = NULL;
+	escapes = NULL;
+	current_port = NULL;
+
+	tlab *outer = current_tlab;
+	if (worker_id >= 0)
+		current_tlab = &f->local;
+
+	sexpr *result = f->items ? map_chunk(f) : apply_fun(f->vm, f->global, f->fn, NULL, 0);
+
+	if (worker_id >= 0) {
+		vm_publish(f->vm, &f->local);
+		current_tlab = outer;
+	}
+
+	live_calls = calls;
+	escapes = esc;
+	current_port = out;
+
+	f->result = result;
+	atomic_store_explicit(&f->state, FUTURE_DONE, memory_order_release);
+	atomic_fetch_sub(&f->vm->futures_pending, 1);
+	wake_all();
+}
+
+static int claim(future *f) {
+	int expected = FUTURE_PENDING;
+
+	return atomic_compare_exchange_strong(&f->state, &expected, FUTURE_RUNNING);
+}
+
+/* For a future taken off a deque. Someone touching it may have got to it
+	first, in which case there's nothing to do but drop the deque's
+	reference. */
+static void run_queued(future *f) {
+	if (claim(f))
+		execute(f);
+	future_release(f);
+}
+
+static void* worker_main(void *arg) {
+	worker_id = (int)(intptr_t)arg;
+	stack_init();
+
+	for (;;) {
+		future *f = find_work();
+		if (f) {
+			run_queued(f);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool_lock);
+		while (atomic_load(&queued) == 0)
+			pthread_cond_wait(&pool_changed, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	return NULL;
+}
+
+int futures_thread_count(void) {
+	char *s = getenv("NOTION_THREADS");
+	long n = s ? strtol(s, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static void pool_start(void) {
+	/* The thread that's touching counts as one of them */
+	worker_count = futures_thread_count() - 1;
+	if (worker_count < 1)
+		worker_count = 1;
+
+	atomic_init(&queued, 0);
+	deques = calloc(worker_count + 1, sizeof(deque));
+	for (int j = 0; j <= worker_count; j++) {
+		pthread_mutex_init(&deques[j].lock, NULL);
+		deques[j].cap = 64;
+		deques[j].items = malloc(deques[j].cap * sizeof(future*));
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (int j = 0; j < worker_count; j++) {
+		pthread_t t;
+		pthread_create(&t, &attr, worker_main, (void*)(intptr_t)j);
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static future* future_new(vm_heap *vm, scope *env, sexpr *fn, sexpr **items, int item_count) {
+	future *f = malloc(sizeof(future));
+	atomic_init(&f->state, FUTURE_PENDING);
+	atomic_init(&f->refs, 2);
+	f->vm = vm;
+	f->fn = fn;
+	f->items = items;
+	f->item_count = item_count;
+	f->result = NULL;
+	f->local.head = NULL;
+	f->local.tail = NULL;
+	f->local.count = 0;
+
+	/* Whatever local scope we're in now may well be gone by the time it
+		runs */
+	f->global = env;
+	while (f->global->parent)
+		f->global = f->global->parent;
+
+	return f;
+}
+
+static void submit(future *f) {
+	pthread_once(&pool_once, pool_start);
+
+	atomic_fetch_add(&f->vm->futures_pending, 1);
+	deque_push(&deques[own_deque()], f);
+	atomic_fetch_add(&queued, 1);
+	wake_all();
+}
+
+/* Wait for f to finish, doing something useful in the meantime */
+static sexpr* wait_for(future *f) {
+	while (atomic_load_explicit(&f->state, memory_order_acquire) != FUTURE_DONE) {
+		if (claim(f)) {
+			execute(f);
+			break;
+		}
+
+		future *g = find_work();
+		if (g) {
+			run_queued(g);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool_lock);
+		while (atomic_load(&f->state) != FUTURE_DONE && atomic_load(&queued) == 0)
+			pthread_cond_wait(&pool_changed, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	return f->result;
+}
+
+/* Wait until every future belonging to vm has finished */
+void futures_drain(vm_heap *vm) {
+	while (atomic_load(&vm->futures_pending) > 0) {
+		future *g = find_work();
+		if (g) {
+			run_queued(g);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool_lock);
+		while (atomic_load(&vm->futures_pending) > 0 && atomic_load(&queued) == 0)
+			pthread_cond_wait(&pool_changed, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+void future_release(future *f) {
+	if (atomic_fetch_sub(&f->refs, 1) == 1)
+		free(f);
+}
+
+void future_mark(vm_heap *vm, future *f) {
+	mark_chain(vm, f->fn);
+	if (f->result)
+		mark_chain(vm, f->result);
+}
+
+/* The thunk is a lambda with no parameters around expr. The analysis of
+	a lambda body is cached against its parameter list (see analyse_body())
+	so we reuse the empty list from last time rather than make a new one
+	and miss the cache on every evaluation. */
+static sexpr* thunk_params(vm_heap *vm, sexpr *body) {
+	sexpr *info = body->type == LVAL_LIST ? atomic_load(&body->closure_info) : NULL;
+	if (info && info->children[0]->count == 0)
+		return info->children[0];
+
+	return sexpr_list(vm);
+}
+
+sexpr* builtin_future(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "future expects one expression.");
+
+	sexpr *lambda[] = { nodes[0], thunk_params(vm, nodes[1]), nodes[1] };
+	sexpr *thunk = builtin_lambda(vm, env, lambda, 3, "lambda");
+	ASSERT_NOT_ERR(thunk);
+
+	future *f = future_new(vm, env, thunk, NULL, 0);
+	sexpr *v = sexpr_future(vm, f);
+	submit(f);
+
+	return v;
+}
+
+sexpr* builtin_touch(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "touch expects a future.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	if (v->type != LVAL_FUTURE)
+		return v;
+
+	return wait_for(v->fut);
+}
+
+/* (pmap f list) */
+sexpr* builtin_pmap(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "pmap expects a function and a list.");
+
+	sexpr *fn = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(fn);
+	ASSERT_TYPE(fn, LVAL_FUN, "pmap expects a function and a list.");
+
+	sexpr *lst = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(lst);
+	ASSERT_TYPE(lst, LVAL_LIST, "pmap expects a function and a list.");
+
+	pthread_once(&pool_once, pool_start);
+
+	int chunks = CHUNKS_PER_THREAD * (worker_count + 1);
+	if (chunks > lst->count)
+		chunks = lst->count;
+
+	future **parts = malloc(chunks * sizeof(future*));
+	for (int j = 0; j < chunks; j++) {
+		int from = (long)lst->count * j / chunks;
+		int to = (long)lst->count * (j + 1) / chunks;
+		parts[j] = future_new(vm, env, fn, lst->children + from, to - from);
+		submit(parts[j]);
+	}
+
+	/* Every chunk has to finish before we can let go of them, even once
+		one has failed. The first error in list order is the one reported. */
+	sexpr *result = sexpr_list(vm);
+	sexpr *err = NULL;
+	for (int j = 0; j < chunks; j++) {
+		sexpr *r = wait_for(parts[j]);
+
+		if (!err && r->type == LVAL_ERR)
+			err = r;
+		else if (!err) {
+			for (int k = 0; k < r->count; k++)
+				sexpr_append(result, r->children[k]);
+		}
+
+		future_release(parts[j]);
+	}
+	free(parts);
+
+	return err ? err : result;
+}
+
+void load_futures_built_ins(scope *sc) {
+	scope_insert_var(sc, "future", sexpr_fun_builtin(&builtin_future, "future"));
+	scope_insert_var(sc, "touch", sexpr_fun_builtin(&builtin_touch, "touch"));
+	scope_insert_var(sc, "pmap", sexpr_fun_builtin(&builtin_pmap, "pmap"));
+}
@@ -0,0 +1,58 @@
+#ifndef futures_h
+#define futures_h
+
+#include <stdatomic.h>
+
+#include "fwd.h"
+#include "environment.h"
+
+/* Futures and a parallel map, run by a pool of worker threads.
+
+	(future expr) hands expr off to the pool and gives back a future right
+	away. (touch f) waits for it and gives back its value (touching anything
+	that isn't a future just gives it back). (pmap f list) is map with the
+	list cut into chunks that are worked on in parallel.
+
+	Each worker has a deque of futures. It pushes and pops its own at one
+	end and, once it runs out, steals from the other end of someone else's.
+	Threads that aren't workers (the REPL) push onto a deque of their own
+	that the workers steal from. A thread waiting in touch doesn't just
+	block: it runs the future itself if nobody has started it yet, and
+	otherwise helps out with whatever else is queued.
+
+	A future runs its thunk from the global scope. Since closures capture
+	their variables by value, everything it needs comes along with it.
+	Whatever it allocates goes on a list of its own (see tlab in
+	environment.h) that's handed to the VM when it finishes, and the GC
+	doesn't run while any future is unfinished.
+
+	Built-in state that futures share (the optimizer, memo caches, strings,
+	the global scope) is safe to use from several at once. Hash tables and
+	string builders aren't, so sharing a mutable one between futures that
+	change it is asking for trouble.
+
+	NOTION_THREADS in the environment overrides how many threads to use,
+	otherwise it's one per core. parse_all (see parser.h) goes by the same
+	number. */
+
+enum future_state { FUTURE_PENDING, FUTURE_RUNNING, FUTURE_DONE };
+
+typedef struct future {
+	atomic_int state;
+	atomic_int refs; /* Whoever made it, plus the deque it's waiting in */
+	vm_heap *vm;
+	scope *global;
+	sexpr *fn; /* A thunk, or the function a pmap chunk is applying */
+	sexpr **items; /* For a pmap chunk, the part of the list it's doing */
+	int item_count;
+	sexpr *result;
+	tlab local;
+} future;
+
+void future_release(future*);
+void future_mark(vm_heap*, future*);
+void futures_drain(vm_heap*);
+int futures_thread_count(void);
+void load_futures_built_ins(scope*);
+
+#endif
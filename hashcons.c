@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashcons.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "hashtable.h"
+#include "sexpr.h"
+
+#define HC_MIN_CAP 256
+
+static unsigned long hc_mix(unsigned long h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static int internable(sexpr *v) {
+	switch (v->type) {
+		case LVAL_NUM:
+		case LVAL_SYM:
+		case LVAL_STR:
+		case LVAL_BOOL:
+		case LVAL_LIST:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Atoms hash on their value. A list's children are already canonical by
+	the time we look at it so it's enough to hash their addresses. */
+static unsigned long hc_hash(sexpr *v) {
+	if (v->type != LVAL_LIST)
+		return sexpr_hash(v, 1);
+
+	unsigned long h = 0x9e3779b97f4a7c15UL + v->count;
+	for (int j = 0; j < v->count; j++)
+		h = hc_mix(h ^ (unsigned long)(uintptr_t)v->children[j]);
+
+	return h;
+}
+
+/* Stricter than equal?: 1 and 1.0 are different objects, as are 0.0 and
+	-0.0 */
+static int hc_same(sexpr *a, sexpr *b) {
+	if (a->type != b->type)
+		return 0;
+
+	switch (a->type) {
+		case LVAL_NUM:
+			if (a->num_type != b->num_type)
+				return 0;
+			if (a->num_type == NUM_TYPE_INT)
+				return a->i_num == b->i_num;
+			return memcmp(&a->d_num, &b->d_num, sizeof(double)) == 0;
+		case LVAL_SYM:
+			return strcmp(a->sym, b->sym) == 0;
+		case LVAL_STR:
+			return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
+		case LVAL_BOOL:
+			return a->bool == b->bool;
+		case LVAL_LIST:
+			if (a->count != b->count)
+				return 0;
+			return a->count == 0
+				|| memcmp(a->children, b->children, a->count * sizeof(sexpr*)) == 0;
+		default:
+			return 0;
+	}
+}
+
+/* Roughly what a duplicate costs us, for the stats */
+static size_t node_bytes(sexpr *v) {
+	size_t bytes = sizeof(sexpr);
+
+	if (v->type == LVAL_LIST)
+		bytes += v->count * sizeof(sexpr*);
+	else if (v->type == LVAL_SYM)
+		bytes += strlen(v->sym) + 1;
+	else if (v->type == LVAL_STR)
+		bytes += v->len;
+
+	return bytes;
+}
+
+static hc_table* hc_new(void) {
+	hc_table *t = malloc(sizeof(hc_table));
+	t->enabled = 0;
+	t->cap = HC_MIN_CAP;
+	t->count = 0;
+	t->slots = calloc(t->cap, sizeof(sexpr*));
+	t->hashes = malloc(t->cap * sizeof(unsigned long));
+	t->hits = 0;
+	t->bytes_saved = 0;
+
+	return t;
+}
+
+void hc_free(hc_table *t) {
+	free(t->slots);
+	free(t->hashes);
+	free(t);
+}
+
+static sexpr* hc_find(hc_table *t, sexpr *v, unsigned long h) {
+	unsigned long j = h & (t->cap - 1);
+
+	while (t->slots[j]) {
+		if (t->hashes[j] == h && hc_same(t->slots[j], v))
+			return t->slots[j];
+		j = (j + 1) & (t->cap - 1);
+	}
+
+	return NULL;
+}
+
+static void hc_place(hc_table *t, sexpr *v, unsigned long h) {
+	unsigned long j = h & (t->cap - 1);
+
+	while (t->slots[j])
+		j = (j + 1) & (t->cap - 1);
+
+	t->slots[j] = v;
+	t->hashes[j] = h;
+}
+
+/* Rebuild the table at the given size. If gen is non-zero, only objects
+	the GC marked in that generation come along. */
+static void hc_rebuild(hc_table *t, unsigned long cap, unsigned int gen) {
+	sexpr **old = t->slots;
+	unsigned long *old_hashes = t->hashes;
+	unsigned long old_cap = t->cap;
+
+	t->cap = cap;
+	t->count = 0;
+	t->slots = calloc(cap, sizeof(sexpr*));
+	t->hashes = malloc(cap * sizeof(unsigned long));
+
+	for (unsigned long j = 0; j < old_cap; j++) {
+		if (old[j] && (!gen || old[j]->gen >= gen)) {
+			hc_place(t, old[j], old_hashes[j]);
+			t->count++;
+		}
+	}
+
+	free(old);
+	free(old_hashes);
+}
+
+static sexpr* hc_lookup_or_add(hc_table *t, sexpr *v) {
+	unsigned long h = hc_hash(v);
+	sexpr *found = hc_find(t, v, h);
+
+	if (found) {
+		if (found != v) {
+			t->hits++;
+			t->bytes_saved += node_bytes(v);
+		}
+		return found;
+	}
+
+	if ((t->count + 1) * 4 > t->cap * 3)
+		hc_rebuild(t, t->cap * 2, 0);
+
+	hc_place(t, v, h);
+	t->count++;
+
+	return v;
+}
+
+static sexpr* intern(vm_heap *vm, hc_table *t, sexpr *v);
+
+/* Quoting interns too, and that can happen in several futures at once, so
+	the table is only touched under the VM's lock */
+sexpr* hc_intern(vm_heap *vm, sexpr *v) {
+	hc_table *t = vm->hc;
+
+	if (!t || !t->enabled || !internable(v))
+		return v;
+
+	vm_lock(vm);
+	sexpr *canon = intern(vm, t, v);
+	vm_unlock(vm);
+
+	return canon;
+}
+
+static sexpr* intern(vm_heap *vm, hc_table *t, sexpr *v) {
+	if (!internable(v))
+		return v;
+
+	if (v->type != LVAL_LIST)
+		return hc_lookup_or_add(t, v);
+
+	/* The list may already be the canonical one (quoting interned data,
+		say) in which case there's no need to walk it. */
+	if (hc_find(t, v, hc_hash(v)) == v)
+		return v;
+
+	/* Otherwise intern the children first. The list itself might be
+		shared with code that isn't expecting it to change, so if any child
+		gets swapped out build a fresh list instead of editing this one. */
+	sexpr *canon = v;
+	for (int j = 0; j < v->count; j++) {
+		sexpr *c = intern(vm, t, v->children[j]);
+
+		if (c != v->children[j] && canon == v) {
+			canon = sexpr_list(vm);
+			for (int k = 0; k < j; k++)
+				sexpr_append(canon, v->children[k]);
+		}
+
+		if (canon != v)
+			sexpr_append(canon, c);
+	}
+
+	return hc_lookup_or_add(t, canon);
+}
+
+/* Called by the GC once marking is done. Anything unmarked is about to be
+	freed so it has to come out of the table. */
+void hc_prune(vm_heap *vm) {
+	hc_table *t = vm->hc;
+
+	if (!t)
+		return;
+
+	unsigned long live = 0;
+	for (unsigned long j = 0; j < t->cap; j++) {
+		if (t->slots[j] && t->slots[j]->gen >= vm->gc_generation)
+			live++;
+	}
+
+	unsigned long cap = HC_MIN_CAP;
+	while (cap < live * 2)
+		cap *= 2;
+
+	hc_rebuild(t, cap, vm->gc_generation);
+}
+
+/* (hash-cons #t) turns interning on for everything parsed or quoted from
+	then on, (hash-cons #f) turns it off again. Data that was already
+	interned stays shared. */
+sexpr* builtin_hash_cons(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected #t or #f.");
+
+	sexpr *on = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(on);
+	ASSERT_TYPE(on, LVAL_BOOL, "Expected #t or #f.");
+
+	if (!vm->hc)
+		vm->hc = hc_new();
+	vm->hc->enabled = on->bool;
+
+	return sexpr_null();
+}
+
+/* (hash-cons-stats) gives back (entries duplicates bytes-saved) */
+sexpr* builtin_hash_cons_stats(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 1, "hash-cons-stats takes no arguments.");
+
+	hc_table *t = vm->hc;
+	sexpr *stats = sexpr_list(vm);
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, t ? t->count : 0));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, t ? t->hits : 0));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, t ? t->bytes_saved : 0));
+
+	return stats;
+}
+
+void load_hashcons_built_ins(scope *sc) {
+	scope_insert_var(sc, "hash-cons", sexpr_fun_builtin(&builtin_hash_cons, "hash-cons"));
+	scope_insert_var(sc, "hash-cons-stats", sexpr_fun_builtin(&builtin_hash_cons_stats, "hash-cons-stats"));
+}
@@ -0,0 +1,36 @@
+#ifndef hashcons_h
+#define hashcons_h
+
+#include <stddef.h>
+
+#include "fwd.h"
+
+/* Optional hash-consing of literal data. When it's switched on, every atom
+	and list the parser builds (and anything quote hands back) goes through
+	hc_intern(), which returns the one canonical copy of it. Lists are
+	interned bottom up, so two lists are the same list exactly when their
+	children are the same pointers and comparing them is cheap.
+
+	The table is weak: it doesn't keep anything alive by itself. The GC
+	calls hc_prune() after marking so entries for objects about to be swept
+	are dropped first.
+
+	Nothing in notion mutates a list or atom once it's built, which is what
+	makes the sharing safe. */
+
+typedef struct hc_table {
+	int enabled;
+	sexpr **slots;
+	unsigned long *hashes;
+	unsigned long cap;
+	unsigned long count;
+	unsigned long hits; /* Duplicates replaced by an existing copy */
+	size_t bytes_saved;
+} hc_table;
+
+sexpr* hc_intern(vm_heap*, sexpr*);
+void hc_prune(vm_heap*);
+void hc_free(hc_table*);
+void load_hashcons_built_ins(scope*);
+
+#endif
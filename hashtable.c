@@ -0,0 +1,437 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtable.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "sexpr.h"
+
+#define HT_MIN_CAP 8
+/* How many old slots we move across per operation while resizing */
+#define HT_MIGRATE_STEP 16
+
+/* Deleted entries leave this behind so probe chains stay unbroken */
+static sexpr tombstone;
+#define TOMBSTONE (&tombstone)
+
+static unsigned long hash_bytes(const char *s, size_t len) {
+	/* FNV-1a */
+	unsigned long h = 14695981039346656037UL;
+	for (size_t j = 0; j < len; j++) {
+		h ^= (unsigned char)s[j];
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+
+static unsigned long hash_mix(unsigned long x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdUL;
+	x ^= x >> 33;
+
+	return x;
+}
+
+/* Hash consistent with eq? (equal == 0) or with sexpr_cmp (equal == 1).
+	eq? compares atoms by value and everything else by identity, so lists
+	only get hashed structurally for equal? tables. */
+unsigned long sexpr_hash(sexpr *v, int equal) {
+	unsigned long h;
+	double d;
+
+	switch (v->type) {
+		case LVAL_NUM:
+			if (v->num_type == NUM_TYPE_INT)
+				return hash_mix((unsigned long)v->i_num);
+			/* -0.0 == 0.0, so they have to hash the same */
+			d = v->d_num == 0 ? 0.0 : v->d_num;
+			memcpy(&h, &d, sizeof h);
+			return hash_mix(h ^ 0x5bd1e995UL);
+		case LVAL_SYM:
+			return hash_bytes(v->sym, strlen(v->sym));
+		case LVAL_STR:
+			return hash_mix(hash_bytes(v->str, v->len));
+		case LVAL_BOOL:
+			return hash_mix(v->bool + 2);
+		case LVAL_NULL:
+			return 1;
+		case LVAL_LIST:
+			if (!equal)
+				break;
+
+			h = 0x9e3779b97f4a7c15UL + v->count;
+			for (int j = 0; j < v->count; j++)
+				h = h * 31 + sexpr_hash(v->children[j], 1);
+			return h;
+		case LVAL_NUMVEC:
+			if (!equal)
+				break;
+
+			return hash_bytes((char*)v->f64, v->count * sizeof(double));
+		default:
+			break;
+	}
+
+	return hash_mix((unsigned long)(uintptr_t)v);
+}
+
+/* eq? calls decimals within 1e-7 of each other the same, which no hash
+	can go along with, so as keys they have to be exactly equal */
+static int keys_equal(htable *t, sexpr *a, sexpr *b) {
+	if (a->type == LVAL_NUM && b->type == LVAL_NUM
+			&& a->num_type == NUM_TYPE_DEC && b->num_type == NUM_TYPE_DEC)
+		return a->d_num == b->d_num;
+
+	return t->equal ? sexpr_cmp(a, b) : sexpr_eq(a, b);
+}
+
+htable* ht_new(int equal) {
+	htable *t = malloc(sizeof(htable));
+	t->equal = equal;
+	t->count = 0;
+	t->cap = HT_MIN_CAP;
+	t->used = 0;
+	t->slots = calloc(t->cap, sizeof(hentry));
+	t->old = NULL;
+	t->old_cap = 0;
+	t->migrated = 0;
+
+	return t;
+}
+
+void ht_free(htable *t) {
+	free(t->slots);
+	free(t->old);
+	free(t);
+}
+
+static hentry* find_in(htable *t, hentry *slots, unsigned long cap, sexpr *key,
+			unsigned long h) {
+	unsigned long j = h & (cap - 1);
+
+	while (slots[j].key) {
+		if (slots[j].key != TOMBSTONE && slots[j].hash == h
+				&& keys_equal(t, slots[j].key, key))
+			return &slots[j];
+		j = (j + 1) & (cap - 1);
+	}
+
+	return NULL;
+}
+
+/* Put an entry we know isn't in the new slots already into them */
+static void raw_insert(htable *t, sexpr *key, sexpr *val, unsigned long h) {
+	unsigned long j = h & (t->cap - 1);
+
+	while (t->slots[j].key && t->slots[j].key != TOMBSTONE)
+		j = (j + 1) & (t->cap - 1);
+
+	if (!t->slots[j].key)
+		t->used++;
+
+	t->slots[j].key = key;
+	t->slots[j].val = val;
+	t->slots[j].hash = h;
+}
+
+static void migrate(htable *t, unsigned long n) {
+	while (t->old && n--) {
+		hentry *e = &t->old[t->migrated++];
+
+		if (e->key && e->key != TOMBSTONE)
+			raw_insert(t, e->key, e->val, e->hash);
+
+		if (t->migrated == t->old_cap) {
+			free(t->old);
+			t->old = NULL;
+			t->old_cap = 0;
+		}
+	}
+}
+
+/* Keep the slots at most 3/4 full, counting tombstones. The old slots are
+	kept around and drained incrementally by migrate(). */
+static void maybe_grow(htable *t) {
+	if ((t->used + 1) * 4 <= t->cap * 3)
+		return;
+
+	/* It'd be unusual to fill the new slots before the last migration is
+		done, but if we do just finish it off */
+	if (t->old)
+		migrate(t, t->old_cap);
+
+	unsigned long cap = t->count * 2 >= t->cap / 2 ? t->cap * 2 : t->cap;
+
+	t->old = t->slots;
+	t->old_cap = t->cap;
+	t->migrated = 0;
+	t->slots = calloc(cap, sizeof(hentry));
+	t->cap = cap;
+	t->used = 0;
+}
+
+static hentry* find(htable *t, sexpr *key, unsigned long h) {
+	hentry *e = find_in(t, t->slots, t->cap, key, h);
+
+	if (!e && t->old)
+		e = find_in(t, t->old, t->old_cap, key, h);
+
+	return e;
+}
+
+sexpr* ht_get(htable *t, sexpr *key) {
+	migrate(t, HT_MIGRATE_STEP);
+
+	hentry *e = find(t, key, sexpr_hash(key, t->equal));
+
+	return e ? e->val : NULL;
+}
+
+void ht_set(htable *t, sexpr *key, sexpr *val) {
+	migrate(t, HT_MIGRATE_STEP);
+
+	unsigned long h = sexpr_hash(key, t->equal);
+	hentry *e = find_in(t, t->slots, t->cap, key, h);
+	if (e) {
+		e->val = val;
+		return;
+	}
+
+	/* If it's still waiting in the old slots, pull it out of there so the
+		key only ever lives in one place */
+	if (t->old && (e = find_in(t, t->old, t->old_cap, key, h))) {
+		e->key = TOMBSTONE;
+		t->count--;
+	}
+
+	maybe_grow(t);
+	raw_insert(t, key, val, h);
+	t->count++;
+}
+
+int ht_delete(htable *t, sexpr *key) {
+	migrate(t, HT_MIGRATE_STEP);
+
+	hentry *e = find(t, key, sexpr_hash(key, t->equal));
+	if (!e)
+		return 0;
+
+	e->key = TOMBSTONE;
+	e->val = NULL;
+	t->count--;
+
+	return 1;
+}
+
+void ht_walk(htable *t, ht_visitor f, void *arg) {
+	for (unsigned long j = 0; j < t->cap; j++) {
+		if (t->slots[j].key && t->slots[j].key != TOMBSTONE)
+			f(t->slots[j].key, t->slots[j].val, arg);
+	}
+
+	for (unsigned long j = t->migrated; t->old && j < t->old_cap; j++) {
+		if (t->old[j].key && t->old[j].key != TOMBSTONE)
+			f(t->old[j].key, t->old[j].val, arg);
+	}
+}
+
+static void copy_entry(sexpr *key, sexpr *val, void *arg) {
+	ht_set((htable*)arg, key, val);
+}
+
+htable* ht_copy(htable *t) {
+	htable *c = ht_new(t->equal);
+	ht_walk(t, copy_entry, c);
+
+	return c;
+}
+
+static void mark_entry(sexpr *key, sexpr *val, void *arg) {
+	vm_heap *vm = arg;
+
+	mark_chain(vm, key);
+	mark_chain(vm, val);
+}
+
+void ht_mark(vm_heap *vm, htable *t) {
+	ht_walk(t, mark_entry, vm);
+}
+
+static sexpr* eval_table(vm_heap *vm, scope *env, sexpr *node) {
+	sexpr *t = eval2(vm, env, node);
+	ASSERT_NOT_ERR(t);
+	ASSERT_TYPE(t, LVAL_HASH, "Expected a hash table.");
+
+	return t;
+}
+
+/* (make-hash-table) compares keys with equal?, (make-hash-table 'eq?) uses
+	eq?, which is cheaper for lists since they're hashed by identity */
+sexpr* builtin_make_hashtable(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MAX(count, 2, "make-hash-table takes at most one parameter.");
+
+	int equal = 1;
+	if (count == 2) {
+		sexpr *kind = eval2(vm, env, nodes[1]);
+		ASSERT_NOT_ERR(kind);
+		ASSERT_TYPE(kind, LVAL_SYM, "Expected 'eq? or 'equal?.");
+
+		if (strcmp(kind->sym, "eq?") == 0)
+			equal = 0;
+		else if (strcmp(kind->sym, "equal?") != 0)
+			return sexpr_err(vm, "Expected 'eq? or 'equal?.");
+	}
+
+	return sexpr_hashtable(vm, ht_new(equal));
+}
+
+sexpr* builtin_hashtableq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *t = eval2(vm, env, nodes[1]);
+
+	return sexpr_bool(vm, t->type == LVAL_HASH);
+}
+
+/* (hash-table-ref table key) is an error if key isn't there, but with a
+	third argument that value is returned instead */
+sexpr* builtin_hashtable_ref(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 3, "Expected a hash table, a key and optional default.");
+	ASSERT_PARAM_MAX(count, 4, "Expected a hash table, a key and optional default.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+	sexpr *key = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(key);
+
+	sexpr *val = ht_get(t->ht, key);
+	if (val)
+		return val;
+
+	if (count == 4)
+		return eval2(vm, env, nodes[3]);
+
+	return sexpr_err(vm, "Key not found in hash table.");
+}
+
+sexpr* builtin_hashtable_containsq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected a hash table and a key.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+	sexpr *key = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(key);
+
+	return sexpr_bool(vm, ht_get(t->ht, key) != NULL);
+}
+
+sexpr* builtin_hashtable_set(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 4, "Expected a hash table, a key and a value.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+	sexpr *key = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(key);
+	sexpr *val = eval2(vm, env, nodes[3]);
+	ASSERT_NOT_ERR(val);
+
+	ht_set(t->ht, key, val);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_hashtable_delete(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected a hash table and a key.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+	sexpr *key = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(key);
+
+	ht_delete(t->ht, key);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_hashtable_count(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a hash table.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+
+	return sexpr_num(vm, NUM_TYPE_INT, t->ht->count);
+}
+
+typedef struct collect_state {
+	vm_heap *vm;
+	sexpr *result;
+	char *op;
+} collect_state;
+
+static void collect_entry(sexpr *key, sexpr *val, void *arg) {
+	collect_state *cs = arg;
+
+	if (strcmp(cs->op, "hash-table-keys") == 0)
+		sexpr_append(cs->result, key);
+	else if (strcmp(cs->op, "hash-table-values") == 0)
+		sexpr_append(cs->result, val);
+	else {
+		sexpr *pair = sexpr_list(cs->vm);
+		sexpr_append(pair, key);
+		sexpr_append(pair, val);
+		sexpr_append(cs->result, pair);
+	}
+}
+
+/* hash-table-keys, hash-table-values and hash-table->alist. There aren't
+	dotted pairs in notion so the "alist" is a list of (key value) lists. */
+sexpr* builtin_hashtable_collect(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a hash table.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+
+	collect_state cs = { vm, sexpr_list(vm), op };
+	ht_walk(t->ht, collect_entry, &cs);
+
+	return cs.result;
+}
+
+/* (hash-table-walk table f) calls (f key value) for each entry. We walk a
+	snapshot of the entries so f is free to modify the table. */
+sexpr* builtin_hashtable_walk(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected a hash table and a function.");
+
+	sexpr *t = eval_table(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(t);
+	sexpr *f = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(f);
+	ASSERT_TYPE(f, LVAL_FUN, "Expected a function.");
+
+	collect_state cs = { vm, sexpr_list(vm), "hash-table->alist" };
+	ht_walk(t->ht, collect_entry, &cs);
+
+	for (int j = 0; j < cs.result->count; j++) {
+		sexpr *r = apply_fun(vm, env, f, cs.result->children[j]->children, 2);
+		ASSERT_NOT_ERR(r);
+	}
+
+	return sexpr_null();
+}
+
+void load_hashtable_built_ins(scope *sc) {
+	scope_insert_var(sc, "make-hash-table", sexpr_fun_builtin(&builtin_make_hashtable, "make-hash-table"));
+	scope_insert_var(sc, "hash-table?", sexpr_fun_builtin(&builtin_hashtableq, "hash-table?"));
+	scope_insert_var(sc, "hash-table-ref", sexpr_fun_builtin(&builtin_hashtable_ref, "hash-table-ref"));
+	scope_insert_var(sc, "hash-table-contains?", sexpr_fun_builtin(&builtin_hashtable_containsq, "hash-table-contains?"));
+	scope_insert_var(sc, "hash-table-set!", sexpr_fun_builtin(&builtin_hashtable_set, "hash-table-set!"));
+	scope_insert_var(sc, "hash-table-delete!", sexpr_fun_builtin(&builtin_hashtable_delete, "hash-table-delete!"));
+	scope_insert_var(sc, "hash-table-count", sexpr_fun_builtin(&builtin_hashtable_count, "hash-table-count"));
+	scope_insert_var(sc, "hash-table-keys", sexpr_fun_builtin(&builtin_hashtable_collect, "hash-table-keys"));
+	scope_insert_var(sc, "hash-table-values", sexpr_fun_builtin(&builtin_hashtable_collect, "hash-table-values"));
+	scope_insert_var(sc, "hash-table->alist", sexpr_fun_builtin(&builtin_hashtable_collect, "hash-table->alist"));
+	scope_insert_var(sc, "hash-table-walk", sexpr_fun_builtin(&builtin_hashtable_walk, "hash-table-walk"));
+}
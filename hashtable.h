@@ -0,0 +1,51 @@
+#ifndef hashtable_h
+#define hashtable_h
+
+#include "fwd.h"
+
+/* Open addressing hash table keyed on s-expressions. It backs the Scheme
+	hash table type but is also handy for anything in C that wants to look
+	things up by sexpr.
+
+	Keys are compared with eq? or with equal? (sexpr_cmp) semantics, except
+	that decimal keys have to be exactly equal (with 0.0 and -0.0 the
+	same), as eq?'s near enough can't be hashed. When a table fills up we
+	allocate one twice the size and then move the old entries across a few
+	at a time on each later operation, so no single insert has to rehash
+	the whole table. */
+
+typedef struct hentry {
+	sexpr *key; /* NULL for an empty slot */
+	sexpr *val;
+	unsigned long hash;
+} hentry;
+
+typedef struct htable {
+	int equal;
+	unsigned long count;
+	hentry *slots;
+	unsigned long cap;
+	unsigned long used; /* Live entries plus tombstones in slots */
+	hentry *old; /* The table we're migrating out of, if any */
+	unsigned long old_cap;
+	unsigned long migrated;
+} htable;
+
+unsigned long sexpr_hash(sexpr*, int);
+
+htable* ht_new(int);
+void ht_free(htable*);
+htable* ht_copy(htable*);
+sexpr* ht_get(htable*, sexpr*);
+void ht_set(htable*, sexpr*, sexpr*);
+int ht_delete(htable*, sexpr*);
+void ht_mark(vm_heap*, htable*);
+
+/* Calls f on every live entry. Handy for iterating without caring whether
+	a resize is under way. */
+typedef void (*ht_visitor)(sexpr*, sexpr*, void*);
+void ht_walk(htable*, ht_visitor, void*);
+
+void load_hashtable_built_ins(scope*);
+
+#endif
@@ -0,0 +1,325 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "image.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "nstring.h"
+#include "serialize.h"
+#include "sexpr.h"
+
+typedef struct binding {
+	char *name;
+	message value;
+} binding;
+
+static int cmp_binding(const void *a, const void *b) {
+	return strcmp(((const binding*)a)->name, ((const binding*)b)->name);
+}
+
+/* Built-ins are there already in whatever loads the image. A global that
+	just happens to be bound to one, like (define first car), is saved by
+	the built-in's name. */
+static int is_own_builtin(const char *name, sexpr *v) {
+	return v->type == LVAL_FUN && v->builtin && strcmp(v->sym, name) == 0;
+}
+
+/* An index entry's name, or NULL if it doesn't point at a '\0' terminated
+	string before the index. Names are only checked as they're looked at. */
+static const char* entry_name(image *img, const image_entry *e) {
+	if (e->name >= img->hdr->index)
+		return NULL;
+
+	const char *s = (const char*)img->data + e->name;
+	if (!memchr(s, '\0', img->hdr->index - e->name))
+		return NULL;
+
+	return s;
+}
+
+static sexpr* collect_bindings(vm_heap *vm, scope *global, binding **out, uint32_t *count) {
+	binding *b = NULL;
+	uint32_t n = 0, cap = 0;
+
+	for (unsigned int j = 0; j < global->size; j++) {
+		for (sym *s = global->sym_table[j]; s; s = s->next) {
+			if (is_own_builtin(s->name, s->val))
+				continue;
+
+			if (n == cap) {
+				cap = cap ? cap * 2 : 64;
+				b = realloc(b, cap * sizeof(binding));
+			}
+
+			b[n].name = s->name;
+			b[n].value = (message){ NULL, 0, 0 };
+			sexpr *err = serialize_image(vm, s->val, &b[n].value);
+			if (err) {
+				char msg[512];
+				snprintf(msg, sizeof msg, "Can't save %s: %s", s->name, err->err);
+				for (uint32_t k = 0; k < n; k++)
+					free(b[k].value.data);
+				free(b);
+				return sexpr_err(vm, msg);
+			}
+			n++;
+		}
+	}
+
+	*out = b;
+	*count = n;
+
+	return NULL;
+}
+
+static sexpr* write_image(vm_heap *vm, const char *path, binding *b, uint32_t count) {
+	/* Written off to the side and renamed over the old one, so a program
+		starting up never sees half an image */
+	size_t plen = strlen(path);
+	char *tmp = malloc(plen + 5);
+	memcpy(tmp, path, plen);
+	memcpy(tmp + plen, ".tmp", 5);
+
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		free(tmp);
+		return sexpr_err(vm, "Couldn't open the image file for writing.");
+	}
+
+	image_header hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+	hdr.version = IMAGE_VERSION;
+	hdr.count = count;
+
+	image_entry *index = malloc((count ? count : 1) * sizeof(image_entry));
+	uint64_t pos = sizeof hdr;
+	fwrite(&hdr, sizeof hdr, 1, f);
+
+	for (uint32_t j = 0; j < count; j++) {
+		index[j].value = pos;
+		index[j].len = b[j].value.len;
+		fwrite(b[j].value.data, 1, b[j].value.len, f);
+		pos += b[j].value.len;
+	}
+
+	for (uint32_t j = 0; j < count; j++) {
+		size_t len = strlen(b[j].name) + 1;
+		index[j].name = pos;
+		fwrite(b[j].name, 1, len, f);
+		pos += len;
+	}
+
+	/* The index is read in place, so it has to be aligned */
+	static const char zeros[8] = { 0 };
+	size_t pad = (8 - pos % 8) % 8;
+	fwrite(zeros, 1, pad, f);
+	pos += pad;
+
+	hdr.index = pos;
+	fwrite(index, sizeof(image_entry), count, f);
+	pos += count * sizeof(image_entry);
+	hdr.size = pos;
+
+	fseek(f, 0, SEEK_SET);
+	fwrite(&hdr, sizeof hdr, 1, f);
+	int failed = ferror(f);
+	failed |= fclose(f) != 0;
+	free(index);
+
+	if (failed || rename(tmp, path) != 0) {
+		remove(tmp);
+		free(tmp);
+		return sexpr_err(vm, "Couldn't write the image file.");
+	}
+	free(tmp);
+
+	return NULL;
+}
+
+/* (save-image "file") */
+sexpr* builtin_save_image(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "save-image expects a filename.");
+
+	sexpr *name = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(name);
+	ASSERT_TYPE(name, LVAL_STR, "save-image expects a filename.");
+
+	scope *global = env;
+	while (global->parent)
+		global = global->parent;
+
+	/* Anything still only in an image we loaded from has to come out of
+		it before we can save it again */
+	if (vm->image) {
+		image *img = vm->image;
+		for (uint32_t j = 0; j < img->hdr->count; j++) {
+			const char *s = entry_name(img, &img->index[j]);
+			if (s)
+				scope_fetch_var(vm, global, (char*)s);
+		}
+	}
+
+	binding *b;
+	uint32_t n;
+	sexpr *err = collect_bindings(vm, global, &b, &n);
+	if (err)
+		return err;
+
+	qsort(b, n, sizeof(binding), cmp_binding);
+
+	char *path = nstr_cstr(name->str, name->len);
+	err = write_image(vm, path, b, n);
+	free(path);
+
+	for (uint32_t j = 0; j < n; j++)
+		free(b[j].value.data);
+	free(b);
+
+	return err ? err : sexpr_null();
+}
+
+static sexpr* bad_image(vm_heap *vm, image *img) {
+	image_close(img);
+	return sexpr_err(vm, "Not a usable image file.");
+}
+
+/* Map the image at path and hang it off vm. Gives back an error, or NULL. */
+sexpr* image_open(vm_heap *vm, const char *path) {
+	image *img = calloc(1, sizeof(image));
+
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		free(img);
+		return sexpr_err(vm, "File not found.");
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(image_header)) {
+		close(fd);
+		return bad_image(vm, img);
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return bad_image(vm, img);
+
+	img->data = p;
+	img->size = st.st_size;
+#else
+	/* No mmap, so it's read in whole. It's still only decoded as needed. */
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		free(img);
+		return sexpr_err(vm, "File not found.");
+	}
+
+	fseek(f, 0, SEEK_END);
+	img->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	unsigned char *data = malloc(img->size ? img->size : 1);
+	img->data = data;
+	size_t got = fread(data, 1, img->size, f);
+	fclose(f);
+	if (got != img->size || img->size < sizeof(image_header))
+		return bad_image(vm, img);
+#endif
+
+	img->hdr = (const image_header*)img->data;
+	const image_header *hdr = img->hdr;
+	if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+			|| hdr->version != IMAGE_VERSION || hdr->size != img->size
+			|| hdr->index % 8 != 0 || hdr->index > img->size
+			|| (img->size - hdr->index) / sizeof(image_entry) < hdr->count)
+		return bad_image(vm, img);
+
+	img->index = (const image_entry*)(img->data + hdr->index);
+
+	if (vm->image)
+		image_close(vm->image);
+	vm->image = img;
+
+	return NULL;
+}
+
+/* Called when name isn't bound in global. If the image has it, it's
+	decoded, bound and given back, otherwise we give back NULL. The header
+	was all image_open() checked, so if the part of the file we need turns
+	out to be garbage we give back an error rather than believe it. */
+sexpr* image_fetch(vm_heap *vm, scope *global, const char *name) {
+	image *img = vm->image;
+	const image_entry *found = NULL;
+
+	long lo = 0, hi = (long)img->hdr->count - 1;
+	while (lo <= hi) {
+		long mid = (lo + hi) / 2;
+		const char *s = entry_name(img, &img->index[mid]);
+		if (!s)
+			return sexpr_err(vm, "Not a usable image file.");
+
+		int c = strcmp(name, s);
+		if (c == 0) {
+			found = &img->index[mid];
+			break;
+		}
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	if (!found)
+		return NULL;
+	if (found->value > img->size || img->size - found->value < found->len)
+		return sexpr_err(vm, "Not a usable image file.");
+
+	/* A future could be after the same name. Whoever gets the lock second
+		finds it already bound. */
+	vm_lock(vm);
+	sexpr *v = NULL;
+	for (sym *s = global->sym_table[bt_hash(global->size, (char*)name)]; s; s = s->next) {
+		if (strcmp(s->name, name) == 0) {
+			v = s->val;
+			break;
+		}
+	}
+
+	if (!v) {
+		v = deserialize_bytes(vm, global, img->data + found->value, found->len);
+		if (v)
+			scope_insert_var(global, (char*)name, v);
+		else
+			v = sexpr_err(vm, "Not a usable image file.");
+	}
+	vm_unlock(vm);
+
+	return v;
+}
+
+void image_close(image *img) {
+	if (img->data) {
+#ifndef _WIN32
+		munmap((void*)img->data, img->size);
+#else
+		free((void*)img->data);
+#endif
+	}
+
+	free(img);
+}
+
+void load_image_built_ins(scope *sc) {
+	scope_insert_var(sc, "save-image", sexpr_fun_builtin(&builtin_save_image, "save-image"));
+}
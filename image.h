@@ -0,0 +1,54 @@
+#ifndef image_h
+#define image_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fwd.h"
+
+/* Heap images. (save-image "file") writes out every global binding that
+	isn't a built-in, and notion --image file starts with them already
+	defined, without tokenizing, parsing or evaluating whatever made them.
+
+	The file is mapped rather than read, and nothing in it is a pointer:
+	it's a header, the values one after another in serialize.h's format,
+	the names, and an index of (name, value) offsets sorted by name. At
+	startup only the header is checked. A binding is decoded onto the heap
+	the first time its name is looked up and isn't already bound, so
+	startup costs the same however big the image is, and a program only
+	pays for the parts of it it uses.
+
+	Each binding is saved separately, so two globals that were the same
+	hash table come back as two hash tables with the same contents.
+	Functions refer to other globals by name, so they're unaffected. */
+
+#define IMAGE_MAGIC "NOTNIMG"
+#define IMAGE_VERSION 1
+
+typedef struct image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count; /* How many bindings */
+	uint64_t index; /* Offset of the index */
+	uint64_t size; /* Of the whole file */
+} image_header;
+
+typedef struct image_entry {
+	uint64_t name; /* Offset of the '\0' terminated name */
+	uint64_t value; /* Offset and length of the value */
+	uint64_t len;
+} image_entry;
+
+typedef struct image {
+	const unsigned char *data;
+	size_t size;
+	const image_header *hdr;
+	const image_entry *index;
+} image;
+
+sexpr* image_open(vm_heap*, const char*);
+sexpr* image_fetch(vm_heap*, scope*, const char*);
+void image_close(image*);
+void load_image_built_ins(scope*);
+
+#endif
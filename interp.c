@@ -0,0 +1,353 @@
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "futures.h"
+#include "serialize.h"
+#include "sexpr.h"
+#include "stack.h"
+
+#define INTERP_STACK_SIZE (8 * 1024 * 1024)
+
+/* Gives back NULL if there isn't memory for it */
+static channel* channel_new(size_t capacity) {
+	size_t cap = 2;
+	while (cap < capacity)
+		cap *= 2;
+
+	/* Rounded up since aligned_alloc() wants a multiple of the alignment */
+	size_t size = (sizeof(channel) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	channel *c = aligned_alloc(CACHE_LINE, size);
+	if (!c)
+		return NULL;
+
+	c->slots = calloc(cap, sizeof(channel_slot));
+	if (!c->slots) {
+		free(c);
+		return NULL;
+	}
+	for (size_t j = 0; j < cap; j++)
+		atomic_init(&c->slots[j].seq, j);
+	c->mask = cap - 1;
+	atomic_init(&c->refs, 1);
+	atomic_init(&c->head, 0);
+	atomic_init(&c->tail, 0);
+	atomic_init(&c->waiters, 0);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->changed, NULL);
+
+	return c;
+}
+
+void channel_ref(channel *c) {
+	atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+void channel_release(channel *c) {
+	if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	/* Anything nobody got round to receiving */
+	size_t tail = atomic_load(&c->tail);
+	size_t head = atomic_load(&c->head);
+	for (size_t pos = tail; pos != head; pos++)
+		message_discard(&c->slots[pos & c->mask].msg);
+
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->changed);
+	free(c->slots);
+	free(c);
+}
+
+/* A slot whose seq equals pos is free for whoever claims pos to send to.
+	Once filled its seq becomes pos + 1, which tells the receiver that
+	claims pos it's ready. Receiving sets it to pos + the capacity, ready
+	for the sender that comes round to it next time. */
+static int try_send(channel *c, message *m) {
+	size_t pos = atomic_load_explicit(&c->head, memory_order_relaxed);
+
+	for (;;) {
+		channel_slot *s = &c->slots[pos & c->mask];
+		size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				s->msg = *m;
+				atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+				return 1;
+			}
+		}
+		else if (dif < 0)
+			return 0; /* Full */
+		else
+			pos = atomic_load_explicit(&c->head, memory_order_relaxed);
+	}
+}
+
+static int try_recv(channel *c, message *m) {
+	size_t pos = atomic_load_explicit(&c->tail, memory_order_relaxed);
+
+	for (;;) {
+		channel_slot *s = &c->slots[pos & c->mask];
+		size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				*m = s->msg;
+				atomic_store_explicit(&s->seq, pos + c->mask + 1, memory_order_release);
+				return 1;
+			}
+		}
+		else if (dif < 0)
+			return 0; /* Empty */
+		else
+			pos = atomic_load_explicit(&c->tail, memory_order_relaxed);
+	}
+}
+
+/* Wake anyone waiting on c. The fence pairs with the one in wait_until():
+	either they see what we just did or we see that they're waiting. */
+static void notify(channel *c) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&c->waiters, memory_order_relaxed) == 0)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	pthread_cond_broadcast(&c->changed);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void wait_until(channel *c, int (*op)(channel*, message*), message *m) {
+	if (op(c, m))
+		return;
+
+	atomic_fetch_add(&c->waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	pthread_mutex_lock(&c->lock);
+	while (!op(c, m))
+		pthread_cond_wait(&c->changed, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	atomic_fetch_sub(&c->waiters, 1);
+}
+
+static void channel_send(channel *c, message *m) {
+	wait_until(c, try_send, m);
+	notify(c);
+}
+
+static void channel_recv(channel *c, message *m) {
+	wait_until(c, try_recv, m);
+	notify(c);
+}
+
+typedef struct interp_start {
+	message call; /* ((name value ...) f arg ...) */
+	channel *result;
+} interp_start;
+
+static void* interp_main(void *arg) {
+	interp_start *st = arg;
+
+	stack_init();
+	vm_heap *vm = vm_new();
+	scope *global = scope_new(GLOBAL_TABLE_SIZE);
+	load_built_ins(global);
+
+	sexpr *call = deserialize(vm, global, &st->call);
+	sexpr *globals = call->children[0];
+	for (int j = 0; j < globals->count; j += 2)
+		scope_insert_var(global, globals->children[j]->sym, globals->children[j + 1]);
+
+	sexpr *result = apply_fun(vm, global, call->children[1], call->children + 2, call->count - 2);
+
+	/* Anything it started has to finish before its heap goes */
+	futures_drain(vm);
+
+	message out = { NULL, 0, 0 };
+	sexpr *err = serialize(vm, result, &out);
+	if (err)
+		serialize(vm, err, &out);
+	channel_send(st->result, &out);
+	channel_release(st->result);
+	free(st);
+
+	free_built_ins(global);
+	scope_free(global);
+	vm_free(vm);
+	free(vm);
+
+	return NULL;
+}
+
+static sexpr* eval_channel(vm_heap *vm, scope *env, sexpr *node) {
+	sexpr *c = eval2(vm, env, node);
+	ASSERT_NOT_ERR(c);
+	ASSERT_TYPE(c, LVAL_CHANNEL, "Expected a channel.");
+
+	return c;
+}
+
+static int can_send(sexpr *v) {
+	return v->type != LVAL_ERR && v->type != LVAL_CONT && v->type != LVAL_CORO
+		&& v->type != LVAL_FUTURE && v->type != LVAL_STRBUILDER
+		&& !(v->type == LVAL_FUN && v->builtin);
+}
+
+/* Functions lean on globals, so the new interpreter gets a copy of every
+	global v mentions, and every global those mention, and so on. found is
+	kept as (name value name value ...). */
+static void collect_globals(vm_heap *vm, scope *global, sexpr *v, sexpr *found) {
+	if (v->type == LVAL_SYM) {
+		for (int j = 0; j < found->count; j += 2) {
+			if (strcmp(found->children[j]->sym, v->sym) == 0)
+				return;
+		}
+
+		sexpr *val = scope_fetch_var(vm, global, v->sym);
+		if (!can_send(val))
+			return;
+
+		sexpr_append(found, v);
+		sexpr_append(found, val);
+		collect_globals(vm, global, val, found);
+	}
+	else if (v->type == LVAL_LIST) {
+		for (int j = 0; j < v->count; j++)
+			collect_globals(vm, global, v->children[j], found);
+	}
+	else if (v->type == LVAL_FUN && !v->builtin) {
+		collect_globals(vm, global, v->body, found);
+		if (v->captured)
+			collect_globals(vm, global, v->captured, found);
+	}
+}
+
+/* (interp-spawn f arg ...) */
+sexpr* builtin_interp_spawn(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 2, "interp-spawn expects a function and its arguments.");
+
+	sexpr *call = sexpr_list(vm);
+	sexpr_append(call, sexpr_list(vm));
+	for (int j = 1; j < count; j++) {
+		sexpr *v = eval2(vm, env, nodes[j]);
+		ASSERT_NOT_ERR(v);
+		sexpr_append(call, v);
+	}
+	ASSERT_TYPE(call->children[1], LVAL_FUN, "interp-spawn expects a function and its arguments.");
+
+	scope *global = env;
+	while (global->parent)
+		global = global->parent;
+	for (int j = 1; j < call->count; j++)
+		collect_globals(vm, global, call->children[j], call->children[0]);
+
+	interp_start *st = malloc(sizeof(interp_start));
+	st->call = (message){ NULL, 0, 0 };
+	sexpr *err = serialize(vm, call, &st->call);
+	if (err) {
+		free(st);
+		return err;
+	}
+
+	st->result = channel_new(1);
+	if (!st->result) {
+		message_discard(&st->call);
+		free(st);
+		return sexpr_err(vm, "Out of memory for the channel.");
+	}
+	channel_ref(st->result);
+	sexpr *result = sexpr_channel(vm, st->result);
+
+	pthread_t t;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, INTERP_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int failed = pthread_create(&t, &attr, interp_main, st);
+	pthread_attr_destroy(&attr);
+
+	if (failed) {
+		message_discard(&st->call);
+		channel_release(st->result);
+		free(st);
+		return sexpr_err(vm, "Couldn't start a thread for the interpreter.");
+	}
+
+	return result;
+}
+
+/* (make-channel) or (make-channel capacity) */
+sexpr* builtin_make_channel(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MAX(count, 2, "make-channel takes at most a capacity.");
+
+	long capacity = CHANNEL_DEFAULT_CAPACITY;
+	if (count == 2) {
+		sexpr *n = eval2(vm, env, nodes[1]);
+		ASSERT_NOT_ERR(n);
+		if (n->type != LVAL_NUM || n->num_type != NUM_TYPE_INT || n->i_num < 1)
+			return sexpr_err(vm, "The capacity must be a positive integer.");
+		if (n->i_num > CHANNEL_MAX_CAPACITY)
+			return sexpr_err(vm, "The capacity is too big.");
+		capacity = n->i_num;
+	}
+
+	channel *c = channel_new(capacity);
+	if (!c)
+		return sexpr_err(vm, "Out of memory for the channel.");
+
+	return sexpr_channel(vm, c);
+}
+
+sexpr* builtin_channel_send(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "channel-send! expects a channel and a value.");
+
+	sexpr *c = eval_channel(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(c);
+
+	sexpr *v = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(v);
+
+	message m = { NULL, 0, 0 };
+	sexpr *err = serialize(vm, v, &m);
+	if (err)
+		return err;
+
+	channel_send(c->chan, &m);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_channel_recv(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "channel-recv expects a channel.");
+
+	sexpr *c = eval_channel(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(c);
+
+	message m;
+	channel_recv(c->chan, &m);
+
+	scope *global = env;
+	while (global->parent)
+		global = global->parent;
+
+	return deserialize(vm, global, &m);
+}
+
+void load_interp_built_ins(scope *sc) {
+	scope_insert_var(sc, "interp-spawn", sexpr_fun_builtin(&builtin_interp_spawn, "interp-spawn"));
+	scope_insert_var(sc, "make-channel", sexpr_fun_builtin(&builtin_make_channel, "make-channel"));
+	scope_insert_var(sc, "channel-send!", sexpr_fun_builtin(&builtin_channel_send, "channel-send!"));
+	scope_insert_var(sc, "channel-recv", sexpr_fun_builtin(&builtin_channel_recv, "channel-recv"));
+}
@@ -0,0 +1,60 @@
+#ifndef interp_h
+#define interp_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "fwd.h"
+#include "serialize.h"
+
+/* Separate interpreters, each with its own heap, global scope and OS
+	thread, that talk to each other over channels. Nothing is shared
+	between their heaps, so each can allocate and collect without caring
+	what the others are up to.
+
+	(interp-spawn f arg ...) starts a fresh interpreter, copies f and the
+	args over to it and calls f there. It gives back a channel that the
+	result turns up on once f returns. Any globals f refers to, directly or
+	through other functions, are copied over as well.
+
+	(make-channel) or (make-channel capacity) makes a bounded channel.
+	(channel-send! ch v) copies v into it, waiting if it's full, and
+	(channel-recv ch) takes the oldest value out, waiting if it's empty.
+	Values go through serialize.h, so what arrives is a copy. Channels
+	themselves can be sent, which is how interpreters get hold of each
+	other's.
+
+	The channel is a lock-free bounded queue (Dmitry Vyukov's MPMC design):
+	each slot has a sequence number saying whose turn it is, and senders
+	and receivers each claim a position with a compare and swap. Only a
+	thread that has to wait for room or for a value touches the lock. */
+
+#define CHANNEL_DEFAULT_CAPACITY 64
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+#define CACHE_LINE 64
+
+typedef struct channel_slot {
+	atomic_size_t seq;
+	message msg;
+} channel_slot;
+
+typedef struct channel {
+	channel_slot *slots;
+	size_t mask;
+	atomic_int refs;
+
+	/* Senders and receivers hammer on these, so each gets a cache line */
+	_Alignas(CACHE_LINE) atomic_size_t head; /* Next position to send to */
+	_Alignas(CACHE_LINE) atomic_size_t tail; /* Next position to receive from */
+
+	_Alignas(CACHE_LINE) atomic_int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} channel;
+
+void channel_ref(channel*);
+void channel_release(channel*);
+void load_interp_built_ins(scope*);
+
+#endif
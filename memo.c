@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memo.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "hashtable.h"
+#include "sexpr.h"
+
+#define MEMO_MIN_BUCKETS 16
+
+/* The buckets start small and grow with the cache (see memo_store), since
+	the limit is whatever the user asked for and may never be reached.
+	Gives back NULL if there isn't the memory even for that. */
+memo_cache* memo_new(unsigned long limit) {
+	memo_cache *c = malloc(sizeof(memo_cache));
+	if (!c)
+		return NULL;
+
+	c->bucket_count = MEMO_MIN_BUCKETS;
+	c->buckets = calloc(c->bucket_count, sizeof(memo_entry*));
+	if (!c->buckets) {
+		free(c);
+		return NULL;
+	}
+
+	c->size = 0;
+	c->limit = limit;
+	c->hits = 0;
+	c->misses = 0;
+	c->newest = NULL;
+	c->oldest = NULL;
+	pthread_mutex_init(&c->lock, NULL);
+
+	return c;
+}
+
+void memo_clear(memo_cache *c) {
+	pthread_mutex_lock(&c->lock);
+
+	memo_entry *e = c->newest;
+	while (e) {
+		memo_entry *next = e->older;
+		free(e);
+		e = next;
+	}
+
+	memset(c->buckets, 0, c->bucket_count * sizeof(memo_entry*));
+	c->size = 0;
+	c->newest = NULL;
+	c->oldest = NULL;
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+void memo_free(memo_cache *c) {
+	memo_clear(c);
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
+
+static void lru_unlink(memo_cache *c, memo_entry *e) {
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		c->newest = e->older;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		c->oldest = e->newer;
+}
+
+static void lru_push(memo_cache *c, memo_entry *e) {
+	e->newer = NULL;
+	e->older = c->newest;
+
+	if (c->newest)
+		c->newest->newer = e;
+	else
+		c->oldest = e;
+	c->newest = e;
+}
+
+static void evict_oldest(memo_cache *c) {
+	memo_entry *e = c->oldest;
+	memo_entry **p = &c->buckets[e->hash & (c->bucket_count - 1)];
+
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+
+	lru_unlink(c, e);
+	free(e);
+	c->size--;
+}
+
+/* Twice the buckets, once there are more entries than buckets. If we can't
+	get them the chains just get longer. */
+static void grow(memo_cache *c) {
+	unsigned long count = c->bucket_count * 2;
+	memo_entry **buckets = calloc(count, sizeof(memo_entry*));
+	if (!buckets)
+		return;
+
+	for (memo_entry *e = c->newest; e; e = e->older) {
+		unsigned long b = e->hash & (count - 1);
+		e->chain = buckets[b];
+		buckets[b] = e;
+	}
+
+	free(c->buckets);
+	c->buckets = buckets;
+	c->bucket_count = count;
+}
+
+sexpr* memo_lookup(memo_cache *c, sexpr *args) {
+	unsigned long h = sexpr_hash(args, 1);
+
+	pthread_mutex_lock(&c->lock);
+
+	memo_entry *e = c->buckets[h & (c->bucket_count - 1)];
+	while (e && !(e->hash == h && sexpr_cmp(e->args, args)))
+		e = e->chain;
+
+	if (!e) {
+		c->misses++;
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+
+	c->hits++;
+	if (c->newest != e) {
+		lru_unlink(c, e);
+		lru_push(c, e);
+	}
+
+	sexpr *val = e->val;
+	pthread_mutex_unlock(&c->lock);
+
+	return val;
+}
+
+void memo_store(memo_cache *c, sexpr *args, sexpr *val) {
+	if (c->limit == 0)
+		return;
+
+	memo_entry *e = malloc(sizeof(memo_entry));
+	if (!e)
+		return;
+	e->args = args;
+	e->val = val;
+	e->hash = sexpr_hash(args, 1);
+
+	pthread_mutex_lock(&c->lock);
+
+	if (c->size >= c->limit)
+		evict_oldest(c);
+
+	unsigned long b = e->hash & (c->bucket_count - 1);
+	e->chain = c->buckets[b];
+	c->buckets[b] = e;
+
+	lru_push(c, e);
+	c->size++;
+	if (c->size > c->bucket_count)
+		grow(c);
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+void memo_mark(vm_heap *vm, memo_cache *c) {
+	for (memo_entry *e = c->newest; e; e = e->older) {
+		mark_chain(vm, e->args);
+		mark_chain(vm, e->val);
+	}
+}
+
+/* A memoized function shares the original's parameters and body. Only the
+	cache is new. */
+static sexpr* memoize_fun(vm_heap *vm, sexpr *f, unsigned long limit) {
+	if (f->type != LVAL_FUN || f->builtin)
+		return sexpr_err(vm, "Only user-defined functions can be memoized.");
+
+	sexpr *m = sexpr_fun_user(vm, f->params, f->body, f->sym);
+	m->captured = f->captured;
+	m->memo = memo_new(limit);
+	if (!m->memo)
+		return sexpr_err(vm, "Out of memory for the cache.");
+
+	return m;
+}
+
+static sexpr* eval_limit(vm_heap *vm, scope *env, sexpr *node, unsigned long *limit) {
+	sexpr *n = eval2(vm, env, node);
+	ASSERT_NOT_ERR(n);
+	ASSERT_TYPE(n, LVAL_NUM, "The cache size must be a number.");
+	if (n->num_type != NUM_TYPE_INT || n->i_num < 0)
+		return sexpr_err(vm, "The cache size must be a non-negative integer.");
+
+	*limit = n->i_num;
+
+	return n;
+}
+
+/* (memoize f) or (memoize f cache-size) returns a memoized version of f.
+	Note that for recursive calls to go through the cache, f's name has to
+	be rebound to the result: (define fib (memoize fib)) */
+sexpr* builtin_memoize(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 2, "Expected a function and optional cache size.");
+	ASSERT_PARAM_MAX(count, 3, "Expected a function and optional cache size.");
+
+	sexpr *f = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+
+	unsigned long limit = MEMO_DEFAULT_LIMIT;
+	if (count == 3) {
+		sexpr *n = eval_limit(vm, env, nodes[2], &limit);
+		ASSERT_NOT_ERR(n);
+	}
+
+	return memoize_fun(vm, f, limit);
+}
+
+/* (define-memo (f x) ...) or (define-memo f (lambda ...)) works just like
+	define and then swaps the binding for a memoized version */
+sexpr* builtin_define_memo(vm_heap *vm, scope *sc, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 3, "Invalid definition.");
+
+	char *name = NULL;
+	if (nodes[1]->type == LVAL_SYM)
+		name = nodes[1]->sym;
+	else if (nodes[1]->type == LVAL_LIST && nodes[1]->count > 0
+			&& nodes[1]->children[0]->type == LVAL_SYM)
+		name = nodes[1]->children[0]->sym;
+	else
+		return sexpr_err(vm, "Define-memo: symbol or list expected.");
+
+	sexpr *r = define(vm, sc, nodes, count, op);
+	ASSERT_NOT_ERR(r);
+
+	sexpr *m = memoize_fun(vm, scope_fetch_var(vm, sc, name), MEMO_DEFAULT_LIMIT);
+	ASSERT_NOT_ERR(m);
+	scope_insert_var(sc, name, m);
+
+	return sexpr_null();
+}
+
+static sexpr* eval_memo_fun(vm_heap *vm, scope *env, sexpr *node) {
+	sexpr *f = eval2(vm, env, node);
+	ASSERT_NOT_ERR(f);
+
+	if (f->type != LVAL_FUN || !f->memo)
+		return sexpr_err(vm, "Expected a memoized function.");
+
+	return f;
+}
+
+/* (memo-stats f) gives back (hits misses size limit) */
+sexpr* builtin_memo_stats(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a memoized function.");
+
+	sexpr *f = eval_memo_fun(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+
+	sexpr *stats = sexpr_list(vm);
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, f->memo->hits));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, f->memo->misses));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, f->memo->size));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, f->memo->limit));
+
+	return stats;
+}
+
+sexpr* builtin_memo_clear(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected a memoized function.");
+
+	sexpr *f = eval_memo_fun(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+
+	memo_clear(f->memo);
+	pthread_mutex_lock(&f->memo->lock);
+	f->memo->hits = 0;
+	f->memo->misses = 0;
+	pthread_mutex_unlock(&f->memo->lock);
+
+	return sexpr_null();
+}
+
+void load_memo_built_ins(scope *sc) {
+	scope_insert_var(sc, "memoize", sexpr_fun_builtin(&builtin_memoize, "memoize"));
+	scope_insert_var(sc, "define-memo", sexpr_fun_builtin(&builtin_define_memo, "define-memo"));
+	scope_insert_var(sc, "memo-stats", sexpr_fun_builtin(&builtin_memo_stats, "memo-stats"));
+	scope_insert_var(sc, "memo-clear!", sexpr_fun_builtin(&builtin_memo_clear, "memo-clear!"));
+}
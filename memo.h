@@ -0,0 +1,52 @@
+#ifndef memo_h
+#define memo_h
+
+#include <pthread.h>
+
+#include "fwd.h"
+
+/* Result caches for memoized functions. Each memoized function owns one,
+	keyed on the list of its (evaluated) arguments and compared with
+	sexpr_cmp, so structurally equal arguments hit the same entry. The
+	cache only hangs on to the least recently used entries up to its limit.
+
+	The cache is reachable only through the function that owns it, so the
+	GC only treats the cached values as live while the function is.
+
+	Futures on different threads can call the same memoized function, so
+	lookups and stores hold the cache's lock. Even a hit reorders the LRU
+	list. */
+
+#define MEMO_DEFAULT_LIMIT 1024
+
+typedef struct memo_entry {
+	sexpr *args;
+	sexpr *val;
+	unsigned long hash;
+	struct memo_entry *chain; /* Next entry in the same bucket */
+	struct memo_entry *newer;
+	struct memo_entry *older;
+} memo_entry;
+
+typedef struct memo_cache {
+	memo_entry **buckets;
+	unsigned long bucket_count;
+	unsigned long size;
+	unsigned long limit;
+	unsigned long hits;
+	unsigned long misses;
+	memo_entry *newest;
+	memo_entry *oldest;
+	pthread_mutex_t lock;
+} memo_cache;
+
+memo_cache* memo_new(unsigned long);
+void memo_free(memo_cache*);
+void memo_clear(memo_cache*);
+sexpr* memo_lookup(memo_cache*, sexpr*);
+void memo_store(memo_cache*, sexpr*, sexpr*);
+void memo_mark(vm_heap*, memo_cache*);
+
+void load_memo_built_ins(scope*);
+
+#endif
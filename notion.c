@@ -1,86 +1,318 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #ifndef _WIN32
+#include <unistd.h>
 #include <editline/readline.h>
 #endif
 
 #include "environment.h"
 #include "evaluator.h"
+#include "fasl.h"
+#include "futures.h"
+#include "image.h"
+#include "optimize.h"
 #include "parser.h"
+#include "server.h"
 #include "sexpr.h"
+#include "stack.h"
 #include "tokenizer.h"
 #include "util.h"
 
 #define MAX_LINE_LENGTH 999
-#define DEFAULT_TABLE_SIZE 1019
+/* Batch mode output goes through a big buffer rather than a line at a time */
+#define BATCH_BUFFER_SIZE (64 * 1024)
 
-int main(int argc, char **argv) {
+enum run_status { RUN_OK, RUN_ERROR, RUN_QUIT };
+
+/* From --image, see image.h */
+static const char *image_path = NULL;
+
+/* Gives back 0 if there was an image and it couldn't be used */
+static int open_image(vm_heap *vm) {
+	if (!image_path)
+		return 1;
+
+	sexpr *err = image_open(vm, image_path);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", image_path, err->err);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void usage(void) {
+	fputs("Usage: notion                  start the REPL\n"
+		"       notion -i               start the REPL even if stdin isn't a terminal\n"
+		"       notion [file ...]       run each file in turn\n"
+		"       notion -e expr          evaluate expr (can be given more than once)\n"
+		"       notion -                run what's piped in on stdin\n"
+		"       notion --serve sock [file ...]\n"
+		"                               load the files and answer requests on sock\n"
+		"       notion --compile file ...\n"
+		"                               write the fast-load cache for each file\n"
+		"Any of these can start with --image file, to begin with what\n"
+		"(save-image \"file\") saved.\n", stderr);
+}
+
+/* Prints each result the way load does. We only collect between
+	top-level expressions and only once the heap has grown enough to make
+	it worth it. */
+static void print_result(vm_heap *vm, scope *global, sexpr *result) {
+	if (result->type != LVAL_NULL) {
+		sexpr_pprint(result);
+		putchar('\n');
+	}
+
+	gc_maybe(vm, global);
+}
+
+/* Evaluate everything tk has. Errors go to stderr and stop the run. */
+static enum run_status run(vm_heap *vm, scope *global, tokenizer *tk, const char *name) {
+	sexpr *result = eval_all(vm, global, tk, print_result);
+	if (result->type != LVAL_ERR)
+		return RUN_OK;
+	if (strcmp(result->err, "<quit>") == 0)
+		return RUN_QUIT;
+
+	/* So the error turns up after whatever was printed before it */
+	fflush(stdout);
+	fprintf(stderr, "%s: %s\n", name, result->err);
+
+	return RUN_ERROR;
+}
+
+/* notion file.scm ..., notion -e '(expr)' or something piped in. No
+	banners, no readline, and the exit status says whether it all worked. */
+static int batch(int argc, char **argv) {
+	setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+
+	vm_heap *vm = vm_new();
+	stack_init();
+	scope *global = scope_new(GLOBAL_TABLE_SIZE);
+	load_built_ins(global);
+
+	enum run_status status = open_image(vm) ? RUN_OK : RUN_ERROR;
+	int sources = 0;
+	for (int j = 1; j < argc && status == RUN_OK; j++) {
+		tokenizer *tk = tokenizer_new();
+		const char *name = argv[j];
+
+		if (strcmp(argv[j], "-h") == 0 || strcmp(argv[j], "--help") == 0) {
+			usage();
+			tokenizer_free(tk);
+			status = RUN_QUIT;
+			break;
+		}
+		else if (strcmp(argv[j], "-e") == 0) {
+			if (++j == argc) {
+				usage();
+				tokenizer_free(tk);
+				status = RUN_ERROR;
+				break;
+			}
+			tokenizer_feed_buffer(tk, argv[j], strlen(argv[j]));
+			name = "-e";
+		}
+		else if (strcmp(argv[j], "-") == 0) {
+			start_stream(tk, stdin);
+			name = "stdin";
+		}
+		else if (!start_file(tk, argv[j])) {
+			fprintf(stderr, "%s: File not found.\n", argv[j]);
+			tokenizer_free(tk);
+			status = RUN_ERROR;
+			break;
+		}
+
+		status = run(vm, global, tk, name);
+		tokenizer_free(tk);
+		sources++;
+	}
+
+	/* Nothing given on the command line, so it's whatever is being piped
+		in */
+	if (sources == 0 && status == RUN_OK) {
+		tokenizer *tk = tokenizer_new();
+		start_stream(tk, stdin);
+		status = run(vm, global, tk, "stdin");
+		tokenizer_free(tk);
+	}
+
+	/* Anything still running is using the heap */
+	futures_drain(vm);
+	free_built_ins(global);
+	scope_free(global);
+	vm_free(vm);
+	free(vm);
+
+	return status == RUN_ERROR ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* notion --compile file ... makes the caches load would otherwise make the
+	first time it read each file (see fasl.h) */
+static int compile(char **files, int count) {
+	vm_heap *vm = vm_new();
+	scope *global = scope_new(GLOBAL_TABLE_SIZE);
+	int status = EXIT_SUCCESS;
+
+	for (int j = 0; j < count; j++) {
+		sexpr *r = fasl_compile(vm, global, files[j]);
+		if (r->type == LVAL_ERR) {
+			fprintf(stderr, "%s: %s\n", files[j], r->err);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	scope_free(global);
+	vm_free(vm);
+	free(vm);
+
+	return status;
+}
+
+static int repl(void) {
 	puts("Notion (Dana's toy Scheme) 0.8.3");
 	puts("Press Ctrl-C or (quit) to exit");
 
 	puts("Loading start-up environment...");
 
-	srand(time(NULL));
-
 	vm_heap *vm = vm_new();
-	scope *global =  scope_new(DEFAULT_TABLE_SIZE);
+	stack_init();
+	scope *global =  scope_new(GLOBAL_TABLE_SIZE);
 
 	load_built_ins(global);
+	if (!open_image(vm)) {
+		free_built_ins(global);
+		scope_free(global);
+		vm_free(vm);
+		free(vm);
+		return EXIT_FAILURE;
+	}
+
 	tokenizer *tz = tokenizer_new();
 	parser *p = parser_new(tz);
 
 	char *line;
-	while (1) {
+	int quit = 0;
+	while (!quit) {
+		/* A different prompt while we wait on the rest of an expression */
+		const char *prompt = parser_pending(p) ? "  " : "> ";
 #ifdef _WIN32
 		line = malloc(sizeof(char) * (MAX_LINE_LENGTH + 1));
-		printf("> ");
-		fgets(line, MAX_LINE_LENGTH, stdin);
-		char *cp = strchr(line, '\n');
+		fputs(prompt, stdout);
+		if (!fgets(line, MAX_LINE_LENGTH, stdin)) {
+			free(line);
+			line = NULL;
+		}
+		char *cp = line ? strchr(line, '\n') : NULL;
 		if (cp) {
 			*cp = '\0';
 		}
 #else
-		line = readline("> ");
+		line = readline(prompt);
 
-		add_history(line);
+		if (line && *line)
+			add_history(line);
 #endif
-		/* Read in an expression from the user */
-		if (is_whitespace(line)) {
+		/* End of input. Anything left unfinished is an error. */
+		if (!line) {
+			putchar('\n');
+			tokenizer_end_input(tz);
+			sexpr *ast;
+			if (parser_next(vm, p, &ast) == PARSE_DATUM && ast->type == LVAL_ERR) {
+				sexpr_pprint(ast);
+				putchar('\n');
+			}
+			break;
+		}
+
+		if (is_whitespace(line) && !parser_pending(p)) {
 			free(line);
 			putchar('\n');
 			continue;
 		}
 
-		tokenizer_feed_line(tz, line);
-		sexpr *ast = get_next_expr(vm, p);
+		/* Every expression the line finishes gets evaluated. One it only
+			starts waits for the lines after it. */
+		tokenizer_feed(tz, line, strlen(line));
+		tokenizer_feed(tz, "\n", 1);
 		free(line);
 
-		if (ast->type == LVAL_ERR) {
-			sexpr_pprint(ast);
-			putchar('\n');
-			continue;
-		}
+		sexpr *ast;
+		while (!quit && parser_next(vm, p, &ast) == PARSE_DATUM) {
+			if (ast->type == LVAL_ERR) {
+				sexpr_pprint(ast);
+				putchar('\n');
+				continue;
+			}
 
-		sexpr *result = eval2(vm, global, ast);
+			sexpr *result = eval2(vm, global, optimize(vm, global, ast));
 
-		if (result->type == LVAL_ERR && strcmp(result->err, "<quit>") == 0) {
-			puts("Notion exiting.");
-			break;
-		}
+			if (result->type == LVAL_ERR && strcmp(result->err, "<quit>") == 0) {
+				puts("Notion exiting.");
+				quit = 1;
+				break;
+			}
 
-		sexpr_pprint(result);
-		putchar('\n');
-		puts("\nGarbage check:");
-		gc_run(vm, global);
+			sexpr_pprint(result);
+			putchar('\n');
+			puts("\nGarbage check:");
+			long swept = gc_run(vm, global);
+			if (swept < 0)
+				puts("Futures are still running, skipping garbage collection.");
+			else
+				printf("%ld s-exprs deleted.\n", swept);
+		}
 	}
 
 	tokenizer_free(tz);
 	parser_free(p);
+	free_built_ins(global);
 	scope_free(global);
 	vm_free(vm);
+	free(vm);
 
 	return 0;
 }
+
+int main(int argc, char **argv) {
+	/* Everything else works the same with or without an image, so it's
+		taken off the front and the rest carries on as usual */
+	if (argc > 1 && strcmp(argv[1], "--image") == 0) {
+		if (argc < 3) {
+			usage();
+			return EXIT_FAILURE;
+		}
+		image_path = argv[2];
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "-i") == 0)
+		return repl();
+
+	if (argc > 1 && strcmp(argv[1], "--compile") == 0)
+		return compile(argv + 2, argc - 2);
+
+	if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+		if (argc < 3) {
+			usage();
+			return EXIT_FAILURE;
+		}
+		return serve(argv[2], image_path, argv + 3, argc - 3);
+	}
+
+#ifdef _WIN32
+	int interactive = argc == 1;
+#else
+	int interactive = argc == 1 && isatty(STDIN_FILENO);
+#endif
+
+	return interactive ? repl() : batch(argc, argv);
+}
@@ -0,0 +1,83 @@
+#ifndef notion_h
+#define notion_h
+
+#include <stddef.h>
+
+/* The interpreter as a library, for programs that want to evaluate Scheme
+	without running the REPL. Build it with make lib, which gives
+	libnotion.a and libnotion.so, and include just this header.
+
+	Each notion context is a complete interpreter with its own heap and
+	global scope. Contexts don't share anything, so separate threads can
+	each use their own, but one context should only be used by one thread
+	at a time. Nothing here writes to stdout (Scheme code that prints, like
+	time or dump, still does).
+
+	Values handed back belong to the context. They stay good until the next
+	notion_collect(), unless they're passed to notion_protect(), in which
+	case they stay good until notion_unprotect(). Nothing is collected
+	unless you call notion_collect(), so call it now and then once you're
+	done with what you have.
+
+	Errors are values too: check with notion_is_error() and get the text
+	with notion_error(). */
+
+struct notion;
+typedef struct notion notion;
+
+struct sexpr;
+typedef struct sexpr notion_value;
+
+enum notion_type { NOTION_NULL, NOTION_INT, NOTION_DEC, NOTION_BOOL,
+	NOTION_STRING, NOTION_SYMBOL, NOTION_LIST, NOTION_FUNCTION, NOTION_ERROR,
+	NOTION_OTHER };
+
+/* A C function callable from Scheme. It gets its arguments already
+	evaluated, and the data pointer it was registered with. Returning NULL
+	is the same as returning the null value. It may be called from worker
+	threads if Scheme code uses it in a future or pmap. */
+typedef notion_value* (*notion_builtin)(notion*, notion_value **args, int count, void *data);
+
+notion* notion_new(void);
+void notion_free(notion*);
+
+/* Evaluate every expression in the string, or file, and give back the
+	value of the last one. Stops at the first error and gives that back. */
+notion_value* notion_eval_string(notion*, const char *src);
+notion_value* notion_load_file(notion*, const char *path);
+
+/* Returns 0, or -1 if name belongs to one of the interpreter's own
+	built-ins, which can't be redefined */
+int notion_register_builtin(notion*, const char *name, notion_builtin, void *data);
+
+/* Frees anything that isn't reachable from the global scope or protected.
+	Gives back how many values were freed, or -1 if it couldn't run (from
+	inside a builtin, or while futures are running). */
+long notion_collect(notion*);
+void notion_protect(notion*, notion_value*);
+void notion_unprotect(notion*, notion_value*);
+
+enum notion_type notion_type_of(notion_value*);
+int notion_is_error(notion_value*);
+long notion_to_long(notion_value*);
+double notion_to_double(notion_value*);
+int notion_to_bool(notion_value*);
+/* For strings and symbols. Strings aren't necessarily '\0' terminated, so
+	use the length. */
+const char* notion_string(notion_value*, size_t *len);
+const char* notion_error(notion_value*);
+int notion_list_length(notion_value*);
+notion_value* notion_list_ref(notion_value*, int);
+/* The short description used in error messages (a list is just "List"),
+	malloc'd */
+char* notion_describe(notion_value*);
+
+notion_value* notion_make_null(notion*);
+notion_value* notion_make_int(notion*, long);
+notion_value* notion_make_double(notion*, double);
+notion_value* notion_make_bool(notion*, int);
+notion_value* notion_make_string(notion*, const char*, size_t);
+notion_value* notion_make_list(notion*, notion_value **items, int count);
+notion_value* notion_make_error(notion*, const char*);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nstring.h"
+
+typedef struct strblock {
+	atomic_uint refs;
+	atomic_size_t used;
+	size_t cap;
+	char data[];
+} strblock;
+
+#define BLOCK_OF(s) ((strblock*)((s) - offsetof(strblock, data)))
+
+static char* block_new(size_t cap) {
+	/* The + 1 is so the most recently appended string always has room for
+		a terminator, which keeps the common case printable as a C string */
+	strblock *b = malloc(sizeof(strblock) + cap + 1);
+	atomic_init(&b->refs, 1);
+	atomic_init(&b->used, 0);
+	b->cap = cap;
+	b->data[0] = '\0';
+
+	return b->data;
+}
+
+char* nstr_new(const char *s, size_t len) {
+	char *data = block_new(len);
+	strblock *b = BLOCK_OF(data);
+
+	if (len)
+		memcpy(data, s, len);
+	data[len] = '\0';
+	b->used = len;
+
+	return data;
+}
+
+char* nstr_ref(char *s) {
+	if (s)
+		atomic_fetch_add_explicit(&BLOCK_OF(s)->refs, 1, memory_order_relaxed);
+
+	return s;
+}
+
+void nstr_unref(char *s) {
+	if (!s)
+		return;
+
+	strblock *b = BLOCK_OF(s);
+	if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1)
+		free(b);
+}
+
+/* Returns a reference to a block holding s followed by t. If s ends where
+	its block's used bytes end and there's room, t is copied in place and
+	the block is shared. Otherwise we start a new block with double the
+	room so the next append can go in place. */
+char* nstr_append(char *s, size_t len, const char *t, size_t tlen) {
+	strblock *b = BLOCK_OF(s);
+	size_t expected = len;
+
+	if (b->cap - len >= tlen && atomic_compare_exchange_strong(&b->used, &expected, len + tlen)) {
+		memcpy(s + len, t, tlen);
+		s[len + tlen] = '\0';
+		atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+
+		return s;
+	}
+
+	size_t cap = 2 * (len + tlen);
+	if (cap < 16)
+		cap = 16;
+
+	char *data = block_new(cap);
+	memcpy(data, s, len);
+	memcpy(data + len, t, tlen);
+	data[len + tlen] = '\0';
+	BLOCK_OF(data)->used = len + tlen;
+
+	return data;
+}
+
+/* A malloc'd, '\0' terminated copy for when we need to hand a string to
+	something like fopen() */
+char* nstr_cstr(const char *s, size_t len) {
+	char *c = malloc(len + 1);
+	memcpy(c, s, len);
+	c[len] = '\0';
+
+	return c;
+}
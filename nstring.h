@@ -0,0 +1,30 @@
+#ifndef nstring_h
+#define nstring_h
+
+#include <stddef.h>
+
+/* String storage for LVAL_STR values. The bytes live in a reference counted
+	block with a small header in front of them, and a string sexpr is just a
+	pointer into that block plus a length. Strings never change once made,
+	so copying one only bumps the count.
+
+	The block also has spare capacity. When we append onto a string whose
+	bytes run right up to the end of what's been used in its block, the new
+	bytes go in place and the result shares the block. Nobody else can see
+	past the end of their own length, so that's safe, and it means building
+	a string up in a loop is amortized linear instead of quadratic.
+
+	Because of that, the bytes of a string aren't necessarily followed by a
+	'\0'. Use the length, or nstr_cstr() when a C string is really needed.
+
+	Strings can be shared between futures running on different threads, so
+	the count is atomic and appending in place claims its bytes with a
+	compare and swap on how much of the block is used. */
+
+char* nstr_new(const char*, size_t);
+char* nstr_ref(char*);
+void nstr_unref(char*);
+char* nstr_append(char*, size_t, const char*, size_t);
+char* nstr_cstr(const char*, size_t);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef numconv_h
+#define numconv_h
+
+#include <stddef.h>
+
+/* Reading and printing numbers without going through the C library.
+
+	num_parse() is what the tokenizer asks about every symbol-ish token, so
+	it gives up on the first byte for anything that can't be a number. It
+	reads [+-]digits as an integer (if it fits in a long) and decimals like
+	1.5, .5, 1. and 6.02e23 as doubles, plus +inf.0, -inf.0 and +nan.0.
+	Doubles are read with Clinger's exact fast path when the digits and
+	exponent are small, and the Eisel-Lemire algorithm otherwise, which is
+	correctly rounded. Only more than 19 significant digits falls back on
+	strtod().
+
+	num_format_double() writes the shortest digits that read back as the
+	same double, using Giulietti's Schubfach algorithm (the same idea as
+	Ryu). It's written plainly for numbers from 1e-6 up to 1e21 and with an
+	exponent outside that, and always has a '.' or an 'e' so that it reads
+	back as a double rather than an integer. */
+
+/* Enough room for anything num_format_double() writes, and the '\0' */
+#define NUM_BUF_SIZE 32
+
+int num_parse(const char *s, size_t len, int *is_int, long *i_num, double *d_num);
+size_t num_format_double(char *buf, double d);
+
+#endif
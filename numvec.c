@@ -0,0 +1,1039 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numvec.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "sexpr.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define NUMVEC_X86 1
+#include <immintrin.h>
+#endif
+
+/* Plain C versions of the kernels. These are what we run on non-x86
+	machines and they also mop up the leftover elements at the tail end of
+	the SIMD loops. */
+static void f64_binop_scalar(enum vec_op op, double *dst, const double *a,
+			const double *b, size_t n) {
+	switch (op) {
+		case VOP_ADD:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] + b[j];
+			break;
+		case VOP_SUB:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] - b[j];
+			break;
+		case VOP_MUL:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] * b[j];
+			break;
+		case VOP_DIV:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] / b[j];
+			break;
+		case VOP_MIN:
+			for (size_t j = 0; j < n; j++) dst[j] = b[j] < a[j] ? b[j] : a[j];
+			break;
+		case VOP_MAX:
+			for (size_t j = 0; j < n; j++) dst[j] = b[j] > a[j] ? b[j] : a[j];
+			break;
+	}
+}
+
+static void f64_scalar_op_scalar(enum vec_op op, double *dst, const double *a,
+			double k, size_t n) {
+	switch (op) {
+		case VOP_ADD:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] + k;
+			break;
+		case VOP_SUB:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] - k;
+			break;
+		case VOP_MUL:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] * k;
+			break;
+		case VOP_DIV:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] / k;
+			break;
+		case VOP_MIN:
+			for (size_t j = 0; j < n; j++) dst[j] = k < a[j] ? k : a[j];
+			break;
+		case VOP_MAX:
+			for (size_t j = 0; j < n; j++) dst[j] = k > a[j] ? k : a[j];
+			break;
+	}
+}
+
+static double f64_dot_scalar(const double *a, const double *b, size_t n) {
+	double sum = 0;
+	for (size_t j = 0; j < n; j++)
+		sum += a[j] * b[j];
+
+	return sum;
+}
+
+static double f64_sum_scalar(const double *a, size_t n) {
+	double sum = 0;
+	for (size_t j = 0; j < n; j++)
+		sum += a[j];
+
+	return sum;
+}
+
+/* Only VOP_MIN and VOP_MAX make sense as reductions. Callers make sure
+	the vector isn't empty. */
+static double f64_reduce_scalar(enum vec_op op, const double *a, size_t n) {
+	double r = a[0];
+	for (size_t j = 1; j < n; j++) {
+		if (op == VOP_MIN && a[j] < r)
+			r = a[j];
+		else if (op == VOP_MAX && a[j] > r)
+			r = a[j];
+	}
+
+	return r;
+}
+
+static void s64_binop_scalar(enum vec_op op, int64_t *dst, const int64_t *a,
+			const int64_t *b, size_t n) {
+	switch (op) {
+		case VOP_ADD:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] + b[j];
+			break;
+		case VOP_SUB:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] - b[j];
+			break;
+		case VOP_MUL:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] * b[j];
+			break;
+		case VOP_DIV:
+			/* vec_apply() checks for zero divisors, and INT64_MIN / -1,
+				before we get here */
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] / b[j];
+			break;
+		case VOP_MIN:
+			for (size_t j = 0; j < n; j++) dst[j] = b[j] < a[j] ? b[j] : a[j];
+			break;
+		case VOP_MAX:
+			for (size_t j = 0; j < n; j++) dst[j] = b[j] > a[j] ? b[j] : a[j];
+			break;
+	}
+}
+
+static void s64_scalar_op_scalar(enum vec_op op, int64_t *dst, const int64_t *a,
+			int64_t k, size_t n) {
+	switch (op) {
+		case VOP_ADD:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] + k;
+			break;
+		case VOP_SUB:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] - k;
+			break;
+		case VOP_MUL:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] * k;
+			break;
+		case VOP_DIV:
+			for (size_t j = 0; j < n; j++) dst[j] = a[j] / k;
+			break;
+		case VOP_MIN:
+			for (size_t j = 0; j < n; j++) dst[j] = k < a[j] ? k : a[j];
+			break;
+		case VOP_MAX:
+			for (size_t j = 0; j < n; j++) dst[j] = k > a[j] ? k : a[j];
+			break;
+	}
+}
+
+static int64_t s64_dot_scalar(const int64_t *a, const int64_t *b, size_t n) {
+	int64_t sum = 0;
+	for (size_t j = 0; j < n; j++)
+		sum += a[j] * b[j];
+
+	return sum;
+}
+
+static int64_t s64_sum_scalar(const int64_t *a, size_t n) {
+	int64_t sum = 0;
+	for (size_t j = 0; j < n; j++)
+		sum += a[j];
+
+	return sum;
+}
+
+static int64_t s64_reduce_scalar(enum vec_op op, const int64_t *a, size_t n) {
+	int64_t r = a[0];
+	for (size_t j = 1; j < n; j++) {
+		if (op == VOP_MIN && a[j] < r)
+			r = a[j];
+		else if (op == VOP_MAX && a[j] > r)
+			r = a[j];
+	}
+
+	return r;
+}
+
+static const numvec_kernels scalar_kernels = {
+	"scalar",
+	f64_binop_scalar, f64_scalar_op_scalar, f64_dot_scalar, f64_sum_scalar,
+	f64_reduce_scalar,
+	s64_binop_scalar, s64_scalar_op_scalar, s64_dot_scalar, s64_sum_scalar,
+	s64_reduce_scalar
+};
+
+#ifdef NUMVEC_X86
+
+/* SSE2 versions. Two doubles per register, and SSE2 only gives us 64-bit
+	integer add and subtract, so everything else on s64vectors stays in the
+	scalar loops. */
+__attribute__((target("sse2")))
+static void f64_binop_sse2(enum vec_op op, double *dst, const double *a,
+			const double *b, size_t n) {
+	size_t j = 0;
+
+	for (; j + 2 <= n; j += 2) {
+		__m128d x = _mm_loadu_pd(a + j);
+		__m128d y = _mm_loadu_pd(b + j);
+		__m128d r;
+
+		switch (op) {
+			case VOP_ADD: r = _mm_add_pd(x, y); break;
+			case VOP_SUB: r = _mm_sub_pd(x, y); break;
+			case VOP_MUL: r = _mm_mul_pd(x, y); break;
+			case VOP_DIV: r = _mm_div_pd(x, y); break;
+			case VOP_MIN: r = _mm_min_pd(y, x); break;
+			default: r = _mm_max_pd(y, x); break;
+		}
+		_mm_storeu_pd(dst + j, r);
+	}
+
+	f64_binop_scalar(op, dst + j, a + j, b + j, n - j);
+}
+
+__attribute__((target("sse2")))
+static void f64_scalar_op_sse2(enum vec_op op, double *dst, const double *a,
+			double k, size_t n) {
+	size_t j = 0;
+	__m128d y = _mm_set1_pd(k);
+
+	for (; j + 2 <= n; j += 2) {
+		__m128d x = _mm_loadu_pd(a + j);
+		__m128d r;
+
+		switch (op) {
+			case VOP_ADD: r = _mm_add_pd(x, y); break;
+			case VOP_SUB: r = _mm_sub_pd(x, y); break;
+			case VOP_MUL: r = _mm_mul_pd(x, y); break;
+			case VOP_DIV: r = _mm_div_pd(x, y); break;
+			case VOP_MIN: r = _mm_min_pd(y, x); break;
+			default: r = _mm_max_pd(y, x); break;
+		}
+		_mm_storeu_pd(dst + j, r);
+	}
+
+	f64_scalar_op_scalar(op, dst + j, a + j, k, n - j);
+}
+
+__attribute__((target("sse2")))
+static double f64_dot_sse2(const double *a, const double *b, size_t n) {
+	size_t j = 0;
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+
+	for (; j + 4 <= n; j += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + j + 2), _mm_loadu_pd(b + j + 2)));
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+
+	return lanes[0] + lanes[1] + f64_dot_scalar(a + j, b + j, n - j);
+}
+
+__attribute__((target("sse2")))
+static double f64_sum_sse2(const double *a, size_t n) {
+	size_t j = 0;
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+
+	for (; j + 4 <= n; j += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + j));
+		acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + j + 2));
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+
+	return lanes[0] + lanes[1] + f64_sum_scalar(a + j, n - j);
+}
+
+__attribute__((target("sse2")))
+static double f64_reduce_sse2(enum vec_op op, const double *a, size_t n) {
+	if (n < 2)
+		return a[0];
+
+	size_t j = 2;
+	__m128d acc = _mm_loadu_pd(a);
+
+	for (; j + 2 <= n; j += 2) {
+		__m128d x = _mm_loadu_pd(a + j);
+		acc = op == VOP_MIN ? _mm_min_pd(x, acc) : _mm_max_pd(x, acc);
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, acc);
+
+	double r = f64_reduce_scalar(op, lanes, 2);
+	for (; j < n; j++) {
+		if (op == VOP_MIN && a[j] < r)
+			r = a[j];
+		else if (op == VOP_MAX && a[j] > r)
+			r = a[j];
+	}
+
+	return r;
+}
+
+__attribute__((target("sse2")))
+static void s64_binop_sse2(enum vec_op op, int64_t *dst, const int64_t *a,
+			const int64_t *b, size_t n) {
+	if (op != VOP_ADD && op != VOP_SUB) {
+		s64_binop_scalar(op, dst, a, b, n);
+		return;
+	}
+
+	size_t j = 0;
+	for (; j + 2 <= n; j += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + j));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + j));
+		__m128i r = op == VOP_ADD ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+		_mm_storeu_si128((__m128i*)(dst + j), r);
+	}
+
+	s64_binop_scalar(op, dst + j, a + j, b + j, n - j);
+}
+
+__attribute__((target("sse2")))
+static void s64_scalar_op_sse2(enum vec_op op, int64_t *dst, const int64_t *a,
+			int64_t k, size_t n) {
+	if (op != VOP_ADD && op != VOP_SUB) {
+		s64_scalar_op_scalar(op, dst, a, k, n);
+		return;
+	}
+
+	size_t j = 0;
+	__m128i y = _mm_set1_epi64x(k);
+	for (; j + 2 <= n; j += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + j));
+		__m128i r = op == VOP_ADD ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+		_mm_storeu_si128((__m128i*)(dst + j), r);
+	}
+
+	s64_scalar_op_scalar(op, dst + j, a + j, k, n - j);
+}
+
+__attribute__((target("sse2")))
+static int64_t s64_sum_sse2(const int64_t *a, size_t n) {
+	size_t j = 0;
+	__m128i acc = _mm_setzero_si128();
+
+	for (; j + 2 <= n; j += 2)
+		acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(a + j)));
+
+	int64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+
+	return lanes[0] + lanes[1] + s64_sum_scalar(a + j, n - j);
+}
+
+static const numvec_kernels sse2_kernels = {
+	"sse2",
+	f64_binop_sse2, f64_scalar_op_sse2, f64_dot_sse2, f64_sum_sse2,
+	f64_reduce_sse2,
+	s64_binop_sse2, s64_scalar_op_sse2, s64_dot_scalar, s64_sum_sse2,
+	s64_reduce_scalar
+};
+
+/* AVX2 versions, four lanes per register. There's still no 64-bit integer
+	multiply below AVX-512 so s64 multiplies and divides (and hence dot)
+	fall back to the scalar loops. */
+__attribute__((target("avx2")))
+static void f64_binop_avx2(enum vec_op op, double *dst, const double *a,
+			const double *b, size_t n) {
+	size_t j = 0;
+
+	for (; j + 4 <= n; j += 4) {
+		__m256d x = _mm256_loadu_pd(a + j);
+		__m256d y = _mm256_loadu_pd(b + j);
+		__m256d r;
+
+		switch (op) {
+			case VOP_ADD: r = _mm256_add_pd(x, y); break;
+			case VOP_SUB: r = _mm256_sub_pd(x, y); break;
+			case VOP_MUL: r = _mm256_mul_pd(x, y); break;
+			case VOP_DIV: r = _mm256_div_pd(x, y); break;
+			case VOP_MIN: r = _mm256_min_pd(y, x); break;
+			default: r = _mm256_max_pd(y, x); break;
+		}
+		_mm256_storeu_pd(dst + j, r);
+	}
+
+	f64_binop_scalar(op, dst + j, a + j, b + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void f64_scalar_op_avx2(enum vec_op op, double *dst, const double *a,
+			double k, size_t n) {
+	size_t j = 0;
+	__m256d y = _mm256_set1_pd(k);
+
+	for (; j + 4 <= n; j += 4) {
+		__m256d x = _mm256_loadu_pd(a + j);
+		__m256d r;
+
+		switch (op) {
+			case VOP_ADD: r = _mm256_add_pd(x, y); break;
+			case VOP_SUB: r = _mm256_sub_pd(x, y); break;
+			case VOP_MUL: r = _mm256_mul_pd(x, y); break;
+			case VOP_DIV: r = _mm256_div_pd(x, y); break;
+			case VOP_MIN: r = _mm256_min_pd(y, x); break;
+			default: r = _mm256_max_pd(y, x); break;
+		}
+		_mm256_storeu_pd(dst + j, r);
+	}
+
+	f64_scalar_op_scalar(op, dst + j, a + j, k, n - j);
+}
+
+__attribute__((target("avx2")))
+static double f64_dot_avx2(const double *a, const double *b, size_t n) {
+	size_t j = 0;
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+
+	for (; j + 8 <= n; j += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + j),
+						_mm256_loadu_pd(b + j)));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + j + 4),
+						_mm256_loadu_pd(b + j + 4)));
+	}
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+			+ f64_dot_scalar(a + j, b + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static double f64_sum_avx2(const double *a, size_t n) {
+	size_t j = 0;
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+
+	for (; j + 8 <= n; j += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + j));
+		acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + j + 4));
+	}
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+			+ f64_sum_scalar(a + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static double f64_reduce_avx2(enum vec_op op, const double *a, size_t n) {
+	if (n < 4)
+		return f64_reduce_scalar(op, a, n);
+
+	size_t j = 4;
+	__m256d acc = _mm256_loadu_pd(a);
+
+	for (; j + 4 <= n; j += 4) {
+		__m256d x = _mm256_loadu_pd(a + j);
+		acc = op == VOP_MIN ? _mm256_min_pd(x, acc) : _mm256_max_pd(x, acc);
+	}
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, acc);
+
+	double r = f64_reduce_scalar(op, lanes, 4);
+	for (; j < n; j++) {
+		if (op == VOP_MIN && a[j] < r)
+			r = a[j];
+		else if (op == VOP_MAX && a[j] > r)
+			r = a[j];
+	}
+
+	return r;
+}
+
+__attribute__((target("avx2")))
+static __m256i s64_minmax_avx2(enum vec_op op, __m256i x, __m256i y) {
+	/* No min/max for 64-bit lanes until AVX-512, so compare and blend */
+	__m256i gt = _mm256_cmpgt_epi64(x, y);
+
+	return op == VOP_MIN ? _mm256_blendv_epi8(x, y, gt)
+			: _mm256_blendv_epi8(y, x, gt);
+}
+
+__attribute__((target("avx2")))
+static void s64_binop_avx2(enum vec_op op, int64_t *dst, const int64_t *a,
+			const int64_t *b, size_t n) {
+	if (op == VOP_MUL || op == VOP_DIV) {
+		s64_binop_scalar(op, dst, a, b, n);
+		return;
+	}
+
+	size_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + j));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b + j));
+		__m256i r;
+
+		if (op == VOP_ADD)
+			r = _mm256_add_epi64(x, y);
+		else if (op == VOP_SUB)
+			r = _mm256_sub_epi64(x, y);
+		else
+			r = s64_minmax_avx2(op, x, y);
+		_mm256_storeu_si256((__m256i*)(dst + j), r);
+	}
+
+	s64_binop_scalar(op, dst + j, a + j, b + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void s64_scalar_op_avx2(enum vec_op op, int64_t *dst, const int64_t *a,
+			int64_t k, size_t n) {
+	if (op == VOP_MUL || op == VOP_DIV) {
+		s64_scalar_op_scalar(op, dst, a, k, n);
+		return;
+	}
+
+	size_t j = 0;
+	__m256i y = _mm256_set1_epi64x(k);
+	for (; j + 4 <= n; j += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + j));
+		__m256i r;
+
+		if (op == VOP_ADD)
+			r = _mm256_add_epi64(x, y);
+		else if (op == VOP_SUB)
+			r = _mm256_sub_epi64(x, y);
+		else
+			r = s64_minmax_avx2(op, x, y);
+		_mm256_storeu_si256((__m256i*)(dst + j), r);
+	}
+
+	s64_scalar_op_scalar(op, dst + j, a + j, k, n - j);
+}
+
+__attribute__((target("avx2")))
+static int64_t s64_sum_avx2(const int64_t *a, size_t n) {
+	size_t j = 0;
+	__m256i acc = _mm256_setzero_si256();
+
+	for (; j + 4 <= n; j += 4)
+		acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(a + j)));
+
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + s64_sum_scalar(a + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static int64_t s64_reduce_avx2(enum vec_op op, const int64_t *a, size_t n) {
+	if (n < 4)
+		return s64_reduce_scalar(op, a, n);
+
+	size_t j = 4;
+	__m256i acc = _mm256_loadu_si256((const __m256i*)a);
+	for (; j + 4 <= n; j += 4)
+		acc = s64_minmax_avx2(op, acc, _mm256_loadu_si256((const __m256i*)(a + j)));
+
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+
+	int64_t r = s64_reduce_scalar(op, lanes, 4);
+	for (; j < n; j++) {
+		if (op == VOP_MIN && a[j] < r)
+			r = a[j];
+		else if (op == VOP_MAX && a[j] > r)
+			r = a[j];
+	}
+
+	return r;
+}
+
+static const numvec_kernels avx2_kernels = {
+	"avx2",
+	f64_binop_avx2, f64_scalar_op_avx2, f64_dot_avx2, f64_sum_avx2,
+	f64_reduce_avx2,
+	s64_binop_avx2, s64_scalar_op_avx2, s64_dot_scalar, s64_sum_avx2,
+	s64_reduce_avx2
+};
+
+#endif
+
+static const numvec_kernels *kernels = &scalar_kernels;
+
+/* Pick the widest kernels the CPU supports. NOTION_SIMD=scalar (or sse2)
+	in the environment caps it, which is handy for benchmarking the
+	fallbacks against each other. */
+static void pick_kernels(void) {
+	kernels = &scalar_kernels;
+
+#ifdef NUMVEC_X86
+	char *cap = getenv("NOTION_SIMD");
+
+	if (cap && strcmp(cap, "scalar") == 0)
+		return;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && !(cap && strcmp(cap, "sse2") == 0))
+		kernels = &avx2_kernels;
+	else if (__builtin_cpu_supports("sse2"))
+		kernels = &sse2_kernels;
+#endif
+}
+
+/* Every interpreter calls this as it starts up (see interp.h), but the
+	choice is made just once for the whole process */
+void numvec_init(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, pick_kernels);
+}
+
+const numvec_kernels* numvec_kernels_get(void) {
+	return kernels;
+}
+
+/* All the builtins are registered under both an f64vector- and s64vector-
+	name and figure out which flavour they are from op, the same way the
+	arithmetic builtins do. */
+static enum sexpr_num_type op_elem_type(char *op) {
+	return strstr(op, "f64") ? NUM_TYPE_DEC : NUM_TYPE_INT;
+}
+
+static int vec_op_from_name(char *name, enum vec_op *vop) {
+	if (strcmp(name, "add") == 0 || strcmp(name, "+") == 0)
+		*vop = VOP_ADD;
+	else if (strcmp(name, "sub") == 0 || strcmp(name, "-") == 0)
+		*vop = VOP_SUB;
+	else if (strcmp(name, "mul") == 0 || strcmp(name, "*") == 0)
+		*vop = VOP_MUL;
+	else if (strcmp(name, "div") == 0 || strcmp(name, "/") == 0)
+		*vop = VOP_DIV;
+	else if (strcmp(name, "min") == 0)
+		*vop = VOP_MIN;
+	else if (strcmp(name, "max") == 0)
+		*vop = VOP_MAX;
+	else
+		return 0;
+
+	return 1;
+}
+
+static int is_vec_of(sexpr *v, enum sexpr_num_type t) {
+	return v->type == LVAL_NUMVEC && v->num_type == t;
+}
+
+static int has_zero_s64(const int64_t *a, size_t n) {
+	for (size_t j = 0; j < n; j++) {
+		if (a[j] == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* INT64_MIN / -1 doesn't fit in an s64 (and on x86 it traps rather than
+	wrapping), nor does negating INT64_MIN. b is NULL when every divisor is
+	-1, which is how negating a vector comes through here. */
+static int has_min_by_neg1_s64(const int64_t *a, const int64_t *b, size_t n) {
+	for (size_t j = 0; j < n; j++) {
+		if (a[j] == INT64_MIN && (!b || b[j] == -1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Store a boxed number into slot j of a vector */
+static sexpr* vec_store(vm_heap *vm, sexpr *v, int j, sexpr *n) {
+	ASSERT_NOT_ERR(n);
+	ASSERT_TYPE(n, LVAL_NUM, "Vector elements must be numbers.");
+
+	if (v->num_type == NUM_TYPE_DEC)
+		v->f64[j] = NUM_CONVERT(n);
+	else if (n->num_type == NUM_TYPE_INT)
+		v->s64[j] = n->i_num;
+	else
+		return sexpr_err(vm, "s64vector elements must be integers.");
+
+	return v;
+}
+
+static sexpr* vec_box(vm_heap *vm, sexpr *v, int j) {
+	if (v->num_type == NUM_TYPE_DEC)
+		return sexpr_num(vm, NUM_TYPE_DEC, v->f64[j]);
+
+	return sexpr_num(vm, NUM_TYPE_INT, v->s64[j]);
+}
+
+sexpr* builtin_numvec_make(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 2, "Expected a length and optional fill value.");
+	ASSERT_PARAM_MAX(count, 3, "Expected a length and optional fill value.");
+
+	sexpr *len = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(len);
+	ASSERT_TYPE(len, LVAL_NUM, "Vector length must be a number.");
+	if (len->num_type != NUM_TYPE_INT || len->i_num < 0)
+		return sexpr_err(vm, "Vector length must be a non-negative integer.");
+	if (len->i_num > INT_MAX)
+		return sexpr_err(vm, "Vector length is too big.");
+
+	sexpr *v = sexpr_numvec(vm, op_elem_type(op), len->i_num);
+	if (!v)
+		return sexpr_err(vm, "Out of memory for the vector.");
+
+	if (count == 3) {
+		sexpr *fill = eval2(vm, env, nodes[2]);
+		ASSERT_NOT_ERR(fill);
+		for (int j = 0; j < v->count; j++) {
+			sexpr *r = vec_store(vm, v, j, fill);
+			ASSERT_NOT_ERR(r);
+		}
+	}
+
+	return v;
+}
+
+sexpr* builtin_numvec(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	sexpr *v = sexpr_numvec(vm, op_elem_type(op), count - 1);
+	if (!v)
+		return sexpr_err(vm, "Out of memory for the vector.");
+
+	for (int j = 1; j < count; j++) {
+		sexpr *r = vec_store(vm, v, j - 1, eval2(vm, env, nodes[j]));
+		ASSERT_NOT_ERR(r);
+	}
+
+	return v;
+}
+
+sexpr* builtin_numvecq(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+
+	return sexpr_bool(vm, is_vec_of(v, op_elem_type(op)));
+}
+
+sexpr* builtin_numvec_length(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	if (!is_vec_of(v, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	return sexpr_num(vm, NUM_TYPE_INT, v->count);
+}
+
+static sexpr* eval_index(vm_heap *vm, scope *env, sexpr *v, sexpr *node, int *j) {
+	sexpr *i = eval2(vm, env, node);
+	ASSERT_NOT_ERR(i);
+	ASSERT_TYPE(i, LVAL_NUM, "Vector index must be a number.");
+
+	if (i->num_type != NUM_TYPE_INT || i->i_num < 0 || i->i_num >= v->count)
+		return sexpr_err(vm, "Vector index out of range.");
+	*j = i->i_num;
+
+	return i;
+}
+
+sexpr* builtin_numvec_ref(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected a vector and an index.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	if (!is_vec_of(v, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	int j;
+	sexpr *i = eval_index(vm, env, v, nodes[2], &j);
+	ASSERT_NOT_ERR(i);
+
+	return vec_box(vm, v, j);
+}
+
+sexpr* builtin_numvec_set(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 4, "Expected a vector, an index and a value.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	if (!is_vec_of(v, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	int j;
+	sexpr *i = eval_index(vm, env, v, nodes[2], &j);
+	ASSERT_NOT_ERR(i);
+
+	sexpr *r = vec_store(vm, v, j, eval2(vm, env, nodes[3]));
+	ASSERT_NOT_ERR(r);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_list_to_numvec(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *l = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(l);
+	ASSERT_TYPE(l, LVAL_LIST, "Expected a list of numbers.");
+
+	sexpr *v = sexpr_numvec(vm, op_elem_type(op), l->count);
+	if (!v)
+		return sexpr_err(vm, "Out of memory for the vector.");
+	for (int j = 0; j < l->count; j++) {
+		sexpr *r = vec_store(vm, v, j, l->children[j]);
+		ASSERT_NOT_ERR(r);
+	}
+
+	return v;
+}
+
+sexpr* builtin_numvec_to_list(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	if (!is_vec_of(v, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	sexpr *l = sexpr_list(vm);
+	for (int j = 0; j < v->count; j++)
+		sexpr_append(l, vec_box(vm, v, j));
+
+	return l;
+}
+
+/* Elementwise v1 <op> v2, or v <op> k when the second operand is a plain
+	number. Shared by the -add/-sub/-mul/-div/-scale builtins and the fast
+	path of -map. */
+static sexpr* vec_apply(vm_heap *vm, enum vec_op vop, sexpr *a, sexpr *b) {
+	const numvec_kernels *k = numvec_kernels_get();
+	sexpr *dst = sexpr_numvec(vm, a->num_type, a->count);
+	if (!dst)
+		return sexpr_err(vm, "Out of memory for the vector.");
+
+	if (b->type == LVAL_NUMVEC) {
+		if (b->num_type != a->num_type)
+			return sexpr_err(vm, "Vectors must have the same element type.");
+		if (b->count != a->count)
+			return sexpr_err(vm, "Vectors must be the same length.");
+
+		if (a->num_type == NUM_TYPE_DEC)
+			k->f64_binop(vop, dst->f64, a->f64, b->f64, a->count);
+		else {
+			if (vop == VOP_DIV && has_zero_s64(b->s64, b->count))
+				return sexpr_err(vm, "Division by zero!");
+			if (vop == VOP_DIV && has_min_by_neg1_s64(a->s64, b->s64, a->count))
+				return sexpr_err(vm, "Integer overflow!");
+			k->s64_binop(vop, dst->s64, a->s64, b->s64, a->count);
+		}
+	}
+	else if (b->type == LVAL_NUM) {
+		if (a->num_type == NUM_TYPE_DEC)
+			k->f64_scalar_op(vop, dst->f64, a->f64, NUM_CONVERT(b), a->count);
+		else {
+			if (b->num_type != NUM_TYPE_INT)
+				return sexpr_err(vm, "s64vector elements must be integers.");
+			if (vop == VOP_DIV && b->i_num == 0)
+				return sexpr_err(vm, "Division by zero!");
+			if ((vop == VOP_DIV || vop == VOP_MUL) && b->i_num == -1
+					&& has_min_by_neg1_s64(a->s64, NULL, a->count))
+				return sexpr_err(vm, "Integer overflow!");
+			k->s64_scalar_op(vop, dst->s64, a->s64, b->i_num, a->count);
+		}
+	}
+	else
+		return sexpr_err(vm, "Expected a vector or a number.");
+
+	return dst;
+}
+
+sexpr* builtin_numvec_op(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected two operands.");
+
+	sexpr *a = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(a);
+	sexpr *b = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(b);
+
+	if (!is_vec_of(a, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	/* op is something like "f64vector-add" */
+	char *name = strchr(op, '-') + 1;
+	enum vec_op vop = VOP_MUL;
+	if (strcmp(name, "scale") == 0) {
+		ASSERT_TYPE(b, LVAL_NUM, "Vectors are scaled by a number.");
+	}
+	else
+		vec_op_from_name(name, &vop);
+
+	return vec_apply(vm, vop, a, b);
+}
+
+sexpr* builtin_numvec_dot(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 3, "Expected two vectors.");
+
+	sexpr *a = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(a);
+	sexpr *b = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(b);
+	enum sexpr_num_type t = op_elem_type(op);
+
+	if (!is_vec_of(a, t) || !is_vec_of(b, t))
+		return sexpr_err(vm, "Expected two numeric vectors of the right type.");
+	if (a->count != b->count)
+		return sexpr_err(vm, "Vectors must be the same length.");
+
+	const numvec_kernels *k = numvec_kernels_get();
+	if (t == NUM_TYPE_DEC)
+		return sexpr_num(vm, t, k->f64_dot(a->f64, b->f64, a->count));
+
+	return sexpr_num(vm, t, k->s64_dot(a->s64, b->s64, a->count));
+}
+
+sexpr* builtin_numvec_reduce(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Just one parameter expected.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(v);
+	enum sexpr_num_type t = op_elem_type(op);
+	if (!is_vec_of(v, t))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	const numvec_kernels *k = numvec_kernels_get();
+	char *name = strchr(op, '-') + 1;
+	if (strcmp(name, "sum") == 0) {
+		if (t == NUM_TYPE_DEC)
+			return sexpr_num(vm, t, k->f64_sum(v->f64, v->count));
+		return sexpr_num(vm, t, k->s64_sum(v->s64, v->count));
+	}
+
+	if (v->count == 0)
+		return sexpr_err(vm, "Cannot take the min or max of an empty vector.");
+
+	enum vec_op vop = strcmp(name, "min") == 0 ? VOP_MIN : VOP_MAX;
+	if (t == NUM_TYPE_DEC)
+		return sexpr_num(vm, t, k->f64_reduce(vop, v->f64, v->count));
+
+	return sexpr_num(vm, t, k->s64_reduce(vop, v->s64, v->count));
+}
+
+/* (f64vector-map op v) or (f64vector-map op v w-or-number). When op is
+	one of + - * / min max we hand the whole thing to the kernels, otherwise
+	we box each element and call the builtin on it, which is slow but means
+	things like % and ^ still work. */
+sexpr* builtin_numvec_map(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_MIN(count, 3, "Expected an operator and one or two operands.");
+	ASSERT_PARAM_MAX(count, 4, "Expected an operator and one or two operands.");
+
+	sexpr *f = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+	if (f->type != LVAL_FUN || !f->builtin)
+		return sexpr_err(vm, "Vector map needs a built-in operator.");
+
+	sexpr *a = eval2(vm, env, nodes[2]);
+	ASSERT_NOT_ERR(a);
+	if (!is_vec_of(a, op_elem_type(op)))
+		return sexpr_err(vm, "Expected a numeric vector of the right type.");
+
+	sexpr *b = NULL;
+	if (count == 4) {
+		b = eval2(vm, env, nodes[3]);
+		ASSERT_NOT_ERR(b);
+		if (b->type == LVAL_NUMVEC && (b->num_type != a->num_type || b->count != a->count))
+			return sexpr_err(vm, "Vectors must be the same length and type.");
+		else if (b->type != LVAL_NUMVEC && b->type != LVAL_NUM)
+			return sexpr_err(vm, "Expected a vector or a number.");
+	}
+
+	enum vec_op vop;
+	if (vec_op_from_name(f->sym, &vop)) {
+		if (b)
+			return vec_apply(vm, vop, a, b);
+		else if (vop == VOP_SUB)
+			return vec_apply(vm, VOP_MUL, a, sexpr_num(vm, NUM_TYPE_INT, -1));
+	}
+
+	sexpr *dst = sexpr_numvec(vm, a->num_type, a->count);
+	if (!dst)
+		return sexpr_err(vm, "Out of memory for the vector.");
+	sexpr *args[3];
+	args[0] = f;
+	for (int j = 0; j < a->count; j++) {
+		args[1] = vec_box(vm, a, j);
+		if (b)
+			args[2] = b->type == LVAL_NUMVEC ? vec_box(vm, b, j) : b;
+
+		sexpr *r = f->fun(vm, env, args, b ? 3 : 2, f->sym);
+		r = vec_store(vm, dst, j, r);
+		ASSERT_NOT_ERR(r);
+	}
+
+	return dst;
+}
+
+sexpr* builtin_simd_level(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	return sexpr_str(vm, (char*)numvec_kernels_get()->name);
+}
+
+void load_numvec_built_ins(scope *sc) {
+	numvec_init();
+
+	scope_insert_var(sc, "make-f64vector", sexpr_fun_builtin(&builtin_numvec_make, "make-f64vector"));
+	scope_insert_var(sc, "f64vector", sexpr_fun_builtin(&builtin_numvec, "f64vector"));
+	scope_insert_var(sc, "f64vector?", sexpr_fun_builtin(&builtin_numvecq, "f64vector?"));
+	scope_insert_var(sc, "f64vector-length", sexpr_fun_builtin(&builtin_numvec_length, "f64vector-length"));
+	scope_insert_var(sc, "f64vector-ref", sexpr_fun_builtin(&builtin_numvec_ref, "f64vector-ref"));
+	scope_insert_var(sc, "f64vector-set!", sexpr_fun_builtin(&builtin_numvec_set, "f64vector-set!"));
+	scope_insert_var(sc, "list->f64vector", sexpr_fun_builtin(&builtin_list_to_numvec, "list->f64vector"));
+	scope_insert_var(sc, "f64vector->list", sexpr_fun_builtin(&builtin_numvec_to_list, "f64vector->list"));
+	scope_insert_var(sc, "f64vector-add", sexpr_fun_builtin(&builtin_numvec_op, "f64vector-add"));
+	scope_insert_var(sc, "f64vector-sub", sexpr_fun_builtin(&builtin_numvec_op, "f64vector-sub"));
+	scope_insert_var(sc, "f64vector-mul", sexpr_fun_builtin(&builtin_numvec_op, "f64vector-mul"));
+	scope_insert_var(sc, "f64vector-div", sexpr_fun_builtin(&builtin_numvec_op, "f64vector-div"));
+	scope_insert_var(sc, "f64vector-scale", sexpr_fun_builtin(&builtin_numvec_op, "f64vector-scale"));
+	scope_insert_var(sc, "f64vector-dot", sexpr_fun_builtin(&builtin_numvec_dot, "f64vector-dot"));
+	scope_insert_var(sc, "f64vector-sum", sexpr_fun_builtin(&builtin_numvec_reduce, "f64vector-sum"));
+	scope_insert_var(sc, "f64vector-min", sexpr_fun_builtin(&builtin_numvec_reduce, "f64vector-min"));
+	scope_insert_var(sc, "f64vector-max", sexpr_fun_builtin(&builtin_numvec_reduce, "f64vector-max"));
+	scope_insert_var(sc, "f64vector-map", sexpr_fun_builtin(&builtin_numvec_map, "f64vector-map"));
+
+	scope_insert_var(sc, "make-s64vector", sexpr_fun_builtin(&builtin_numvec_make, "make-s64vector"));
+	scope_insert_var(sc, "s64vector", sexpr_fun_builtin(&builtin_numvec, "s64vector"));
+	scope_insert_var(sc, "s64vector?", sexpr_fun_builtin(&builtin_numvecq, "s64vector?"));
+	scope_insert_var(sc, "s64vector-length", sexpr_fun_builtin(&builtin_numvec_length, "s64vector-length"));
+	scope_insert_var(sc, "s64vector-ref", sexpr_fun_builtin(&builtin_numvec_ref, "s64vector-ref"));
+	scope_insert_var(sc, "s64vector-set!", sexpr_fun_builtin(&builtin_numvec_set, "s64vector-set!"));
+	scope_insert_var(sc, "list->s64vector", sexpr_fun_builtin(&builtin_list_to_numvec, "list->s64vector"));
+	scope_insert_var(sc, "s64vector->list", sexpr_fun_builtin(&builtin_numvec_to_list, "s64vector->list"));
+	scope_insert_var(sc, "s64vector-add", sexpr_fun_builtin(&builtin_numvec_op, "s64vector-add"));
+	scope_insert_var(sc, "s64vector-sub", sexpr_fun_builtin(&builtin_numvec_op, "s64vector-sub"));
+	scope_insert_var(sc, "s64vector-mul", sexpr_fun_builtin(&builtin_numvec_op, "s64vector-mul"));
+	scope_insert_var(sc, "s64vector-div", sexpr_fun_builtin(&builtin_numvec_op, "s64vector-div"));
+	scope_insert_var(sc, "s64vector-scale", sexpr_fun_builtin(&builtin_numvec_op, "s64vector-scale"));
+	scope_insert_var(sc, "s64vector-dot", sexpr_fun_builtin(&builtin_numvec_dot, "s64vector-dot"));
+	scope_insert_var(sc, "s64vector-sum", sexpr_fun_builtin(&builtin_numvec_reduce, "s64vector-sum"));
+	scope_insert_var(sc, "s64vector-min", sexpr_fun_builtin(&builtin_numvec_reduce, "s64vector-min"));
+	scope_insert_var(sc, "s64vector-max", sexpr_fun_builtin(&builtin_numvec_reduce, "s64vector-max"));
+	scope_insert_var(sc, "s64vector-map", sexpr_fun_builtin(&builtin_numvec_map, "s64vector-map"));
+	scope_insert_var(sc, "simd-level", sexpr_fun_builtin(&builtin_simd_level, "simd-level"));
+}
@@ -0,0 +1,33 @@
+#ifndef numvec_h
+#define numvec_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fwd.h"
+
+/* Homogeneous, unboxed numeric vectors (f64vector and s64vector). The bulk
+	operations are done by kernels picked once at start-up based on what
+	the CPU can do: AVX2, SSE2 or plain C loops. */
+
+enum vec_op { VOP_ADD, VOP_SUB, VOP_MUL, VOP_DIV, VOP_MIN, VOP_MAX };
+
+typedef struct numvec_kernels {
+	const char *name;
+	void (*f64_binop)(enum vec_op, double*, const double*, const double*, size_t);
+	void (*f64_scalar_op)(enum vec_op, double*, const double*, double, size_t);
+	double (*f64_dot)(const double*, const double*, size_t);
+	double (*f64_sum)(const double*, size_t);
+	double (*f64_reduce)(enum vec_op, const double*, size_t);
+	void (*s64_binop)(enum vec_op, int64_t*, const int64_t*, const int64_t*, size_t);
+	void (*s64_scalar_op)(enum vec_op, int64_t*, const int64_t*, int64_t, size_t);
+	int64_t (*s64_dot)(const int64_t*, const int64_t*, size_t);
+	int64_t (*s64_sum)(const int64_t*, size_t);
+	int64_t (*s64_reduce)(enum vec_op, const int64_t*, size_t);
+} numvec_kernels;
+
+void numvec_init(void);
+const numvec_kernels* numvec_kernels_get(void);
+void load_numvec_built_ins(scope*);
+
+#endif
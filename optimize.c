@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimize.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "sexpr.h"
+#include "util.h"
+
+/* Built-ins that always give the same answer for the same arguments and
+	don't touch anything else, so calling them once ahead of time is safe.
+	Things that build new lists (cons, list, cdr) are left out since
+	callers can tell a fresh list from a shared one with eq?. */
+static const char *pure_builtins[] = {
+	"+", "-", "*", "/", "%", "^", "=", ">", ">=", "<", "<=",
+	"not", "and", "or", "min", "max", "eq?", "null?", "pair?", "number?",
+	"string?", "string-length", "car", NULL
+};
+
+optimizer* optimizer_new(void) {
+	optimizer *o = malloc(sizeof(optimizer));
+	o->enabled = 1;
+	o->shadowed_cap = 64;
+	o->shadowed_count = 0;
+	o->shadowed = calloc(o->shadowed_cap, sizeof(char*));
+
+	return o;
+}
+
+void optimizer_free(optimizer *o) {
+	for (unsigned long j = 0; j < o->shadowed_cap; j++)
+		free(o->shadowed[j]);
+	free(o->shadowed);
+	free(o);
+}
+
+static unsigned long name_hash(const char *s) {
+	unsigned long h = 14695981039346656037UL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+
+static unsigned long name_slot(char **slots, unsigned long cap, const char *name) {
+	unsigned long j = name_hash(name) & (cap - 1);
+
+	while (slots[j] && strcmp(slots[j], name) != 0)
+		j = (j + 1) & (cap - 1);
+
+	return j;
+}
+
+static int is_shadowed(optimizer *o, const char *name) {
+	return o->shadowed[name_slot(o->shadowed, o->shadowed_cap, name)] != NULL;
+}
+
+static void add_shadowed(optimizer *o, const char *name) {
+	unsigned long j = name_slot(o->shadowed, o->shadowed_cap, name);
+	if (o->shadowed[j])
+		return;
+
+	if ((o->shadowed_count + 1) * 2 > o->shadowed_cap) {
+		unsigned long cap = o->shadowed_cap * 2;
+		char **slots = calloc(cap, sizeof(char*));
+
+		for (unsigned long k = 0; k < o->shadowed_cap; k++) {
+			if (o->shadowed[k])
+				slots[name_slot(slots, cap, o->shadowed[k])] = o->shadowed[k];
+		}
+
+		free(o->shadowed);
+		o->shadowed = slots;
+		o->shadowed_cap = cap;
+		j = name_slot(slots, cap, name);
+	}
+
+	char *copy = NULL;
+	o->shadowed[j] = n_strcpy(copy, (char*)name);
+	o->shadowed_count++;
+}
+
+static void note_params(optimizer *o, sexpr *params) {
+	for (int j = 0; j < params->count; j++) {
+		if (params->children[j]->type == LVAL_SYM)
+			add_shadowed(o, params->children[j]->sym);
+	}
+}
+
+/* If the head of a call is a symbol that's still bound to a built-in in
+	the global scope, return the built-in */
+static sexpr* builtin_head(vm_heap *vm, scope *global, sexpr *head) {
+	if (head->type != LVAL_SYM || is_shadowed(vm->opt, head->sym))
+		return NULL;
+
+	sexpr *f = scope_fetch_var(vm, global, head->sym);
+	if (f->type != LVAL_FUN || !f->builtin)
+		return NULL;
+
+	return f;
+}
+
+static int is_pure(char *name) {
+	for (int j = 0; pure_builtins[j]; j++) {
+		if (strcmp(pure_builtins[j], name) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int is_const(sexpr *v) {
+	return v->type == LVAL_NUM || v->type == LVAL_BOOL
+		|| v->type == LVAL_STR || v->type == LVAL_CONST;
+}
+
+/* What a constant evaluates to */
+static sexpr* const_value(sexpr *v) {
+	return v->type == LVAL_CONST ? v->datum : v;
+}
+
+static sexpr* opt_expr(vm_heap*, scope*, sexpr*);
+
+/* Optimize the children of v from index from on. Returns v itself if
+	none of them changed, otherwise a new list. */
+static sexpr* opt_children(vm_heap *vm, scope *global, sexpr *v, int from) {
+	sexpr *result = v;
+
+	for (int j = from; j < v->count; j++) {
+		sexpr *c = opt_expr(vm, global, v->children[j]);
+
+		if (c != v->children[j] && result == v) {
+			result = sexpr_list(vm);
+			for (int k = 0; k < j; k++)
+				sexpr_append(result, v->children[k]);
+		}
+
+		if (result != v)
+			sexpr_append(result, c);
+	}
+
+	return result;
+}
+
+/* Run the built-in now. If it fails, leave the call alone so the error
+	turns up when (and if) the code actually runs. */
+static sexpr* fold(vm_heap *vm, scope *global, sexpr *f, sexpr *call) {
+	for (int j = 1; j < call->count; j++) {
+		if (!is_const(call->children[j]))
+			return call;
+	}
+
+	sexpr *r = f->fun(vm, global, call->children, call->count, f->sym);
+
+	switch (r->type) {
+		case LVAL_NUM:
+		case LVAL_BOOL:
+		case LVAL_STR:
+			return r;
+		case LVAL_SYM:
+		case LVAL_LIST:
+			return sexpr_const(vm, r);
+		default:
+			return call;
+	}
+}
+
+static sexpr* opt_if(vm_heap *vm, scope *global, sexpr *v) {
+	if (v->count != 4)
+		return v;
+
+	sexpr *call = opt_children(vm, global, v, 1);
+	sexpr *test = call->children[1];
+
+	if (!is_const(test))
+		return call;
+
+	/* Same rule as builtin_if: anything that isn't a boolean counts as
+		true */
+	test = const_value(test);
+	if (test->type == LVAL_BOOL && !test->bool)
+		return call->children[3];
+
+	return call->children[2];
+}
+
+static sexpr* opt_cond(vm_heap *vm, scope *global, sexpr *v) {
+	for (int j = 1; j < v->count; j++) {
+		if (v->children[j]->type != LVAL_LIST || v->children[j]->count != 2)
+			return v;
+	}
+
+	sexpr *result = sexpr_list(vm);
+	sexpr_append(result, v->children[0]);
+	int changed = 0;
+
+	for (int j = 1; j < v->count; j++) {
+		sexpr *clause = v->children[j];
+		sexpr *test = clause->children[0];
+		int is_else = IS_ELSE_CLAUSE(j, v->count, test);
+
+		if (!is_else)
+			test = opt_expr(vm, global, test);
+
+		/* A test that's constantly false can never be picked */
+		if (is_const(test) && const_value(test)->type == LVAL_BOOL
+				&& !const_value(test)->bool) {
+			changed = 1;
+			continue;
+		}
+
+		sexpr *expr = opt_expr(vm, global, clause->children[1]);
+		if (test != clause->children[0] || expr != clause->children[1]) {
+			clause = sexpr_list(vm);
+			sexpr_append(clause, test);
+			sexpr_append(clause, expr);
+			changed = 1;
+		}
+
+		/* Nothing after a constant test (or else) is reachable. A
+			constant that isn't a boolean is an error at run time, so it
+			has to stay. */
+		if (is_else || is_const(test)) {
+			/* And if it's the first clause left, it's always the one taken */
+			if (result->count == 1 && (is_else || const_value(test)->type == LVAL_BOOL))
+				return expr;
+
+			sexpr_append(result, clause);
+			if (j < v->count - 1)
+				changed = 1;
+			break;
+		}
+
+		sexpr_append(result, clause);
+	}
+
+	if (!changed)
+		return v;
+
+	/* Every test was false, and cond gives back null for that */
+	if (result->count == 1)
+		return sexpr_null();
+
+	return result;
+}
+
+static sexpr* opt_expr(vm_heap *vm, scope *global, sexpr *v) {
+	if (v->type != LVAL_LIST || v->count == 0)
+		return v;
+
+	sexpr *f = builtin_head(vm, global, v->children[0]);
+	if (!f)
+		return opt_children(vm, global, v, 0);
+
+	if (strcmp(f->sym, "quote") == 0)
+		return v->count == 2 ? sexpr_const(vm, v->children[1]) : v;
+
+	if (strcmp(f->sym, "lambda") == 0) {
+		if (v->count != 3 || v->children[1]->type != LVAL_LIST)
+			return v;
+		note_params(vm->opt, v->children[1]);
+		return opt_children(vm, global, v, 2);
+	}
+
+	if (strcmp(f->sym, "define") == 0 || strcmp(f->sym, "define-memo") == 0) {
+		if (v->count < 3)
+			return v;
+		if (v->children[1]->type == LVAL_LIST)
+			note_params(vm->opt, v->children[1]);
+		return opt_children(vm, global, v, 2);
+	}
+
+	if (strcmp(f->sym, "if") == 0)
+		return opt_if(vm, global, v);
+
+	if (strcmp(f->sym, "cond") == 0)
+		return opt_cond(vm, global, v);
+
+	sexpr *call = opt_children(vm, global, v, 1);
+	if (is_pure(f->sym))
+		return fold(vm, global, f, call);
+
+	return call;
+}
+
+/* The set of shadowed names is shared by every thread, hence the lock.
+	analyse_body() already holds it when it calls optimize_body(). */
+sexpr* optimize(vm_heap *vm, scope *sc, sexpr *v) {
+	if (!vm->opt->enabled)
+		return v;
+
+	/* Built-ins only ever live in the global scope */
+	while (sc->parent)
+		sc = sc->parent;
+
+	vm_lock(vm);
+	sexpr *result = opt_expr(vm, sc, v);
+	vm_unlock(vm);
+
+	return result;
+}
+
+/* For lambda and define: the parameters need to be noted before looking
+	at the body */
+sexpr* optimize_body(vm_heap *vm, scope *sc, sexpr *params, sexpr *body) {
+	if (!vm->opt->enabled)
+		return body;
+
+	if (params->type == LVAL_LIST)
+		note_params(vm->opt, params);
+
+	return optimize(vm, sc, body);
+}
+
+/* (optimize #f) turns the pass off, (optimize #t) back on. Handy for
+	checking whether it's responsible for something odd. */
+sexpr* builtin_optimize(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "Expected #t or #f.");
+
+	sexpr *on = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(on);
+	ASSERT_TYPE(on, LVAL_BOOL, "Expected #t or #f.");
+
+	vm->opt->enabled = on->bool;
+
+	return sexpr_null();
+}
+
+void load_optimize_built_ins(scope *sc) {
+	scope_insert_var(sc, "optimize", sexpr_fun_builtin(&builtin_optimize, "optimize"));
+}
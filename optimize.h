@@ -0,0 +1,41 @@
+#ifndef optimize_h
+#define optimize_h
+
+#include "fwd.h"
+
+/* A simple optimization pass run over forms after they're parsed and over
+	function bodies when lambda and define build a function. It
+
+		- replaces (quote x) with a pre-resolved constant (LVAL_CONST) so
+		  evaluating it doesn't go through the quote builtin each time
+		- folds calls to pure built-ins whose arguments are all constants,
+		  (* 2 3) becomes 6, by running the built-in once up front
+		- drops if and cond branches whose tests are constants
+
+	Forms may be shared (hash-consing, or one body used by several
+	functions) so the pass never edits a list in place. It builds a new one
+	when something changed and otherwise hands back what it was given.
+
+	Scoping is lexical: a function's frame hangs off the global scope plus
+	whatever it captured, so a parameter named, say, car changes what car
+	means in that function's body (and in lambdas made there that capture
+	it) but nowhere else. The pass doesn't keep track of which body it's
+	in, so any name we have ever seen used as a parameter is never folded
+	anywhere. Parameters are noted before their body is looked at, so that
+	errs on the safe side, and redefining built-ins via parameter names is
+	hopefully rare enough that folding less often for it doesn't matter. */
+
+typedef struct optimizer {
+	int enabled;
+	char **shadowed; /* Open addressed set of parameter names */
+	unsigned long shadowed_cap;
+	unsigned long shadowed_count;
+} optimizer;
+
+optimizer* optimizer_new(void);
+void optimizer_free(optimizer*);
+sexpr* optimize(vm_heap*, scope*, sexpr*);
+sexpr* optimize_body(vm_heap*, scope*, sexpr*, sexpr*);
+void load_optimize_built_ins(scope*);
+
+#endif
@@ -1,130 +1,371 @@
-/* The parser accpets tokens one at a time via parser_feed_token()
-	and builds up an expression one token at a time. Parser is probably
-	too strong a word for it at the moment. Is only significant checking is
-	making sure the open and close parantheses add up.
+/* The parser takes tokens one at a time and builds up an expression as
+	they come. Parser is probably too strong a word for it at the moment.
+	Its only significant checking is making sure the open and close
+	parantheses add up.
 
-	It is not yet checking to see if a valid scheme expression is being made */
+	It is not yet checking to see if a valid scheme expression is being made.
 
-#include <ctype.h>
+	There's no recursion: the lists (and quotes) that are still open are
+	kept on a stack in the parser, so it can stop whenever the tokenizer
+	runs out of input and carry on from the same place once there's
+	more. */
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "futures.h"
+#include "hashcons.h"
+#include "nstring.h"
 #include "parser.h"
+#include "scan.h"
 #include "sexpr.h"
 #include "util.h"
 
-sexpr *build_quote_form(vm_heap *vm, parser *p) {
-	sexpr *sq = sexpr_list(vm);
-	sexpr_append(sq, sexpr_sym(vm, "quote"));
+/* Text shorter than this isn't worth starting threads for */
+#define PARALLEL_PARSE_MIN (1024 * 1024)
+
+/* Copy the inside of a string token, taking out the escapes as we go */
+static sexpr* str_from_token(vm_heap *vm, const char *text, size_t len) {
+	char *data = nstr_new(text, len);
+	if (!memchr(text, '\\', len))
+		return sexpr_str_shared(vm, data, len);
 
-	sexpr *quoted = get_next_expr(vm, p);
-	if (quoted->type == LVAL_ERR)
-		return quoted;
+	size_t k = 0;
+	for (size_t j = 0; j < len; j++) {
+		if (text[j] == '\\')
+			++j;
+		data[k++] = text[j];
+	}
+	data[k] = '\0';
 
-	sexpr_append(sq, quoted);
+	return sexpr_str_shared(vm, data, k);
+}
 
-	return sq;
+static int token_is(const char *text, token *t, const char *s) {
+	return t->len == strlen(s) && memcmp(text, s, t->len) == 0;
 }
 
-sexpr* sexpr_from_token(vm_heap *vm, parser *p, token *t) {
+/* The token's text is only good until we ask for the next one, so
+	anything we want from it gets copied here */
+static sexpr* atom_from_token(vm_heap *vm, parser *p, token *t) {
 	sexpr *expr = NULL;
+	const char *text = token_text(p->tk, t);
 
 	switch (t->type) {
 		case T_NUM:
-			if (t->is_int) 
-				expr = sexpr_num(vm, NUM_TYPE_INT, t->i_num);
+			/* sexpr_num() takes a double, which would round integers
+				past 2^53, so the exact value is set afterwards */
+			if (t->is_int) {
+				expr = sexpr_num(vm, NUM_TYPE_INT, 0);
+				expr->i_num = t->i_num;
+			}
 			else 
 				expr = sexpr_num(vm, NUM_TYPE_DEC, t->d_num);
 			break;
 		case T_SYM:
-			expr = sexpr_sym(vm, t->val);
+			expr = sexpr_sym_n(vm, text, t->len);
 			break;
 		case T_CONSTANT:
-			if (strcmp("#t", t->val) == 0)
+			if (token_is(text, t, "#t"))
 				expr = sexpr_bool(vm, 1);
-			else if (strcmp("#f", t->val) == 0)
+			else if (token_is(text, t, "#f"))
 				expr = sexpr_bool(vm, 0);
 			else
 				expr = sexpr_err(vm, "Unknown constant.");
 			break;
 		case T_STR:
-			expr = sexpr_str(vm, t->val);
+			expr = str_from_token(vm, text, t->len);
 			break;
 		case T_ERR:
-			expr = sexpr_err(vm, t->val);
+			expr = sexpr_err(vm, (char*)t->err);
 			break;
-		case T_SINGLE_QUOTE:
-			return build_quote_form(vm, p);
-		case T_LIST_START:
-		case T_LIST_END:
-		case T_NULL:
-		case T_UNKNOWN:
-		case T_COMMENT:
+		default:
 			expr = sexpr_err(vm, "Unexpected token.");
 			break;
 	}
 
-	return expr;
+	return hc_intern(vm, expr);
 }
 
 parser* parser_new(tokenizer *tk) {
 	parser *p = malloc(sizeof(parser));
-	p->complete = 0;
-	p->open_p = 0;
-	p->closed_p = 0;
-	p->curr = NULL;
-	p->head = NULL;
+	p->stack = NULL;
+	p->depth = 0;
+	p->cap = 0;
+	p->err = NULL;
 	p->tk = tk;
 
 	return p;
 }
 
 void parser_free(parser *p) {
+	free(p->stack);
 	free(p);
 }
 
+static void push(vm_heap *vm, parser *p, int quote) {
+	if (p->depth == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 16;
+		p->stack = realloc(p->stack, p->cap * sizeof(parse_frame));
+	}
+
+	parse_frame *f = &p->stack[p->depth++];
+	f->list = sexpr_list(vm);
+	f->quote = quote;
+	if (quote)
+		sexpr_append(f->list, sexpr_sym(vm, "quote"));
+}
+
+/* datum is finished, so it goes into whatever's open, which may finish
+	that too. Gives back 1 when that's made a whole top-level expression,
+	which is left in *out. If anything in it was an error, the expression
+	as a whole is the first error. */
+static int finish(vm_heap *vm, parser *p, sexpr *datum, sexpr **out) {
+	for (;;) {
+		if (datum->type == LVAL_ERR && !p->err)
+			p->err = datum;
+
+		if (p->depth == 0) {
+			*out = p->err ? p->err : datum;
+			p->err = NULL;
+			return 1;
+		}
+
+		parse_frame *f = &p->stack[p->depth - 1];
+		sexpr_append(f->list, datum);
+		if (!f->quote)
+			return 0;
+
+		p->depth--;
+		datum = hc_intern(vm, f->list);
+	}
+}
+
+/* Run out of input partway through an expression */
+static sexpr* unfinished(vm_heap *vm, parser *p) {
+	sexpr *err = p->err;
+	if (!err) {
+		int in_list = 0;
+		for (int j = 0; j < p->depth; j++)
+			in_list |= !p->stack[j].quote;
+		err = sexpr_err(vm, in_list ? "Expected end of list." : "Expected an expression after '.");
+	}
+
+	p->depth = 0;
+	p->err = NULL;
+
+	return err;
+}
+
+enum parse_status parser_next(vm_heap *vm, parser *p, sexpr **out) {
+	for (;;) {
+		token t = next_token(p->tk);
+		sexpr *datum;
+
+		switch (t.type) {
+			case T_MORE:
+				return PARSE_MORE;
+			case T_NULL:
+				if (p->depth == 0)
+					return PARSE_END;
+				*out = unfinished(vm, p);
+				return PARSE_DATUM;
+			case T_LIST_START:
+				push(vm, p, 0);
+				continue;
+			case T_SINGLE_QUOTE:
+				push(vm, p, 1);
+				continue;
+			case T_LIST_END:
+				/* A quote with nothing after it can't take the ) so
+					that's an error, but the ) still closes its list */
+				while (p->depth > 0 && p->stack[p->depth - 1].quote) {
+					if (!p->err)
+						p->err = sexpr_err(vm, "Expected an expression after '.");
+					p->depth--;
+				}
+
+				if (p->depth == 0)
+					datum = sexpr_err(vm, "Unexpected token.");
+				else
+					datum = hc_intern(vm, p->stack[--p->depth].list);
+				break;
+			default:
+				datum = atom_from_token(vm, p, &t);
+				break;
+		}
+
+		if (finish(vm, p, datum, out))
+			return PARSE_DATUM;
+	}
+}
+
 sexpr *get_next_expr(vm_heap *vm, parser *p) {
-	token *t = next_token(p->tk);
+	sexpr *ast;
+
+	return parser_next(vm, p, &ast) == PARSE_DATUM ? ast : sexpr_null();
+}
 
-	while (t && t->type == T_COMMENT) {
-		token_free(t);
-		t = next_token(p->tk);
+int parser_pending(parser *p) {
+	return p->depth > 0 || tokenizer_pending(p->tk);
+}
+
+/* Every expression in text, in a list */
+static sexpr* parse_forms(vm_heap *vm, const char *text, size_t len) {
+	tokenizer *tk = tokenizer_new();
+	tokenizer_feed_buffer(tk, text, len);
+	parser *p = parser_new(tk);
+
+	sexpr *forms = sexpr_list(vm);
+	sexpr *ast = get_next_expr(vm, p);
+	while (ast->type != LVAL_NULL) {
+		sexpr_append(forms, ast);
+		ast = get_next_expr(vm, p);
 	}
 
-	if (!t)
-		return sexpr_null();
+	parser_free(p);
+	tokenizer_free(tk);
+
+	return forms;
+}
 
-	if (t->type == T_LIST_START) {
-		token_free(t);
-		sexpr *list = sexpr_list(vm);
+/* Find up to pieces - 1 places to cut text so each piece is whole
+	top-level expressions, as near to evenly sized as we can. A cut is
+	always at whitespace outside of any list, string or comment, and not
+	between a quote and what it quotes, so the pieces tokenize exactly as
+	they would have as part of the whole. This has to agree with the
+	tokenizer about where strings and comments end, including the odd
+	cases: a backslash in a string always takes the byte after it with it,
+	and a '\0' ends a string or a comment. Gives back how many cuts it
+	found. */
+static int find_cuts(const char *s, size_t len, size_t *cuts, int pieces) {
+	enum { IN_CODE, IN_STRING, IN_COMMENT } state = IN_CODE;
+	long depth = 0;
+	int quoted = 0, n = 0;
+	size_t target = len / pieces;
 
-		t = next_token(p->tk);
-		while (t && t->type != T_LIST_END) {
-			if (t->type == T_LIST_START) {
-				tokenizer_stash(p->tk, t);
-				sexpr_append(list, get_next_expr(vm, p));
-			}
-			else if (t->type != T_COMMENT) {
-				sexpr_append(list, sexpr_from_token(vm, p, t));
-				token_free(t);
+	for (size_t j = 0; j < len && n < pieces - 1; j++) {
+		unsigned char c = s[j];
+
+		if (state == IN_STRING) {
+			if (c == '\\' && s[j + 1] != '\0')
+				++j;
+			else if (c == '"')
+				state = IN_CODE;
+			else if (c == '\0')
+				state = IN_CODE;
+			continue;
+		}
+
+		if (state == IN_COMMENT) {
+			if (c != '\n' && c != '\0')
+				continue;
+			state = IN_CODE;
+		}
+
+		if (scan_class[c] & SC_SPACE) {
+			if (depth == 0 && !quoted && j >= target) {
+				cuts[n++] = j;
+				target = j + (len - j) / (pieces - n);
 			}
+		}
+		else if (c == ';')
+			state = IN_COMMENT;
+		else if (c == '\'')
+			quoted = 1;
+		else {
+			/* Whatever this is, it's what a waiting quote was for */
+			quoted = 0;
+			if (c == '"')
+				state = IN_STRING;
+			else if (c == '(')
+				++depth;
+			else if (c == ')' && depth > 0)
+				--depth;
+		}
+	}
+
+	return n;
+}
+
+typedef struct parse_job {
+	vm_heap *vm;
+	const char *text;
+	size_t len;
+	sexpr *forms;
+	tlab local;
+	pthread_t thread;
+} parse_job;
+
+static void* parse_piece(void *arg) {
+	parse_job *job = arg;
+
+	/* What we make goes on a list of our own, the same as for a future,
+		and is handed over once we're done */
+	current_tlab = &job->local;
+	job->forms = parse_forms(job->vm, job->text, job->len);
+	current_tlab = NULL;
+
+	return NULL;
+}
+
+sexpr* parse_all(vm_heap *vm, char *text, size_t len) {
+	int threads = futures_thread_count();
+	if (len < PARALLEL_PARSE_MIN || threads < 2)
+		return parse_forms(vm, text, len);
+
+	size_t *cuts = malloc(threads * sizeof(size_t));
+	int pieces = find_cuts(text, len, cuts, threads) + 1;
 
-			t = next_token(p->tk);
+	/* Each piece has to end in a '\0' for the tokenizer. The cuts are all
+		at whitespace, so we borrow those bytes and put them back after. */
+	char *saved = malloc(pieces);
+	parse_job *jobs = calloc(pieces, sizeof(parse_job));
+	size_t start = 0;
+	for (int j = 0; j < pieces; j++) {
+		size_t end = j < pieces - 1 ? cuts[j] : len;
+		jobs[j].vm = vm;
+		jobs[j].text = text + start;
+		jobs[j].len = end - start;
+		if (j < pieces - 1) {
+			saved[j] = text[end];
+			text[end] = '\0';
 		}
+		start = end + 1;
+	}
 
-		if (!t)
-			return sexpr_err(vm, "Expected end of list.");
-		else
-			token_free(t);
+	/* The first piece is ours */
+	int started = 1;
+	for (int j = 1; j < pieces; j++) {
+		if (pthread_create(&jobs[j].thread, NULL, parse_piece, &jobs[j]) != 0)
+			break;
+		started++;
+	}
 
-		return list;
+	jobs[0].forms = parse_forms(vm, jobs[0].text, jobs[0].len);
+	for (int j = 1; j < started; j++) {
+		pthread_join(jobs[j].thread, NULL);
+		vm_publish(vm, &jobs[j].local);
 	}
-	else {
-		sexpr *e = sexpr_from_token(vm, p, t);
-		token_free(t);
-		return e;
+
+	/* Any we couldn't start a thread for get done here */
+	for (int j = started; j < pieces; j++)
+		jobs[j].forms = parse_forms(vm, jobs[j].text, jobs[j].len);
+
+	for (int j = 0; j < pieces - 1; j++)
+		text[cuts[j]] = saved[j];
+
+	sexpr *forms = jobs[0].forms;
+	for (int j = 1; j < pieces; j++) {
+		for (int k = 0; k < jobs[j].forms->count; k++)
+			sexpr_append(forms, jobs[j].forms->children[k]);
 	}
 
-	return sexpr_err(vm, "Expected s-expression.");
+	free(jobs);
+	free(saved);
+	free(cuts);
+
+	return forms;
 }
@@ -5,20 +5,44 @@
 #include "sexpr.h"
 #include "tokenizer.h"
 
-sexpr* parse(char*, int*);
+/* A list, or a quote, that's been opened and not yet finished */
+typedef struct parse_frame {
+	sexpr *list;
+	int quote;
+} parse_frame;
 
 typedef struct parser {
-    int complete;
-    unsigned int open_p;
-    unsigned int closed_p;
-    sexpr *head;
-    sexpr *curr;
-    tokenizer *tk;
+	parse_frame *stack;
+	int depth;
+	int cap;
+	sexpr *err; /* First error in the expression we're partway through */
+	tokenizer *tk;
 } parser;
 
+/* parser_next gives back PARSE_DATUM with the next whole top-level
+	expression (or the error in it) in *out, PARSE_END once the tokenizer
+	has nothing left, or PARSE_MORE if the tokenizer is being fed input a
+	piece at a time and needs the next piece. After PARSE_MORE, feed the
+	tokenizer and call it again and it carries on where it left off.
+
+	An expression is handed back as soon as its last ) arrives, so nothing
+	is left half built when we give back a PARSE_DATUM and it's safe to
+	collect garbage then. It's not safe after a PARSE_MORE, since the
+	lists still open aren't reachable from anywhere the collector looks. */
+enum parse_status { PARSE_DATUM, PARSE_END, PARSE_MORE };
+
 parser* parser_new(tokenizer*);
 void parser_free(parser*);
-void parser_feed_token(vm_heap*, parser*, token*);
+enum parse_status parser_next(vm_heap*, parser*, sexpr**);
 sexpr *get_next_expr(vm_heap *vm, parser *p);
+int parser_pending(parser*);
+
+/* Parse the whole of text into a list of its top-level expressions, with
+	any that didn't parse left in as errors. A big text is cut into pieces
+	at top-level expressions and the pieces are parsed on separate threads
+	(as many as futures would use, see futures.h), so it takes less time
+	with more cores. text[len] has to be '\0'. text is written to while
+	we work but is put back the way it was before we give it back. */
+sexpr* parse_all(vm_heap*, char*, size_t);
 
 #endif
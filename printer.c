@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coro.h"
+#include "evaluator.h"
+#include "hashtable.h"
+#include "nstring.h"
+#include "numconv.h"
+#include "printer.h"
+#include "sexpr.h"
+
+/* Lists nested deeper than this go on the heap */
+#define PRINT_INLINE_DEPTH 64
+
+_Thread_local port *current_port = NULL;
+
+void port_open_file(port *p, FILE *f) {
+	p->f = f;
+	p->buf = p->chunk;
+	p->len = 0;
+	p->cap = PORT_CHUNK;
+	p->outer = NULL;
+}
+
+void port_open_string(port *p) {
+	port_open_file(p, NULL);
+}
+
+void port_close(port *p) {
+	port_flush(p);
+	if (p->buf != p->chunk)
+		free(p->buf);
+	p->buf = p->chunk;
+	p->len = 0;
+}
+
+/* For ports that have to outlive the C frame that made them, which is the
+	ones that get made current (see port_unwind_to) */
+port* port_new_string(void) {
+	port *p = malloc(sizeof(port));
+	port_open_string(p);
+
+	return p;
+}
+
+void port_free(port *p) {
+	port_close(p);
+	free(p);
+}
+
+void port_flush(port *p) {
+	if (p->f && p->len) {
+		fwrite(p->buf, 1, p->len, p->f);
+		p->len = 0;
+	}
+}
+
+/* Make room for n more bytes. A file port writes out what it has, a string
+	port grows. */
+static void make_room(port *p, size_t n) {
+	if (p->f) {
+		port_flush(p);
+		return;
+	}
+
+	size_t cap = p->cap * 2;
+	while (cap < p->len + n)
+		cap *= 2;
+
+	if (p->buf == p->chunk) {
+		p->buf = malloc(cap);
+		memcpy(p->buf, p->chunk, p->len);
+	}
+	else
+		p->buf = realloc(p->buf, cap);
+	p->cap = cap;
+}
+
+/* So that at least n bytes can go straight into p->buf. n is never more
+	than PORT_CHUNK. */
+static inline void reserve(port *p, size_t n) {
+	if (p->cap - p->len < n)
+		make_room(p, n);
+}
+
+void port_write(port *p, const char *s, size_t n) {
+	if (p->len + n > p->cap) {
+		make_room(p, n);
+
+		/* Too big to be worth copying through the buffer */
+		if (p->f && n >= p->cap) {
+			fwrite(s, 1, n, p->f);
+			return;
+		}
+	}
+
+	memcpy(p->buf + p->len, s, n);
+	p->len += n;
+}
+
+void port_putc(port *p, char c) {
+	reserve(p, 1);
+	p->buf[p->len++] = c;
+}
+
+static void put_str(port *p, const char *s) {
+	port_write(p, s, strlen(s));
+}
+
+/* Numbers are written straight into the buffer */
+static void put_long(port *p, long n) {
+	reserve(p, 24);
+
+	char *out = p->buf + p->len;
+	unsigned long u = n < 0 ? 0 - (unsigned long)n : (unsigned long)n;
+	if (n < 0)
+		*out++ = '-';
+
+	int digits = 1;
+	for (unsigned long x = u; x >= 10; x /= 10)
+		++digits;
+	for (int j = digits - 1; j >= 0; j--) {
+		out[j] = '0' + u % 10;
+		u /= 10;
+	}
+
+	p->len = out + digits - p->buf;
+}
+
+static void put_double(port *p, double d) {
+	reserve(p, NUM_BUF_SIZE);
+	p->len += num_format_double(p->buf + p->len, d);
+}
+
+/* Everything that doesn't have other sexprs inside it */
+static void print_atom(port *p, sexpr *v, int display) {
+	char tmp[64];
+
+	switch (v->type) {
+		case LVAL_ERR:
+			put_str(p, "Error: ");
+			put_str(p, v->err);
+			port_putc(p, '\n');
+			break;
+		case LVAL_SYM:
+			put_str(p, v->sym);
+			break;
+		case LVAL_STR:
+			if (!display)
+				port_putc(p, '"');
+			port_write(p, v->str, v->len);
+			if (!display)
+				port_putc(p, '"');
+			break;
+		case LVAL_STRBUILDER:
+			put_str(p, "String builder");
+			break;
+		case LVAL_HASH:
+			snprintf(tmp, sizeof tmp, "Hash table (%lu entries)", v->ht->count);
+			put_str(p, tmp);
+			break;
+		case LVAL_CONT:
+			put_str(p, "Continuation");
+			break;
+		case LVAL_CORO:
+			put_str(p, v->co->kind == CORO_GENERATOR ? "Generator" : "Task");
+			break;
+		case LVAL_FUTURE:
+			put_str(p, "Future");
+			break;
+		case LVAL_CHANNEL:
+			put_str(p, "Channel");
+			break;
+		case LVAL_NUM:
+			if (v->num_type == NUM_TYPE_INT)
+				put_long(p, v->i_num);
+			else
+				put_double(p, v->d_num);
+			break;
+		case LVAL_BOOL:
+			put_str(p, v->bool ? "#t" : "#f");
+			break;
+		case LVAL_NUMVEC:
+			put_str(p, v->num_type == NUM_TYPE_DEC ? "#f64(" : "#s64(");
+			for (int j = 0; j < v->count; j++) {
+				if (j > 0)
+					port_putc(p, ' ');
+				if (v->num_type == NUM_TYPE_DEC)
+					put_double(p, v->f64[j]);
+				else
+					put_long(p, v->s64[j]);
+			}
+			port_putc(p, ')');
+			break;
+		case LVAL_FUN:
+			put_str(p, "Built-in function");
+			break;
+		case LVAL_LIST:
+		case LVAL_CONST:
+		case LVAL_NULL:
+			/* Don't need to do anything */
+			break;
+	}
+}
+
+/* A list (or quote, or user-defined function) the printer is partway
+	through. next is which of its parts comes next. */
+typedef struct print_frame {
+	sexpr *v;
+	int next;
+} print_frame;
+
+static int has_parts(sexpr *v) {
+	return v->type == LVAL_LIST || v->type == LVAL_CONST
+		|| (v->type == LVAL_FUN && !v->builtin);
+}
+
+static void print_open(port *p, sexpr *v) {
+	if (v->type == LVAL_LIST)
+		port_putc(p, '(');
+	else if (v->type == LVAL_CONST)
+		put_str(p, "(quote ");
+	else
+		put_str(p, "User-defined function ");
+}
+
+/* Writes whatever goes before f's next part and gives it back, or writes
+	f's closing and gives back NULL once there are no more */
+static sexpr* print_next(port *p, print_frame *f) {
+	sexpr *v = f->v;
+	int j = f->next++;
+
+	if (v->type == LVAL_LIST) {
+		if (j < v->count) {
+			if (j > 0)
+				port_putc(p, ' ');
+			return v->children[j];
+		}
+		port_putc(p, ')');
+		return NULL;
+	}
+
+	if (v->type == LVAL_CONST) {
+		if (j == 0)
+			return v->datum;
+		port_putc(p, ')');
+		return NULL;
+	}
+
+	/* A user-defined function shows its parameters and body */
+	if (j == 0)
+		return v->params;
+	if (j == 1) {
+		port_putc(p, ' ');
+		return v->body;
+	}
+
+	return NULL;
+}
+
+void port_print(port *p, sexpr *v, int display) {
+	print_frame inline_stack[PRINT_INLINE_DEPTH];
+	print_frame *stack = inline_stack;
+	int cap = PRINT_INLINE_DEPTH;
+	int depth = 0;
+
+	while (v) {
+		if (has_parts(v)) {
+			if (depth == cap) {
+				cap *= 2;
+				if (stack == inline_stack) {
+					stack = malloc(sizeof(print_frame) * cap);
+					memcpy(stack, inline_stack, sizeof inline_stack);
+				}
+				else
+					stack = realloc(stack, sizeof(print_frame) * cap);
+			}
+			print_open(p, v);
+			stack[depth].v = v;
+			stack[depth++].next = 0;
+		}
+		else
+			print_atom(p, v, display);
+
+		/* Back out of whatever we've finished to find what's next */
+		v = NULL;
+		while (depth > 0 && !(v = print_next(p, &stack[depth - 1])))
+			--depth;
+	}
+
+	if (stack != inline_stack)
+		free(stack);
+}
+
+/* To the current output port */
+void out_print(sexpr *v, int display) {
+	if (current_port) {
+		port_print(current_port, v, display);
+		return;
+	}
+
+	port p;
+	port_open_file(&p, stdout);
+	port_print(&p, v, display);
+	port_close(&p);
+}
+
+void out_write(const char *s, size_t n) {
+	if (current_port)
+		port_write(current_port, s, n);
+	else
+		fwrite(s, 1, n, stdout);
+}
+
+/* What's in a string port, as a C string the caller owns. The port is left
+	empty. */
+char* port_cstr(port *p) {
+	port_putc(p, '\0');
+
+	char *s;
+	if (p->buf == p->chunk) {
+		s = malloc(p->len);
+		memcpy(s, p->chunk, p->len);
+	}
+	else
+		s = p->buf;
+
+	p->buf = p->chunk;
+	p->len = 0;
+	p->cap = PORT_CHUNK;
+
+	return s;
+}
+
+sexpr* port_to_str(vm_heap *vm, port *p) {
+	return sexpr_str_shared(vm, nstr_new(p->buf, p->len), p->len);
+}
+
+/* Free the ports from top down to, but not including, to */
+void port_release(port *top, port *to) {
+	while (top && top != to) {
+		port *outer = top->outer;
+		port_free(top);
+		top = outer;
+	}
+}
+
+/* After a call/cc escape, get rid of the ports the frames we jumped over
+	had made current */
+void port_unwind_to(port *to) {
+	port_release(current_port, to);
+	current_port = to;
+}
+
+sexpr* builtin_display(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "display expects just 1 argument.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(v);
+	out_print(v, 1);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_write(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "write expects just 1 argument.");
+
+	sexpr *v = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(v);
+	out_print(v, 0);
+
+	return sexpr_null();
+}
+
+sexpr* builtin_newline(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 1, "newline doesn't take any arguments.");
+	out_write("\n", 1);
+
+	return sexpr_null();
+}
+
+/* (with-output-to-string thunk) calls thunk and gives back everything it
+	displayed or wrote as a string, rather than printing it */
+sexpr* builtin_with_output_to_string(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 2, "with-output-to-string expects a function of no arguments.");
+
+	sexpr *f = eval2(vm, env, nodes[1]);
+	ASSERT_NOT_ERR(f);
+	ASSERT_TYPE(f, LVAL_FUN, "with-output-to-string expects a function of no arguments.");
+
+	port *p = port_new_string();
+	p->outer = current_port;
+	current_port = p;
+
+	sexpr *result = apply_fun(vm, env, f, NULL, 0);
+	current_port = p->outer;
+
+	if (result->type != LVAL_ERR)
+		result = port_to_str(vm, p);
+	port_free(p);
+
+	return result;
+}
+
+void load_printer_built_ins(scope *sc) {
+	scope_insert_var(sc, "display", sexpr_fun_builtin(&builtin_display, "display"));
+	scope_insert_var(sc, "write", sexpr_fun_builtin(&builtin_write, "write"));
+	scope_insert_var(sc, "newline", sexpr_fun_builtin(&builtin_newline, "newline"));
+	scope_insert_var(sc, "with-output-to-string",
+		sexpr_fun_builtin(&builtin_with_output_to_string, "with-output-to-string"));
+}
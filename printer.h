@@ -0,0 +1,59 @@
+#ifndef printer_h
+#define printer_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "fwd.h"
+
+/* Output ports. Printing goes into a port's buffer instead of a printf or
+	putchar per atom. A file port writes its buffer out to the FILE when it
+	fills up and when the port is closed, so even a big list is a few large
+	fwrite()s. A string port just grows, and what's in it becomes a string
+	at the end (see with-output-to-string).
+
+	The printer itself is a loop with its own stack of the lists it's in
+	the middle of, so a deeply nested list can't run it off the C stack.
+
+	Each thread has a current output port that display, write and newline
+	go to. NULL means stdout. A future runs with its own, as does each
+	coroutine, and a call/cc that escapes out of a with-output-to-string
+	puts back the port that was current when the call/cc was made. */
+
+#define PORT_CHUNK 4096
+
+typedef struct port {
+	FILE *f; /* NULL for a string port */
+	char *buf; /* chunk, until a string port outgrows it */
+	size_t len;
+	size_t cap;
+	struct port *outer; /* What was current before this one */
+	char chunk[PORT_CHUNK];
+} port;
+
+extern _Thread_local port *current_port;
+
+/* A port points into itself, so it can't be copied once it's opened */
+void port_open_file(port*, FILE*);
+void port_open_string(port*);
+void port_close(port*);
+port* port_new_string(void);
+void port_free(port*);
+
+void port_write(port*, const char*, size_t);
+void port_putc(port*, char);
+void port_flush(port*);
+
+/* display leaves the quotes off strings, write keeps them */
+void port_print(port*, sexpr*, int display);
+void out_print(sexpr*, int display);
+void out_write(const char*, size_t);
+
+char* port_cstr(port*);
+sexpr* port_to_str(vm_heap*, port*);
+
+void port_release(port *top, port *to);
+void port_unwind_to(port*);
+void load_printer_built_ins(scope*);
+
+#endif
@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Symbols are letters, digits and @#$&:|?._-+*!<>=/ */
+const unsigned char scan_class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 2, 0, 2, 2, 0, 2, 0, 0, 0, 2, 2, 0, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 2, 2, 2, 2,
+	2, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 2,
+	0, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 2, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/* Plain C versions. These are what we run on non-x86 machines and they
+	also finish off whatever's left after the SIMD loops. */
+static size_t space_end_scalar(const char *s, size_t pos, size_t len) {
+	while (scan_class[(unsigned char)s[pos]] & SC_SPACE)
+		++pos;
+
+	return pos;
+}
+
+static size_t symbol_end_scalar(const char *s, size_t pos, size_t len) {
+	while (scan_class[(unsigned char)s[pos]] & SC_SYMBOL)
+		++pos;
+
+	return pos;
+}
+
+/* The C library's versions of these are usually vectorized already */
+static size_t string_end_scalar(const char *s, size_t pos, size_t len) {
+	return pos + strcspn(s + pos, "\"\\");
+}
+
+static size_t line_end_scalar(const char *s, size_t pos, size_t len) {
+	const char *nl = strchr(s + pos, '\n');
+
+	return nl ? (size_t)(nl - s) : pos + strlen(s + pos);
+}
+
+static const scan_kernels scalar_kernels = {
+	"scalar",
+	space_end_scalar, symbol_end_scalar, string_end_scalar, line_end_scalar
+};
+
+#ifdef SCAN_X86
+
+/* Each of these builds a mask with a bit set for every byte in the block
+	that ends the run, so the first set bit is where it stops. Bytes from
+	0x80 up are negative as far as the signed compares go, so they never
+	count as being in a range and always end a symbol. */
+
+#define IN_RANGE_128(v, lo, hi) _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+	_mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+#define IS_128(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+
+__attribute__((target("sse2")))
+static inline unsigned int space_mask_sse2(__m128i v) {
+	__m128i sp = _mm_or_si128(_mm_or_si128(IS_128(v, ' '), IS_128(v, '\n')),
+		_mm_or_si128(IS_128(v, '\t'), IS_128(v, '\r')));
+
+	return ~_mm_movemask_epi8(sp) & 0xffff;
+}
+
+/* Everything from ! to z, and |, less the handful in there that aren't
+	allowed */
+__attribute__((target("sse2")))
+static inline unsigned int symbol_mask_sse2(__m128i v) {
+	__m128i in = _mm_or_si128(IN_RANGE_128(v, '!', 'z'), IS_128(v, '|'));
+	__m128i out = _mm_or_si128(
+		_mm_or_si128(_mm_or_si128(IS_128(v, '"'), IS_128(v, '%')),
+			_mm_or_si128(IN_RANGE_128(v, '\'', ')'), IS_128(v, ','))),
+		_mm_or_si128(_mm_or_si128(IS_128(v, ';'), IN_RANGE_128(v, '[', '^')),
+			IS_128(v, '`')));
+
+	return ~_mm_movemask_epi8(_mm_andnot_si128(out, in)) & 0xffff;
+}
+
+__attribute__((target("sse2")))
+static inline unsigned int string_mask_sse2(__m128i v) {
+	__m128i m = _mm_or_si128(_mm_or_si128(IS_128(v, '"'), IS_128(v, '\\')),
+		IS_128(v, '\0'));
+
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned int line_mask_sse2(__m128i v) {
+	return _mm_movemask_epi8(_mm_or_si128(IS_128(v, '\n'), IS_128(v, '\0')));
+}
+
+#define SCAN_SSE2(name, scalar) \
+	__attribute__((target("sse2"))) \
+	static size_t name##_sse2(const char *s, size_t pos, size_t len) { \
+		for (; pos + 16 <= len; pos += 16) { \
+			unsigned int m = name##_mask_sse2(_mm_loadu_si128((const __m128i*)(s + pos))); \
+			if (m) \
+				return pos + __builtin_ctz(m); \
+		} \
+		return scalar(s, pos, len); \
+	}
+
+SCAN_SSE2(space, space_end_scalar)
+SCAN_SSE2(symbol, symbol_end_scalar)
+SCAN_SSE2(string, string_end_scalar)
+SCAN_SSE2(line, line_end_scalar)
+
+static const scan_kernels sse2_kernels = {
+	"sse2",
+	space_sse2, symbol_sse2, string_sse2, line_sse2
+};
+
+/* The same again, 32 bytes at a time */
+
+#define IN_RANGE_256(v, lo, hi) _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), \
+	_mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+#define IS_256(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+
+__attribute__((target("avx2")))
+static inline unsigned int space_mask_avx2(__m256i v) {
+	__m256i sp = _mm256_or_si256(_mm256_or_si256(IS_256(v, ' '), IS_256(v, '\n')),
+		_mm256_or_si256(IS_256(v, '\t'), IS_256(v, '\r')));
+
+	return ~(unsigned int)_mm256_movemask_epi8(sp);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int symbol_mask_avx2(__m256i v) {
+	__m256i in = _mm256_or_si256(IN_RANGE_256(v, '!', 'z'), IS_256(v, '|'));
+	__m256i out = _mm256_or_si256(
+		_mm256_or_si256(_mm256_or_si256(IS_256(v, '"'), IS_256(v, '%')),
+			_mm256_or_si256(IN_RANGE_256(v, '\'', ')'), IS_256(v, ','))),
+		_mm256_or_si256(_mm256_or_si256(IS_256(v, ';'), IN_RANGE_256(v, '[', '^')),
+			IS_256(v, '`')));
+
+	return ~(unsigned int)_mm256_movemask_epi8(_mm256_andnot_si256(out, in));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int string_mask_avx2(__m256i v) {
+	__m256i m = _mm256_or_si256(_mm256_or_si256(IS_256(v, '"'), IS_256(v, '\\')),
+		IS_256(v, '\0'));
+
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int line_mask_avx2(__m256i v) {
+	return _mm256_movemask_epi8(_mm256_or_si256(IS_256(v, '\n'), IS_256(v, '\0')));
+}
+
+/* Most runs are short (a space, a five letter symbol) so the first block
+	is done with SSE2, which costs less to get going, and we only switch to
+	32 bytes at a time once the run has gone on past it */
+#define SCAN_AVX2(name) \
+	__attribute__((target("avx2"))) \
+	static size_t name##_avx2(const char *s, size_t pos, size_t len) { \
+		if (pos + 16 > len) \
+			return name##_sse2(s, pos, len); \
+		unsigned int m = name##_mask_sse2(_mm_loadu_si128((const __m128i*)(s + pos))); \
+		if (m) \
+			return pos + __builtin_ctz(m); \
+		for (pos += 16; pos + 32 <= len; pos += 32) { \
+			m = name##_mask_avx2(_mm256_loadu_si256((const __m256i*)(s + pos))); \
+			if (m) \
+				return pos + __builtin_ctz(m); \
+		} \
+		return name##_sse2(s, pos, len); \
+	}
+
+SCAN_AVX2(space)
+SCAN_AVX2(symbol)
+SCAN_AVX2(string)
+SCAN_AVX2(line)
+
+static const scan_kernels avx2_kernels = {
+	"avx2",
+	space_avx2, symbol_avx2, string_avx2, line_avx2
+};
+
+#endif
+
+static const scan_kernels *kernels = &scalar_kernels;
+
+/* Same rules as numvec.c's */
+static void pick_kernels(void) {
+	kernels = &scalar_kernels;
+
+#ifdef SCAN_X86
+	char *cap = getenv("NOTION_SIMD");
+
+	if (cap && strcmp(cap, "scalar") == 0)
+		return;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && !(cap && strcmp(cap, "sse2") == 0))
+		kernels = &avx2_kernels;
+	else if (__builtin_cpu_supports("sse2"))
+		kernels = &sse2_kernels;
+#endif
+}
+
+void scan_init(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, pick_kernels);
+}
+
+const scan_kernels* scan_kernels_get(void) {
+	scan_init();
+
+	return kernels;
+}
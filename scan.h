@@ -0,0 +1,37 @@
+#ifndef scan_h
+#define scan_h
+
+#include <stddef.h>
+
+/* The tokenizer's inner loops: getting past whitespace, finding the end of
+	a symbol, of the inside of a string and of a comment. Like numvec.h
+	these are kernels picked once at start-up, AVX2, SSE2 or plain C, and
+	NOTION_SIMD=scalar (or sse2) in the environment caps the choice.
+
+	Each one is handed the text, where to start and how long the text is,
+	and gives back the position of the first byte that isn't part of the
+	run. The text always has a '\0' at s[len], which ends every run, so
+	the SIMD loops only work on whole blocks that fit before len and leave
+	the last few bytes to the plain C loop. */
+
+typedef size_t (*scan_fn)(const char *s, size_t pos, size_t len);
+
+typedef struct scan_kernels {
+	const char *name;
+	scan_fn space_end; /* First byte that isn't ' ', \t, \r or \n */
+	scan_fn symbol_end; /* First byte that can't be in a symbol */
+	scan_fn string_end; /* First '"', '\\' or '\0' */
+	scan_fn line_end; /* First '\n' or '\0' */
+} scan_kernels;
+
+/* Character classes, for the places we only look at one byte */
+#define SC_SPACE 1
+#define SC_SYMBOL 2
+#define SC_ALPHA 4
+
+extern const unsigned char scan_class[256];
+
+void scan_init(void);
+const scan_kernels* scan_kernels_get(void);
+
+#endif
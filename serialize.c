@@ -0,0 +1,519 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serialize.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "hashtable.h"
+#include "interp.h"
+#include "memo.h"
+#include "nstring.h"
+#include "sexpr.h"
+#include "stack.h"
+
+/* Each value is a tag byte followed by whatever that kind of value needs.
+	Lengths and counts are 64 bit, everything is in the host's byte order
+	since messages never leave the process. */
+enum msg_tag { M_NULL, M_INT, M_DEC, M_BOOL, M_STR, M_SYM, M_ERR, M_LIST,
+	M_CONST, M_NUMVEC, M_HASH, M_BUILTIN, M_FUN, M_CHANNEL };
+
+static void put(message *m, const void *p, size_t n) {
+	if (m->len + n > m->cap) {
+		while (m->len + n > m->cap)
+			m->cap = m->cap ? m->cap * 2 : 256;
+		m->data = realloc(m->data, m->cap);
+	}
+
+	memcpy(m->data + m->len, p, n);
+	m->len += n;
+}
+
+static void put_u8(message *m, uint8_t b) {
+	put(m, &b, 1);
+}
+
+static void put_u64(message *m, uint64_t n) {
+	put(m, &n, sizeof n);
+}
+
+static void put_bytes(message *m, const char *s, size_t len) {
+	put_u64(m, len);
+	put(m, s, len);
+}
+
+/* Symbols and error messages are stored with their '\0' so the reader can
+	use them where they are */
+static void put_cstr(message *m, const char *s) {
+	put_u64(m, strlen(s));
+	put(m, s, strlen(s) + 1);
+}
+
+typedef struct writer {
+	vm_heap *vm;
+	message *m;
+	/* Hash tables we're in the middle of writing, to catch one that
+		contains itself */
+	sexpr **open;
+	int open_count;
+	int open_cap;
+	sexpr *err;
+	int image; /* Written to a file, which a channel can't be */
+} writer;
+
+static void write_value(writer*, sexpr*);
+
+static void write_entry(sexpr *key, sexpr *val, void *arg) {
+	writer *w = arg;
+	write_value(w, key);
+	write_value(w, val);
+}
+
+static void write_hash(writer *w, sexpr *v) {
+	for (int j = 0; j < w->open_count; j++) {
+		if (w->open[j] == v) {
+			w->err = sexpr_err(w->vm, "Can't send a hash table that contains itself.");
+			return;
+		}
+	}
+
+	if (w->open_count == w->open_cap) {
+		w->open_cap = w->open_cap ? w->open_cap * 2 : 8;
+		w->open = realloc(w->open, w->open_cap * sizeof(sexpr*));
+	}
+	w->open[w->open_count++] = v;
+
+	put_u8(w->m, M_HASH);
+	put_u8(w->m, v->ht->equal);
+	put_u64(w->m, v->ht->count);
+	ht_walk(v->ht, write_entry, w);
+
+	w->open_count--;
+}
+
+static void write_value(writer *w, sexpr *v) {
+	message *m = w->m;
+
+	if (w->err)
+		return;
+
+	switch (v->type) {
+		case LVAL_NULL:
+			put_u8(m, M_NULL);
+			break;
+		case LVAL_NUM:
+			if (v->num_type == NUM_TYPE_INT) {
+				put_u8(m, M_INT);
+				put(m, &v->i_num, sizeof v->i_num);
+			}
+			else {
+				put_u8(m, M_DEC);
+				put(m, &v->d_num, sizeof v->d_num);
+			}
+			break;
+		case LVAL_BOOL:
+			put_u8(m, M_BOOL);
+			put_u8(m, v->bool);
+			break;
+		case LVAL_STR:
+			put_u8(m, M_STR);
+			put_bytes(m, v->str, v->len);
+			break;
+		case LVAL_SYM:
+			put_u8(m, M_SYM);
+			put_cstr(m, v->sym);
+			break;
+		case LVAL_ERR:
+			put_u8(m, M_ERR);
+			put_cstr(m, v->err);
+			break;
+		case LVAL_LIST:
+			put_u8(m, M_LIST);
+			put_u64(m, v->count);
+			for (int j = 0; j < v->count; j++)
+				write_value(w, v->children[j]);
+			break;
+		case LVAL_CONST:
+			put_u8(m, M_CONST);
+			write_value(w, v->datum);
+			break;
+		case LVAL_NUMVEC:
+			put_u8(m, M_NUMVEC);
+			put_u8(m, v->num_type);
+			put_u64(m, v->count);
+			if (v->num_type == NUM_TYPE_DEC)
+				put(m, v->f64, v->count * sizeof(double));
+			else
+				put(m, v->s64, v->count * sizeof(int64_t));
+			break;
+		case LVAL_HASH:
+			write_hash(w, v);
+			break;
+		case LVAL_FUN:
+			/* Every interpreter has the same built-ins, and they can't be
+				redefined, so the name is enough */
+			if (v->builtin) {
+				put_u8(m, M_BUILTIN);
+				put_cstr(m, v->sym);
+				break;
+			}
+
+			put_u8(m, M_FUN);
+			put_cstr(m, v->sym);
+			/* A memoized function gets an empty cache of the same size */
+			put_u64(m, v->memo ? v->memo->limit + 1 : 0);
+			write_value(w, v->params);
+			write_value(w, v->body);
+			write_value(w, v->captured ? v->captured : sexpr_null());
+			break;
+		case LVAL_CHANNEL:
+			if (w->image) {
+				w->err = sexpr_err(w->vm, "Can't save a channel in an image.");
+				break;
+			}
+			put_u8(m, M_CHANNEL);
+			put(m, &v->chan, sizeof v->chan);
+			break;
+		default: {
+			char msg[256];
+			char *desc = sexpr_desc(v);
+			snprintf(msg, sizeof msg, "Can't send %s to another interpreter.", desc);
+			free(desc);
+			w->err = sexpr_err(w->vm, msg);
+		}
+	}
+}
+
+/* Reading a message either builds the values it describes, or walks over
+	it just to take or drop the references it holds to channels */
+enum read_mode { READ_BUILD, READ_ACQUIRE, READ_RELEASE };
+
+typedef struct reader {
+	enum read_mode mode;
+	vm_heap *vm;
+	scope *global;
+	message *m;
+	size_t pos;
+	/* The bytes came from a file (an image or a .fasl cache), so they
+		may be anything and can't hold a channel */
+	int file;
+	int bad; /* Ran off the end, or found something that can't be right */
+} reader;
+
+static size_t left(reader *r) {
+	return r->m->len - r->pos;
+}
+
+/* Every read is checked against the end of the message. Once one fails
+	the reader is bad, gets zeros from then on and stops making things. */
+static void get(reader *r, void *p, size_t n) {
+	if (r->bad || n > left(r)) {
+		r->bad = 1;
+		memset(p, 0, n);
+		return;
+	}
+
+	memcpy(p, r->m->data + r->pos, n);
+	r->pos += n;
+}
+
+static uint8_t get_u8(reader *r) {
+	uint8_t b;
+	get(r, &b, 1);
+
+	return b;
+}
+
+static uint64_t get_u64(reader *r) {
+	uint64_t n;
+	get(r, &n, sizeof n);
+
+	return n;
+}
+
+static char* get_bytes(reader *r, size_t *len) {
+	*len = get_u64(r);
+	if (r->bad || *len > left(r)) {
+		r->bad = 1;
+		*len = 0;
+		return "";
+	}
+
+	char *s = (char*)r->m->data + r->pos;
+	r->pos += *len;
+
+	return s;
+}
+
+static char* get_cstr(reader *r) {
+	size_t len;
+	char *s = get_bytes(r, &len);
+	if (r->bad || left(r) == 0 || s[len] != '\0') {
+		r->bad = 1;
+		return "";
+	}
+	r->pos++;
+
+	return s;
+}
+
+/* Every value takes at least a byte, so a count bigger than what's left
+	(or than fits in an int) is a corrupt one, and not a reason to loop for
+	ever or allocate the world */
+static uint64_t get_count(reader *r) {
+	uint64_t n = get_u64(r);
+	if (n > left(r) || n > INT_MAX) {
+		r->bad = 1;
+		return 0;
+	}
+
+	return n;
+}
+
+/* A function's parameters are a list of symbols, which is what the
+	evaluator takes for granted */
+static int good_params(sexpr *params) {
+	if (params->type != LVAL_LIST)
+		return 0;
+
+	for (int j = 0; j < params->count; j++) {
+		if (params->children[j]->type != LVAL_SYM)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* In READ_BUILD mode gives back the value, otherwise NULL. Also NULL once
+	the reader has gone bad. */
+static sexpr* read_value(reader *r) {
+	int build = r->mode == READ_BUILD;
+	vm_heap *vm = r->vm;
+	sexpr *v = NULL;
+	size_t len;
+	char *s;
+
+	/* A corrupt file can nest as deep as it's long */
+	if (stack_low())
+		r->bad = 1;
+	if (r->bad)
+		return NULL;
+
+	switch (get_u8(r)) {
+		case M_NULL:
+			return build ? sexpr_null() : NULL;
+		case M_INT: {
+			long n;
+			get(r, &n, sizeof n);
+			if (build && !r->bad) {
+				v = sexpr_num(vm, NUM_TYPE_INT, 0);
+				v->i_num = n;
+			}
+			return v;
+		}
+		case M_DEC: {
+			double d;
+			get(r, &d, sizeof d);
+			return build && !r->bad ? sexpr_num(vm, NUM_TYPE_DEC, d) : NULL;
+		}
+		case M_BOOL: {
+			int b = get_u8(r);
+			return build && !r->bad ? sexpr_bool(vm, b) : NULL;
+		}
+		case M_STR:
+			s = get_bytes(r, &len);
+			return build && !r->bad ? sexpr_str_shared(vm, nstr_new(s, len), len) : NULL;
+		case M_SYM:
+			s = get_cstr(r);
+			return build && !r->bad ? sexpr_sym(vm, s) : NULL;
+		case M_ERR:
+			s = get_cstr(r);
+			return build && !r->bad ? sexpr_err(vm, s) : NULL;
+		case M_LIST: {
+			uint64_t count = get_count(r);
+			if (build && !r->bad)
+				v = sexpr_list(vm);
+			for (uint64_t j = 0; j < count && !r->bad; j++) {
+				sexpr *c = read_value(r);
+				if (build && c)
+					sexpr_append(v, c);
+			}
+			return r->bad ? NULL : v;
+		}
+		case M_CONST: {
+			sexpr *datum = read_value(r);
+			return build && datum ? sexpr_const(vm, datum) : NULL;
+		}
+		case M_NUMVEC: {
+			enum sexpr_num_type t = get_u8(r);
+			uint64_t count = get_u64(r);
+			size_t size = t == NUM_TYPE_DEC ? sizeof(double) : sizeof(int64_t);
+			if ((t != NUM_TYPE_DEC && t != NUM_TYPE_INT) || count > left(r) / size
+					|| count > INT_MAX) {
+				r->bad = 1;
+				return NULL;
+			}
+			if (!build) {
+				r->pos += count * size;
+				return NULL;
+			}
+			v = sexpr_numvec(vm, t, count);
+			if (!v) {
+				r->bad = 1;
+				return NULL;
+			}
+			get(r, t == NUM_TYPE_DEC ? (void*)v->f64 : (void*)v->s64, count * size);
+			return v;
+		}
+		case M_HASH: {
+			int equal = get_u8(r);
+			uint64_t count = get_count(r);
+			if (build && !r->bad)
+				v = sexpr_hashtable(vm, ht_new(equal));
+			for (uint64_t j = 0; j < count && !r->bad; j++) {
+				sexpr *key = read_value(r);
+				sexpr *val = read_value(r);
+				if (build && key && val)
+					ht_set(v->ht, key, val);
+			}
+			return r->bad ? NULL : v;
+		}
+		case M_BUILTIN:
+			s = get_cstr(r);
+			if (!build || r->bad)
+				return NULL;
+			v = scope_fetch_var(vm, r->global, s);
+			if (r->file && (v->type != LVAL_FUN || !v->builtin)) {
+				r->bad = 1;
+				return NULL;
+			}
+			return v;
+		case M_FUN: {
+			char *name = get_cstr(r);
+			uint64_t memo = get_u64(r);
+			sexpr *params = read_value(r);
+			sexpr *body = read_value(r);
+			sexpr *captured = read_value(r);
+			if (!build || r->bad)
+				return NULL;
+			if (r->file && (!good_params(params) || memo > (uint64_t)LONG_MAX + 1)) {
+				r->bad = 1;
+				return NULL;
+			}
+
+			v = sexpr_fun_user(vm, params, body, name);
+			if (captured->type == LVAL_LIST)
+				v->captured = captured;
+			if (memo)
+				v->memo = memo_new(memo - 1);
+			return v;
+		}
+		case M_CHANNEL: {
+			/* From a file this would be a made-up pointer */
+			if (r->file) {
+				r->bad = 1;
+				return NULL;
+			}
+
+			channel *ch;
+			get(r, &ch, sizeof ch);
+			if (r->mode == READ_ACQUIRE)
+				channel_ref(ch);
+			else if (r->mode == READ_RELEASE)
+				channel_release(ch);
+			else
+				v = sexpr_channel(vm, ch);
+			return v;
+		}
+	}
+
+	if (r->file) {
+		r->bad = 1;
+		return NULL;
+	}
+
+	return build ? sexpr_err(vm, "Corrupt message.") : NULL;
+}
+
+static void walk(message *m, enum read_mode mode) {
+	reader r = { mode, NULL, NULL, m, 0, 0, 0 };
+	read_value(&r);
+}
+
+/* Flatten v into m, which should start out zeroed. Gives back an error if
+	v has something in it that can't be sent, otherwise NULL. */
+sexpr* serialize(vm_heap *vm, sexpr *v, message *m) {
+	writer w = { vm, m, NULL, 0, 0, NULL, 0 };
+	write_value(&w, v);
+	free(w.open);
+
+	if (w.err) {
+		free(m->data);
+		m->data = NULL;
+		m->len = m->cap = 0;
+		return w.err;
+	}
+
+	/* The message now holds its own references to any channels in it */
+	walk(m, READ_ACQUIRE);
+
+	return NULL;
+}
+
+/* Like serialize() but for saving to a file (see image.h), so anything
+	that only makes sense inside this process is refused */
+sexpr* serialize_image(vm_heap *vm, sexpr *v, message *m) {
+	writer w = { vm, m, NULL, 0, 0, NULL, 1 };
+	write_value(&w, v);
+	free(w.open);
+
+	if (w.err) {
+		free(m->data);
+		m->data = NULL;
+		m->len = m->cap = 0;
+		return w.err;
+	}
+
+	return NULL;
+}
+
+/* Build the value m describes on vm's heap. Built-ins are looked up in
+	global. The message is used up: its references to channels are handed
+	over to the values made from them. */
+sexpr* deserialize(vm_heap *vm, scope *global, message *m) {
+	reader r = { READ_BUILD, vm, global, m, 0, 0, 0 };
+	sexpr *v = read_value(&r);
+	if (!v)
+		v = sexpr_err(vm, "Corrupt message.");
+
+	free(m->data);
+	m->data = NULL;
+	m->len = m->cap = 0;
+
+	return v;
+}
+
+/* Build a value from bytes we don't own, like part of a mapped image
+	file. The bytes are copied out of, never kept. They're from a file, so
+	they're checked as they're read, and if they don't hold exactly one
+	good value we give back NULL. */
+sexpr* deserialize_bytes(vm_heap *vm, scope *global, const unsigned char *data, size_t len) {
+	message m = { (unsigned char*)data, len, len };
+	reader r = { READ_BUILD, vm, global, &m, 0, 1, 0 };
+	sexpr *v = read_value(&r);
+
+	return r.bad || r.pos != len ? NULL : v;
+}
+
+/* For a message that's never going to be read */
+void message_discard(message *m) {
+	if (!m->data)
+		return;
+
+	walk(m, READ_RELEASE);
+	free(m->data);
+	m->data = NULL;
+	m->len = m->cap = 0;
+}
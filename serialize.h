@@ -0,0 +1,33 @@
+#ifndef serialize_h
+#define serialize_h
+
+#include <stddef.h>
+
+#include "fwd.h"
+
+/* Values flattened into a block of bytes, for moving them from one
+	interpreter's heap to another's (see interp.h). Nothing in a message
+	points into the heap it came from, so the sender's GC can do what it
+	likes once the message is made.
+
+	Lists, strings, numbers, vectors, hash tables and functions (their
+	parameters, body and captured variables) can all be sent. A function
+	doesn't bring along any globals it refers to (interp-spawn sees to
+	those separately). Channels are sent by reference: both
+	sides end up with the same channel. Continuations, coroutines, futures
+	and string builders belong to the interpreter that made them and can't
+	be sent. */
+
+typedef struct message {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+} message;
+
+sexpr* serialize(vm_heap*, sexpr*, message*);
+sexpr* deserialize(vm_heap*, scope*, message*);
+sexpr* serialize_image(vm_heap*, sexpr*, message*);
+sexpr* deserialize_bytes(vm_heap*, scope*, const unsigned char*, size_t);
+void message_discard(message*);
+
+#endif
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "environment.h"
+#include "evaluator.h"
+#include "futures.h"
+#include "image.h"
+#include "printer.h"
+#include "sexpr.h"
+#include "stack.h"
+#include "tokenizer.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK (64 * 1024)
+
+typedef struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+} buffer;
+
+typedef struct connection {
+	int fd;
+	scope *env;
+	buffer in;
+	buffer out;
+	size_t sent; /* How much of out has gone so far */
+	int closing; /* Close once out has all gone */
+} connection;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+	stopping = 1;
+}
+
+static void buffer_reserve(buffer *b, size_t n) {
+	if (b->len + n <= b->cap)
+		return;
+
+	while (b->len + n > b->cap)
+		b->cap = b->cap ? b->cap * 2 : 4096;
+	b->data = realloc(b->data, b->cap);
+}
+
+static void buffer_put(buffer *b, const void *p, size_t n) {
+	buffer_reserve(b, n);
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void put_length(buffer *b, uint32_t n) {
+	unsigned char hdr[4] = { n >> 24, n >> 16, n >> 8, n };
+	buffer_put(b, hdr, 4);
+}
+
+static uint32_t get_length(const char *p) {
+	const unsigned char *u = (const unsigned char*)p;
+	return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void respond(connection *c, int status, const char *text, size_t len) {
+	put_length(&c->out, len + 1);
+	unsigned char s = status;
+	buffer_put(&c->out, &s, 1);
+	buffer_put(&c->out, text, len);
+}
+
+static void handle_request(vm_heap *vm, connection *c, const char *src, size_t len) {
+	char *line = malloc(len + 1);
+	memcpy(line, src, len);
+	line[len] = '\0';
+
+	/* Whatever the request displays or writes goes back to the client
+		ahead of the result, not to our stdout */
+	port *out = port_new_string();
+	out->outer = current_port;
+	current_port = out;
+
+	tokenizer *tk = tokenizer_new();
+	tokenizer_feed_buffer(tk, line, len);
+	sexpr *result = eval_all(vm, c->env, tk, NULL);
+	tokenizer_free(tk);
+	free(line);
+
+	current_port = out->outer;
+
+	int status = 0;
+	if (result->type == LVAL_ERR) {
+		if (strcmp(result->err, "<quit>") == 0)
+			c->closing = 1;
+		else {
+			port_write(out, result->err, strlen(result->err));
+			status = 1;
+		}
+	}
+	else
+		port_print(out, result, 0);
+
+	respond(c, status, out->buf, out->len);
+	port_free(out);
+}
+
+/* Answer every complete request in the input buffer. Gives back 0 if the
+	connection should be dropped. */
+static int handle_input(vm_heap *vm, scope *global, connection *c) {
+	size_t pos = 0;
+
+	while (!c->closing && c->in.len - pos >= 4) {
+		uint32_t n = get_length(c->in.data + pos);
+		if (n > SERVER_MAX_REQUEST)
+			return 0;
+		if (c->in.len - pos - 4 < n)
+			break;
+
+		handle_request(vm, c, c->in.data + pos + 4, n);
+		pos += 4 + n;
+
+		/* In between requests nothing is on the C stack, so it's a safe
+			point to collect */
+		gc_maybe(vm, global);
+	}
+
+	memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+	c->in.len -= pos;
+
+	return 1;
+}
+
+/* Send what we can without blocking. Gives back 0 if the connection
+	should be dropped. */
+static int flush_output(connection *c) {
+	while (c->sent < c->out.len) {
+		ssize_t n = write(c->fd, c->out.data + c->sent, c->out.len - c->sent);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		c->sent += n;
+	}
+
+	c->out.len = 0;
+	c->sent = 0;
+
+	return !c->closing;
+}
+
+static void watch(int epfd, connection *c, int op) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (c->sent < c->out.len ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+static connection* connection_new(vm_heap *vm, scope *global, int fd) {
+	connection *c = calloc(1, sizeof(connection));
+	c->fd = fd;
+	c->env = scope_copy(global);
+	vm_add_scope(vm, c->env);
+
+	return c;
+}
+
+static void connection_free(vm_heap *vm, connection *c) {
+	close(c->fd);
+	vm_remove_scope(vm, c->env);
+	scope_free(c->env);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+}
+
+static void on_readable(vm_heap *vm, scope *global, int epfd, connection *c) {
+	int open = 1;
+
+	for (;;) {
+		buffer_reserve(&c->in, READ_CHUNK);
+		ssize_t n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+		if (n > 0) {
+			c->in.len += n;
+			continue;
+		}
+
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			open = 0;
+		if (n == 0 || errno != EINTR)
+			break;
+	}
+
+	/* Whatever arrived before the client hung up still gets answered, as
+		far as it can be */
+	if (!handle_input(vm, global, c) || !flush_output(c) || !open) {
+		connection_free(vm, c);
+		return;
+	}
+
+	watch(epfd, c, EPOLL_CTL_MOD);
+}
+
+static void on_writable(vm_heap *vm, int epfd, connection *c) {
+	if (!flush_output(c)) {
+		connection_free(vm, c);
+		return;
+	}
+
+	watch(epfd, c, EPOLL_CTL_MOD);
+}
+
+static void accept_all(vm_heap *vm, scope *global, int epfd, int lfd) {
+	for (;;) {
+		int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		connection *c = connection_new(vm, global, fd);
+		watch(epfd, c, EPOLL_CTL_ADD);
+	}
+}
+
+static int listen_on(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: Socket path is too long.\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* Left behind by a server that didn't get to clean up */
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int serve(const char *path, const char *image, char **files, int file_count) {
+	vm_heap *vm = vm_new();
+	stack_init();
+	scope *global = scope_new(GLOBAL_TABLE_SIZE);
+	load_built_ins(global);
+
+	int status = EXIT_SUCCESS;
+	sexpr *err = image ? image_open(vm, image) : NULL;
+	if (err) {
+		fprintf(stderr, "%s: %s\n", image, err->err);
+		status = EXIT_FAILURE;
+	}
+
+	for (int j = 0; j < file_count && status == EXIT_SUCCESS; j++) {
+		tokenizer *tk = tokenizer_new();
+		if (!start_file(tk, files[j])) {
+			fprintf(stderr, "%s: File not found.\n", files[j]);
+			status = EXIT_FAILURE;
+		}
+		else {
+			sexpr *r = eval_all(vm, global, tk, NULL);
+			if (r->type == LVAL_ERR) {
+				fprintf(stderr, "%s: %s\n", files[j], r->err);
+				status = EXIT_FAILURE;
+			}
+		}
+		tokenizer_free(tk);
+	}
+
+	int lfd = status == EXIT_SUCCESS ? listen_on(path) : -1;
+	if (lfd < 0) {
+		free_built_ins(global);
+		scope_free(global);
+		vm_free(vm);
+		free(vm);
+		return EXIT_FAILURE;
+	}
+
+	gc_run(vm, global);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /* NULL means the listening socket */
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+	fprintf(stderr, "Serving on %s\n", path);
+
+	struct epoll_event events[MAX_EVENTS];
+	while (!stopping) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		for (int j = 0; j < n; j++) {
+			connection *c = events[j].data.ptr;
+			if (!c)
+				accept_all(vm, global, epfd, lfd);
+			else if (events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				on_readable(vm, global, epfd, c);
+			else if (events[j].events & EPOLLOUT)
+				on_writable(vm, epfd, c);
+		}
+	}
+
+	/* Connections still open are dropped along with the heap */
+	close(epfd);
+	close(lfd);
+	unlink(path);
+	futures_drain(vm);
+	for (int j = vm->scope_count - 1; j >= 0; j--)
+		scope_free(vm->scopes[j]);
+	free_built_ins(global);
+	scope_free(global);
+	vm_free(vm);
+	free(vm);
+
+	return EXIT_SUCCESS;
+}
+
+#else
+
+int serve(const char *path, const char *image, char **files, int file_count) {
+	fputs("--serve needs epoll, which this platform doesn't have.\n", stderr);
+	return EXIT_FAILURE;
+}
+
+#endif
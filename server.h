@@ -0,0 +1,31 @@
+#ifndef server_h
+#define server_h
+
+/* notion --serve /path/to/sock [file ...] loads the files (after the
+	image, if there's an --image in front, see image.h) once and then
+	answers requests from any number of clients over a Unix domain socket,
+	so they don't each pay for starting up and loading their libraries.
+
+	A request is a 4 byte length, big endian, followed by that many bytes
+	of Scheme source. Every expression in it is evaluated and the response
+	is a 4 byte length followed by a status byte (0 for ok, 1 for an error)
+	and then whatever the request displayed or wrote, followed by the last
+	result as the REPL would print it, or the error message. A connection
+	can send as many requests as it likes, one after another. (quit) closes
+	the connection.
+
+	Each connection starts with its own copy of the global bindings as they
+	were once the files were loaded, so what one client defines the others
+	don't see. Copying only copies the table, not the values, so it's
+	cheap, but it does mean a hash table made by one of the files is the
+	same hash table for everyone.
+
+	It's one thread with an epoll loop. Clients are served concurrently in
+	that nobody waits on anyone else's I/O, but requests are evaluated one
+	at a time, so a slow one holds up the rest. */
+
+#define SERVER_MAX_REQUEST (16 * 1024 * 1024)
+
+int serve(const char *path, const char *image, char **files, int file_count);
+
+#endif
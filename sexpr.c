@@ -3,13 +3,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "coro.h"
+#include "futures.h"
+#include "hashtable.h"
+#include "interp.h"
+#include "memo.h"
+#include "nstring.h"
+#include "printer.h"
 #include "sexpr.h"
 #include "util.h"
 
 /* Making this a singleton of sorts. A bunch of functions return a null value
 	but they don't need to be unique values stored on the heap and re-created
-	and garbage collected. Re-use is better than recycling! */
-static sexpr *null_expr = NULL;
+	and garbage collected. Re-use is better than recycling!
+
+	It's set up statically rather than on first use so that threads running
+	futures can't race to make it. */
+static sexpr null_expr = { .type = LVAL_NULL };
 
 void print_sexpr_type(sexpr *v) {
 	switch (v->type) {
@@ -17,7 +27,13 @@ void print_sexpr_type(sexpr *v) {
 			printf("number");
 			break;
 		case LVAL_STR:
-			printf("string (%s)", v->str);
+			printf("string (%.*s)", (int)v->len, v->str);
+			break;
+		case LVAL_STRBUILDER:
+			printf("string builder");
+			break;
+		case LVAL_HASH:
+			printf("hash table");
 			break;
 		case LVAL_SYM:
 			printf("symbol (%s)", v->sym);
@@ -37,44 +53,86 @@ void print_sexpr_type(sexpr *v) {
 		case LVAL_BOOL:
 			printf("boolean (%s)", v->bool ? "true" : "false");
 			break;
+		case LVAL_NUMVEC:
+			printf("%s", v->num_type == NUM_TYPE_DEC ? "f64vector" : "s64vector");
+			break;
+		case LVAL_CONST:
+			printf("constant");
+			break;
+		case LVAL_CONT:
+			printf("continuation");
+			break;
+		case LVAL_CORO:
+			printf("%s", v->co->kind == CORO_GENERATOR ? "generator" : "task");
+			break;
+		case LVAL_FUTURE:
+			printf("future");
+			break;
+		case LVAL_CHANNEL:
+			printf("channel");
+			break;
 	}
 }
 
+/* A short description of v for error messages, which the caller frees */
 char* sexpr_desc(sexpr *v) {
-	char buffer[1024];
+	port p;
+	port_open_string(&p);
 
 	switch (v->type) {
 		case LVAL_NUM:
-			if (v->num_type == NUM_TYPE_INT)
-				snprintf(buffer, sizeof buffer, "%ld", v->i_num);
-			else
-				snprintf(buffer, sizeof buffer, "%f", v->d_num);
-			break;
 		case LVAL_STR:
-			snprintf(buffer, sizeof buffer, "\"%s\"", v->str);
+		case LVAL_BOOL:
+			port_print(&p, v, 0);
+			break;
+		case LVAL_STRBUILDER:
+			port_write(&p, "String builder", 14);
+			break;
+		case LVAL_HASH:
+			port_write(&p, "Hash table", 10);
 			break;
 		case LVAL_FUN:
 		case LVAL_SYM:
-			snprintf(buffer, sizeof buffer, "%s", v->sym);
+			port_write(&p, v->sym, strlen(v->sym));
 			break;
 		case LVAL_ERR:
-			snprintf(buffer, sizeof buffer, "Err: %s", v->sym);
+			port_write(&p, "Err: ", 5);
+			port_write(&p, v->sym, strlen(v->sym));
 			break;
 		case LVAL_LIST:
-			snprintf(buffer, sizeof buffer, "List");
+			port_write(&p, "List", 4);
 			break;
 		case LVAL_NULL:
-			snprintf(buffer, sizeof buffer, "Null");
+			port_write(&p, "Null", 4);
 			break;
-		case LVAL_BOOL:
-			snprintf(buffer, sizeof buffer, "%s", v->bool ? "#t" : "#f");
+		case LVAL_NUMVEC: {
+			char buffer[64];
+			int len = snprintf(buffer, sizeof buffer, "%s of length %d",
+				v->num_type == NUM_TYPE_DEC ? "f64vector" : "s64vector", v->count);
+			port_write(&p, buffer, len);
+			break;
+		}
+		case LVAL_CONST:
+			port_write(&p, "Constant", 8);
+			break;
+		case LVAL_CONT:
+			port_write(&p, "Continuation", 12);
+			break;
+		case LVAL_CORO:
+			if (v->co->kind == CORO_GENERATOR)
+				port_write(&p, "Generator", 9);
+			else
+				port_write(&p, "Task", 4);
+			break;
+		case LVAL_FUTURE:
+			port_write(&p, "Future", 6);
+			break;
+		case LVAL_CHANNEL:
+			port_write(&p, "Channel", 7);
 			break;
 	}
 
-	char *msg = NULL;
-	msg = n_strcpy(msg, buffer);
-
-	return msg;
+	return port_cstr(&p);
 }
 
 /* This is mathematically, philosophically terrible, but also so
@@ -105,6 +163,8 @@ sexpr* sexpr_fun_builtin(builtinf fun, char *name) {
 	v->builtin = 1;
 	v->params = NULL;
 	v->body = NULL;
+	v->memo = NULL;
+	v->captured = NULL;
 	v->gen = 0;
 	v->count = 0;
 
@@ -119,6 +179,8 @@ sexpr* sexpr_fun_user(vm_heap* vm, sexpr *params, sexpr *body, char *name) {
 	v->builtin = 0;
 	v->params = params;
 	v->body = body;
+	v->memo = NULL;
+	v->captured = NULL;
 	v->gen = 0;
 	v->count = 0;
 
@@ -128,15 +190,137 @@ sexpr* sexpr_fun_user(vm_heap* vm, sexpr *params, sexpr *body, char *name) {
 }
 
 sexpr* sexpr_str(vm_heap* vm, char *s) {
+	size_t len = s ? strlen(s) : 0;
+
+	return sexpr_str_shared(vm, nstr_new(s, len), len);
+}
+
+/* Wrap a string block we already hold a reference to. The new sexpr takes
+	over that reference. */
+sexpr* sexpr_str_shared(vm_heap* vm, char *data, size_t len) {
 	sexpr *v = malloc(sizeof(sexpr));
 	v->type = LVAL_STR;
 	v->gen = 0;
 	v->count = 0;
+	v->str = data;
+	v->len = len;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+sexpr* sexpr_strbuilder(vm_heap* vm) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_STRBUILDER;
+	v->gen = 0;
+	v->count = 0;
+	v->str = nstr_new(NULL, 0);
+	v->len = 0;
+
+	vm_add(vm, v);
 
-	if (s)
-		v->str = n_strcpy(v->str, s);
+	return v;
+}
+
+/* Numeric vectors keep their elements unboxed in one zeroed block. count
+	is the number of elements and num_type says whether they are doubles or
+	64-bit ints. Gives back NULL if there isn't room for count elements. */
+sexpr* sexpr_numvec(vm_heap* vm, enum sexpr_num_type t, int count) {
+	void *elems = t == NUM_TYPE_DEC ? calloc(count ? count : 1, sizeof(double))
+				: calloc(count ? count : 1, sizeof(int64_t));
+	if (!elems)
+		return NULL;
+
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_NUMVEC;
+	v->num_type = t;
+	v->gen = 0;
+	v->count = count;
+
+	if (t == NUM_TYPE_DEC)
+		v->f64 = elems;
 	else
-		v-> str = NULL;
+		v->s64 = elems;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+sexpr* sexpr_hashtable(vm_heap* vm, htable *t) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_HASH;
+	v->ht = t;
+	v->gen = 0;
+	v->count = 0;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+/* A pre-resolved (quote datum), made by the optimizer. Evaluating it just
+	gives back the datum. */
+sexpr* sexpr_const(vm_heap* vm, sexpr *datum) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_CONST;
+	v->datum = datum;
+	v->gen = 0;
+	v->count = 0;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+/* An escape continuation made by call/cc. It gets called like a function
+	but it isn't one, so builtin is always 0. */
+sexpr* sexpr_cont(vm_heap* vm, struct continuation *k) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_CONT;
+	v->k = k;
+	v->builtin = 0;
+	v->memo = NULL;
+	v->gen = 0;
+	v->count = 0;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+sexpr* sexpr_coro(vm_heap* vm, struct coro *co) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_CORO;
+	v->co = co;
+	v->gen = 0;
+	v->count = 0;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+sexpr* sexpr_future(vm_heap* vm, struct future *fut) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_FUTURE;
+	v->fut = fut;
+	v->gen = 0;
+	v->count = 0;
+
+	vm_add(vm, v);
+
+	return v;
+}
+
+/* The new sexpr takes over a reference to the channel */
+sexpr* sexpr_channel(vm_heap* vm, struct channel *chan) {
+	sexpr *v = malloc(sizeof(sexpr));
+	v->type = LVAL_CHANNEL;
+	v->chan = chan;
+	v->gen = 0;
+	v->count = 0;
 
 	vm_add(vm, v);
 
@@ -156,9 +340,17 @@ sexpr* sexpr_err(vm_heap* vm, char *s) {
 }
 
 sexpr* sexpr_sym(vm_heap* vm, char *s) {
+	return sexpr_sym_n(vm, s, strlen(s));
+}
+
+/* For when the name isn't '\0' terminated, like a token straight out of
+	the source */
+sexpr* sexpr_sym_n(vm_heap* vm, const char *s, size_t len) {
 	sexpr *v = malloc(sizeof(sexpr));
 	v->type = LVAL_SYM;
-	v->sym = n_strcpy(v->sym, s);
+	v->sym = malloc(len + 1);
+	memcpy(v->sym, s, len);
+	v->sym[len] = '\0';
 	v->gen = 0;
 	v->count = 0;
 
@@ -184,6 +376,8 @@ sexpr* sexpr_list(vm_heap* vm) {
 	v->type = LVAL_LIST;
 	v->count = 0;
 	v->children = NULL;
+	v->closure_info = NULL;
+	v->shares = NULL;
 	v->gen = 0;
 
 	vm_add(vm, v);
@@ -192,44 +386,54 @@ sexpr* sexpr_list(vm_heap* vm) {
 }
 
 sexpr* sexpr_null(void) {
-	if (!null_expr) {
-		null_expr = malloc(sizeof(sexpr));
-		null_expr->type = LVAL_NULL;
-		null_expr->sym = NULL;
-		null_expr->err = NULL;
-		null_expr->str = NULL;
-		null_expr->count = 0;
-		null_expr->children = NULL;
-		null_expr->neighbour = NULL;
-		null_expr->params = NULL;
-		null_expr->body = NULL;
-		null_expr->fun = NULL;
-		null_expr->gen = 0;
-		null_expr->count = 0;
-	}
-
-	return null_expr;
+	return &null_expr;
 }
 
 void sexpr_free(sexpr *v) {
 	switch (v->type) {
 		case LVAL_LIST:
-			free(v->children);
+			if (!v->shares)
+				free(v->children);
 			break;
 		case LVAL_NUM:
 		case LVAL_BOOL:
 		case LVAL_NULL:
+		case LVAL_CONST:
 			break;
 		case LVAL_ERR:
 			free(v->err);
 			break;
 		case LVAL_FUN:
+			if (v->memo)
+				memo_free(v->memo);
+			/* fall through */
 		case LVAL_SYM:
 			free(v->sym);
 			break;
 		case LVAL_STR:
-			if (v->str)
-				free(v->str);
+		case LVAL_STRBUILDER:
+			nstr_unref(v->str);
+			break;
+		case LVAL_NUMVEC:
+			if (v->num_type == NUM_TYPE_DEC)
+				free(v->f64);
+			else
+				free(v->s64);
+			break;
+		case LVAL_HASH:
+			ht_free(v->ht);
+			break;
+		case LVAL_CONT:
+			free(v->k);
+			break;
+		case LVAL_CORO:
+			coro_free(v->co);
+			break;
+		case LVAL_FUTURE:
+			future_release(v->fut);
+			break;
+		case LVAL_CHANNEL:
+			channel_release(v->chan);
 			break;
 	}
 
@@ -246,19 +450,66 @@ sexpr* sexpr_copy_atom(vm_heap* vm, sexpr* src) {
 	if (src->type == LVAL_BOOL)
 		return sexpr_bool(vm, src->bool);
 
-	if (src->type == LVAL_NULL)
+	/* A continuation is only good for escaping to the one call/cc that
+		made it, so there's nothing to copy */
+	if (src->type == LVAL_NULL || src->type == LVAL_CONT)
+		return src;
+
+	/* Nor is there any sensible way to copy a coroutine part way through,
+		or a computation that may be happening on another thread */
+	if (src->type == LVAL_CORO || src->type == LVAL_FUTURE)
+		return src;
+
+	/* Channels are shared by design */
+	if (src->type == LVAL_CHANNEL)
 		return src;
 
 	if (src->type == LVAL_FUN) {
+		/* Built-ins aren't on the heap and never change, so they're shared */
 		if (src->builtin)
-			return sexpr_fun_builtin(src->fun, src->sym);
-		else
-			return sexpr_fun_user(vm, sexpr_copy(vm, src->params),
-						sexpr_copy(vm, src->body), src->sym);
+			return src;
+
+		/* Parameters and bodies are never modified so copies share them.
+			A copy of a memoized function gets its own (empty) cache though. */
+		sexpr *f = sexpr_fun_user(vm, src->params, src->body, src->sym);
+		f->captured = src->captured;
+		if (src->memo)
+			f->memo = memo_new(src->memo->limit);
+
+		return f;
 	}
 
+	/* Strings are immutable so a copy can share the original's bytes. Two
+		builders can share them too since appending never touches bytes that
+		are already inside someone's length. */
 	if (src->type == LVAL_STR)
-		return sexpr_str(vm, src->str);
+		return sexpr_str_shared(vm, nstr_ref(src->str), src->len);
+
+	if (src->type == LVAL_STRBUILDER) {
+		sexpr *b = sexpr_strbuilder(vm);
+		nstr_unref(b->str);
+		b->str = nstr_ref(src->str);
+		b->len = src->len;
+		return b;
+	}
+
+	if (src->type == LVAL_HASH)
+		return sexpr_hashtable(vm, ht_copy(src->ht));
+
+	if (src->type == LVAL_NUMVEC) {
+		sexpr *v = sexpr_numvec(vm, src->num_type, src->count);
+		if (!v)
+			return sexpr_err(vm, "Out of memory for the vector.");
+		if (src->num_type == NUM_TYPE_DEC)
+			memcpy(v->f64, src->f64, src->count * sizeof(double));
+		else
+			memcpy(v->s64, src->s64, src->count * sizeof(int64_t));
+		return v;
+	}
+
+	/* Quoted data is never modified so copies can share it */
+	if (src->type == LVAL_CONST)
+		return sexpr_const(vm, src->datum);
 
 	return sexpr_err(vm, "Can only copy atoms.");
 }
@@ -287,6 +538,14 @@ sexpr* sexpr_copy(vm_heap* vm, sexpr* src) {
 }
 
 void sexpr_append(sexpr *v, sexpr *next) {
+	/* A borrowed array has to be copied before it can grow */
+	if (v->shares) {
+		sexpr **own = malloc(sizeof(sexpr*) * (v->count + 1));
+		memcpy(own, v->children, sizeof(sexpr*) * v->count);
+		v->children = own;
+		v->shares = NULL;
+	}
+
 	v->count++;
 	v->children = realloc(v->children, sizeof(sexpr*) * v->count);
 	v->children[v->count - 1] = next;
@@ -296,48 +555,14 @@ void print_padding(int depth) {
 	for (int j = 0; j < depth * 4; j++) putchar(' ');
 }
 
-void sexpr_pprint(sexpr *v) {
-	switch (v->type) {
-		case LVAL_ERR:
-			printf("Error: %s\n", v->err);
-			break;
-		case LVAL_LIST:
-			putchar('(');
+/* Print v to f the way the REPL shows it. See printer.c. */
+void sexpr_fprint(FILE *f, sexpr *v) {
+	port p;
+	port_open_file(&p, f);
+	port_print(&p, v, 0);
+	port_close(&p);
+}
 
-			for (int j = 0; j < v->count; j++) {
-				sexpr_pprint(v->children[j]);
-				if (j < v->count - 1)
-					putchar(' ');
-			}
-			putchar(')');
-			break;
-		case LVAL_SYM:
-			printf("%s", v->sym);
-			break;
-		case LVAL_STR:
-			printf("\"%s\"", v->str);
-			break;
-		case LVAL_NUM:
-			if (v->num_type == NUM_TYPE_INT)
-				printf("%li", v->i_num);
-			else
-				printf("%f", v->d_num);
-			break;
-		case LVAL_BOOL:
-			printf("%s", v->bool ? "#t" : "#f");
-			break;
-		case LVAL_FUN:
-			if (v->builtin)
-				printf("Built-in function");
-			else {
-				printf("User-defined function");
-				putchar(' ');
-				sexpr_pprint(v->params);
-				putchar(' ');
-				sexpr_pprint(v->body);
-			}
-		case LVAL_NULL:
-			/* Don't need to do anything */
-			break;
-	}
+void sexpr_pprint(sexpr *v) {
+	sexpr_fprint(stdout, v);
 }
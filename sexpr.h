@@ -1,11 +1,16 @@
 #ifndef sexpr_h
 #define sexpr_h
 
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+
 #include "fwd.h"
 #include "environment.h"
 
 enum sexpr_type { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_LIST, LVAL_NULL,
-	LVAL_BOOL, LVAL_FUN, LVAL_STR };
+	LVAL_BOOL, LVAL_FUN, LVAL_STR, LVAL_NUMVEC, LVAL_STRBUILDER,
+	LVAL_HASH, LVAL_CONST, LVAL_CONT, LVAL_CORO, LVAL_FUTURE, LVAL_CHANNEL };
 enum sexpr_num_type { NUM_TYPE_INT, NUM_TYPE_DEC };
 
 typedef sexpr*(*builtinf)(vm_heap *, scope*, sexpr**, int, char*);
@@ -13,7 +18,6 @@ typedef sexpr*(*builtinf)(vm_heap *, scope*, sexpr**, int, char*);
 struct sexpr {
 	enum sexpr_type type;
 	enum sexpr_num_type num_type;
-	int global_scope; /* Is the value stashed in the global scope or not */
 
 	union {
 		long i_num;
@@ -21,13 +25,29 @@ struct sexpr {
 		int bool;
 		char *sym;
 		char *err;
-		char *str;
+		char *str; /* See nstring.h, not necessarily '\0' terminated */
+		double *f64; /* LVAL_NUMVEC with num_type NUM_TYPE_DEC */
+		int64_t *s64; /* LVAL_NUMVEC with num_type NUM_TYPE_INT */
+		struct htable *ht;
+		struct sexpr *datum; /* LVAL_CONST, see optimize.h */
+		struct continuation *k; /* LVAL_CONT, see builtin_callcc() */
+		struct coro *co; /* LVAL_CORO, see coro.h */
+		struct future *fut; /* LVAL_FUTURE, see futures.h */
+		struct channel *chan; /* LVAL_CHANNEL, see interp.h */
 	};
 
 	int builtin;
 	builtinf fun;
 	sexpr *params;
 	sexpr *body;
+	struct memo_cache *memo; /* Result cache, if the function is memoized */
+	sexpr *captured; /* Closed over variables, see evaluator.c */
+	/* Cached on a function body, see analyse_body(). Atomic because a
+		future may fill it in while another thread is reading it. */
+	_Atomic(sexpr*) closure_info;
+	sexpr *shares; /* A list made by cdr borrows its children from this one */
+
+	size_t len; /* Length in bytes of a string or string builder */
 
 	int count;
 	struct sexpr **children;
@@ -39,6 +59,7 @@ sexpr* sexpr_err(vm_heap*, char*);
 sexpr* sexpr_num(vm_heap*, enum sexpr_num_type, double);
 sexpr* sexpr_null(void);
 sexpr* sexpr_sym(vm_heap*, char*);
+sexpr* sexpr_sym_n(vm_heap*, const char*, size_t);
 sexpr* sexpr_list(vm_heap*);
 sexpr* sexpr_bool(vm_heap*, int);
 sexpr* sexpr_fun_builtin(builtinf, char*);
@@ -46,6 +67,15 @@ sexpr* sexpr_fun_user(vm_heap*, sexpr*, sexpr*, char*);
 sexpr* sexpr_copy(vm_heap*, sexpr*);
 sexpr* sexpr_quote(vm_heap*);
 sexpr* sexpr_str(vm_heap*, char *);
+sexpr* sexpr_str_shared(vm_heap*, char *, size_t);
+sexpr* sexpr_strbuilder(vm_heap*);
+sexpr* sexpr_hashtable(vm_heap*, struct htable*);
+sexpr* sexpr_numvec(vm_heap*, enum sexpr_num_type, int);
+sexpr* sexpr_const(vm_heap*, sexpr*);
+sexpr* sexpr_cont(vm_heap*, struct continuation*);
+sexpr* sexpr_coro(vm_heap*, struct coro*);
+sexpr* sexpr_future(vm_heap*, struct future*);
+sexpr* sexpr_channel(vm_heap*, struct channel*);
 
 void sexpr_free(sexpr*);
 void sexpr_append(sexpr*, sexpr*);
@@ -53,10 +83,15 @@ void sexpr_append(sexpr*, sexpr*);
 char* sexpr_desc(sexpr*);
 void print_sexpr_type(sexpr*);
 void sexpr_pprint(sexpr*);
+void sexpr_fprint(FILE*, sexpr*);
 
 #define IS_ATOM(a) (a->type == LVAL_NUM || a->type == LVAL_SYM \
 	|| a->type == LVAL_NULL || a->type == LVAL_BOOL \
-	|| a->type == LVAL_FUN || a->type == LVAL_STR) ? 1 : 0
+	|| a->type == LVAL_FUN || a->type == LVAL_STR \
+	|| a->type == LVAL_NUMVEC || a->type == LVAL_STRBUILDER \
+	|| a->type == LVAL_HASH || a->type == LVAL_CONST \
+	|| a->type == LVAL_CONT || a->type == LVAL_CORO \
+	|| a->type == LVAL_FUTURE || a->type == LVAL_CHANNEL) ? 1 : 0
 
 #define NUM_CONVERT(x) x->num_type == NUM_TYPE_INT ? x->i_num : x->d_num
 
@@ -0,0 +1,304 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#include "stack.h"
+#include "environment.h"
+#include "evaluator.h"
+#include "sexpr.h"
+
+/* How much of the thread's own stack eval2() is allowed to use before
+	moving to segments. Deliberately modest so it's safe on any thread. */
+#define NATIVE_BUDGET (512 * 1024)
+#define SEGMENT_SIZE (1024 * 1024)
+/* Room left at the end of a segment for whatever the last eval2() on it
+	calls that isn't eval2() (printf, the builtins' own frames, etc) */
+#define SEGMENT_MARGIN (128 * 1024)
+#define MAX_SPARE_SEGMENTS 4
+
+_Thread_local uintptr_t stack_limit = 0;
+
+static _Thread_local unsigned long segs_in_use = 0;
+static _Thread_local unsigned long segs_peak = 0;
+static _Thread_local unsigned long seg_switches = 0;
+
+#ifndef _WIN32
+
+struct stack_seg {
+	char *mem; /* Bottom of the mapping, the lowest page is a guard page */
+	uintptr_t saved_limit; /* stack_limit of the segment below this one */
+	ucontext_t ctx;
+	ucontext_t caller;
+	char *caller_sp; /* How far down the segment below had got */
+	stack_seg *below;
+
+	vm_heap *vm;
+	scope *sc;
+	sexpr *expr;
+	sexpr *result;
+};
+
+static _Thread_local stack_seg *current = NULL;
+/* A few released segments are kept around, since a recursion that keeps
+	crossing the same boundary would otherwise map and unmap one on every
+	call */
+static _Thread_local stack_seg *spares[MAX_SPARE_SEGMENTS];
+static _Thread_local int spare_count = 0;
+
+void stack_init(void) {
+	char here;
+	stack_limit = (uintptr_t)&here - NATIVE_BUDGET;
+}
+
+static stack_seg* seg_alloc(void) {
+	if (spare_count > 0)
+		return spares[--spare_count];
+
+	stack_seg *s = malloc(sizeof(stack_seg));
+	s->mem = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s->mem == MAP_FAILED) {
+		free(s);
+		return NULL;
+	}
+
+	/* Overrunning the segment should crash rather than quietly scribble
+		over whatever is mapped below it */
+	mprotect(s->mem, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+	return s;
+}
+
+static void seg_release(stack_seg *s) {
+	if (spare_count < MAX_SPARE_SEGMENTS) {
+		spares[spare_count++] = s;
+		return;
+	}
+
+	munmap(s->mem, SEGMENT_SIZE);
+	free(s);
+}
+
+static void seg_main(void) {
+	stack_seg *s = current;
+	s->result = eval2(s->vm, s->sc, s->expr);
+	/* Returning resumes s->caller via uc_link */
+}
+
+sexpr* eval_on_new_segment(vm_heap *vm, scope *sc, sexpr *v) {
+	stack_seg *s = seg_alloc();
+	if (!s)
+		return sexpr_err(vm, "Out of memory for the evaluation stack.");
+
+	s->vm = vm;
+	s->sc = sc;
+	s->expr = v;
+	s->result = NULL;
+	s->below = current;
+	s->saved_limit = stack_limit;
+
+	getcontext(&s->ctx);
+	s->ctx.uc_stack.ss_sp = s->mem;
+	s->ctx.uc_stack.ss_size = SEGMENT_SIZE;
+	s->ctx.uc_link = &s->caller;
+	makecontext(&s->ctx, seg_main, 0);
+
+	current = s;
+	stack_limit = (uintptr_t)s->mem + SEGMENT_MARGIN;
+	if (++segs_in_use > segs_peak)
+		segs_peak = segs_in_use;
+	seg_switches++;
+
+	char here;
+	s->caller_sp = &here;
+	swapcontext(&s->caller, &s->ctx);
+
+	sexpr *result = s->result;
+	current = s->below;
+	stack_limit = s->saved_limit;
+	segs_in_use--;
+	seg_release(s);
+
+	return result;
+}
+
+stack_seg* stack_current(void) {
+	return current;
+}
+
+/* Called after a longjmp has taken us back down to a frame on segment s.
+	Any segments above it were abandoned mid-evaluation and can go. */
+void stack_unwind_to(stack_seg *s) {
+	while (current != s) {
+		stack_seg *dead = current;
+		current = dead->below;
+		stack_limit = dead->saved_limit;
+		segs_in_use--;
+		seg_release(dead);
+	}
+}
+
+/* A coroutine is an evaluation with a segment of its own to start on.
+	It can overflow onto further segments just like anything else. */
+struct stack_ctx {
+	ucontext_t uc;
+	stack_seg *base; /* NULL for a thread's own stack */
+	stack_seg *seg; /* Segment it's currently on, while switched out */
+	uintptr_t limit;
+	char *sp; /* Roughly where its stack pointer was when switched out */
+	void (*entry)(void*);
+	void *arg;
+};
+
+static _Thread_local stack_ctx *starting = NULL;
+static _Thread_local stack_ctx thread_ctx;
+
+static void ctx_main(void) {
+	stack_ctx *c = starting;
+	c->entry(c->arg);
+
+	/* entry() is supposed to switch away for good before it gets here */
+	fputs("A coroutine returned without switching away.\n", stderr);
+	abort();
+}
+
+stack_ctx* stack_ctx_new(void (*entry)(void*), void *arg) {
+	stack_seg *base = seg_alloc();
+	if (!base)
+		return NULL;
+
+	stack_ctx *c = malloc(sizeof(stack_ctx));
+	c->base = base;
+	c->seg = base;
+	c->limit = (uintptr_t)base->mem + SEGMENT_MARGIN;
+	c->sp = base->mem + SEGMENT_SIZE;
+	c->entry = entry;
+	c->arg = arg;
+	base->below = NULL;
+
+	getcontext(&c->uc);
+	c->uc.uc_stack.ss_sp = base->mem;
+	c->uc.uc_stack.ss_size = SEGMENT_SIZE;
+	c->uc.uc_link = NULL;
+	makecontext(&c->uc, ctx_main, 0);
+
+	return c;
+}
+
+/* Frees a coroutine that won't be switched to again, along with any
+	segments it had overflowed onto */
+void stack_ctx_free(stack_ctx *c) {
+	stack_seg *s = c->seg;
+	while (s != c->base) {
+		stack_seg *below = s->below;
+		segs_in_use--;
+		seg_release(s);
+		s = below;
+	}
+	seg_release(c->base);
+
+	free(c);
+}
+
+/* The context for whatever is running on the thread's own stack */
+stack_ctx* stack_thread_ctx(void) {
+	return &thread_ctx;
+}
+
+/* Switch from the running context (which gets saved in from) to to */
+void stack_ctx_switch(stack_ctx *from, stack_ctx *to) {
+	char here;
+	from->sp = &here;
+	from->seg = current;
+	from->limit = stack_limit;
+
+	current = to->seg;
+	stack_limit = to->limit;
+	starting = to;
+
+	swapcontext(&from->uc, &to->uc);
+}
+
+static void scan_words(char *lo, char *hi, void (*visit)(void*, uintptr_t), void *data) {
+	uintptr_t *w = (uintptr_t*)(((uintptr_t)lo + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1));
+	for ( ; (char*)(w + 1) <= hi; w++)
+		visit(data, *w);
+}
+
+/* Hand every word a switched-out coroutine might be keeping a value in to
+	visit(): the live part of each of its segments plus the registers saved
+	when it was switched out. The GC uses this to find values that are only
+	referred to from the middle of a suspended evaluation. */
+void stack_ctx_scan(stack_ctx *c, void (*visit)(void*, uintptr_t), void *data) {
+	scan_words((char*)&c->uc, (char*)(&c->uc + 1), visit, data);
+
+	char *sp = c->sp;
+	for (stack_seg *s = c->seg; s; s = s == c->base ? NULL : s->below) {
+		scan_words(sp, s->mem + SEGMENT_SIZE, visit, data);
+
+		if (s != c->base) {
+			scan_words((char*)&s->caller, (char*)(&s->caller + 1), visit, data);
+			sp = s->caller_sp;
+		}
+	}
+}
+
+#else
+
+void stack_init(void) {
+}
+
+sexpr* eval_on_new_segment(vm_heap *vm, scope *sc, sexpr *v) {
+	return eval2(vm, sc, v);
+}
+
+stack_seg* stack_current(void) {
+	return NULL;
+}
+
+void stack_unwind_to(stack_seg *s) {
+}
+
+stack_ctx* stack_ctx_new(void (*entry)(void*), void *arg) {
+	return NULL;
+}
+
+void stack_ctx_free(stack_ctx *c) {
+}
+
+stack_ctx* stack_thread_ctx(void) {
+	return NULL;
+}
+
+void stack_ctx_switch(stack_ctx *from, stack_ctx *to) {
+}
+
+void stack_ctx_scan(stack_ctx *c, void (*visit)(void*, uintptr_t), void *data) {
+}
+
+#endif
+
+/* (stack-stats) gives back (segments-in-use peak-segments switches) */
+sexpr* builtin_stack_stats(vm_heap *vm, scope *env, sexpr **nodes, int count, char *op) {
+	ASSERT_PARAM_EQ(count, 1, "stack-stats takes no arguments.");
+
+	sexpr *stats = sexpr_list(vm);
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, segs_in_use));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, segs_peak));
+	sexpr_append(stats, sexpr_num(vm, NUM_TYPE_INT, seg_switches));
+
+	return stats;
+}
+
+void load_stack_built_ins(scope *sc) {
+	scope_insert_var(sc, "stack-stats", sexpr_fun_builtin(&builtin_stack_stats, "stack-stats"));
+}
@@ -0,0 +1,48 @@
+#ifndef stack_h
+#define stack_h
+
+#include <stdint.h>
+
+#include "fwd.h"
+
+/* eval2() recurses in C for every nested call, so left alone the deepest a
+	Scheme program can recurse is whatever fits on the C stack (a few
+	hundred thousand calls at best, then a segfault). Instead, when the
+	stack we're running on gets close to its end, eval2() carries on on a
+	fresh segment allocated with mmap and comes back once that evaluation
+	is done. Recursion depth is then limited by memory, not by ulimit -s.
+
+	Switching segments uses ucontext, which Windows doesn't have, so there
+	we just stay on the native stack. */
+
+struct stack_seg;
+typedef struct stack_seg stack_seg;
+
+/* Below this address the current segment is running low. Zero (the
+	default for a thread that never called stack_init()) means never. */
+extern _Thread_local uintptr_t stack_limit;
+
+static inline int stack_low(void) {
+	char here;
+	return (uintptr_t)&here < stack_limit;
+}
+
+void stack_init(void);
+sexpr* eval_on_new_segment(vm_heap*, scope*, sexpr*);
+stack_seg* stack_current(void);
+void stack_unwind_to(stack_seg*);
+
+/* Separate lines of execution, each starting on a segment of its own, that
+	we can switch between. See coro.c for what they're used for. Not
+	available on Windows, where stack_ctx_new() always returns NULL. */
+struct stack_ctx;
+typedef struct stack_ctx stack_ctx;
+
+stack_ctx* stack_ctx_new(void (*)(void*), void*);
+void stack_ctx_free(stack_ctx*);
+stack_ctx* stack_thread_ctx(void);
+void stack_ctx_switch(stack_ctx*, stack_ctx*);
+void stack_ctx_scan(stack_ctx*, void (*)(void*, uintptr_t), void*);
+void load_stack_built_ins(scope*);
+
+#endif
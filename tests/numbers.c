@@ -0,0 +1,310 @@
+/* Checks that numbers are read and printed (numconv.h) exactly right,
+	using the C library as the reference. From the top of the repo:
+
+	  make test-numbers
+
+	Reading: whatever strtol() would take whole as a long, num_parse()
+	has to give back as that long, and everything else has to come back as
+	the same double as strtod() gives, bit for bit. That's tried on hard
+	cases (exact halfway points, subnormals, more than 19 digits, things
+	that overflow or underflow, -0) and on lots of made up ones.
+
+	Printing: what num_format_double() writes has to read back as the same
+	double, and there mustn't be anything with fewer significant digits
+	that does. It says what went wrong, if anything did, and exits with a
+	failure. */
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../numconv.h"
+
+#define RANDOM_COUNT 300000
+#define SHOW 10
+
+static int failures = 0;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static uint64_t bits_of(double d) {
+	uint64_t b;
+	memcpy(&b, &d, sizeof b);
+
+	return b;
+}
+
+static double from_bits(uint64_t b) {
+	double d;
+	memcpy(&d, &b, sizeof d);
+
+	return d;
+}
+
+static double random_double(void) {
+	for (;;) {
+		double d = from_bits(rng());
+		if (isfinite(d))
+			return d;
+	}
+}
+
+static void fail(const char *fmt, const char *s, double want, double got) {
+	if (failures++ < SHOW) {
+		printf("  ");
+		printf(fmt, s);
+		printf(" (wanted %a, got %a)\n", want, got);
+	}
+}
+
+static void check_parse(const char *s) {
+	int is_int;
+	long i;
+	double d;
+
+	if (!num_parse(s, strlen(s), &is_int, &i, &d)) {
+		fail("%s wasn't read as a number", s, 0, 0);
+		return;
+	}
+
+	char *end;
+	errno = 0;
+	long want_i = strtol(s, &end, 10);
+	if (*end == '\0' && errno == 0) {
+		if (!is_int || i != want_i)
+			fail("%s should have been read as an integer", s, want_i, is_int ? i : d);
+		return;
+	}
+
+	double want = strtod(s, &end);
+	if (is_int)
+		fail("%s was read as an integer", s, want, i);
+	else if (bits_of(d) != bits_of(want))
+		fail("%s wasn't read the same as strtod", s, want, d);
+}
+
+static const char *hard[] = {
+	/* Signs and zeros */
+	"0", "-0", "+0", "0.0", "-0.0", "+0.0", "-0.", ".0", "-.0", "0e0", "-0e0", "-0e-400",
+	"0.000000000000000000000000000000000000000000000000000000000000000",
+
+	/* Integers on the edge of a long, and past it */
+	"9223372036854775807", "-9223372036854775808", "9223372036854775808",
+	"-9223372036854775809", "18446744073709551615", "18446744073709551616",
+	"99999999999999999999", "-99999999999999999999", "000000000000000000000042",
+	"123456789012345678901234567890", "-123456789012345678901234567890",
+
+	/* Overflow and underflow */
+	"1e400", "-1e400", "1e-400", "-1e-400", "1e308", "1.7976931348623157e308",
+	"1.7976931348623158e308", "1.7976931348623159e308", "1.797693134862315807e308",
+	"179769313486231580793728971405303415079934132710037826936173778980444968292764750946"
+	"649017977587207096330286416692887910946555547851940402630657488671505820681908902000"
+	"708383676273854845817711531764475730270069855571366959622842914819860834936475292719"
+	"074168444365510704342711559699508093042880177904174497791.9999999999",
+	"1e99999999999999999999", "1e-99999999999999999999", "0e99999999999999999999",
+
+	/* Subnormals, and where they start and stop */
+	"5e-324", "4.9406564584124654e-324", "2.4703282292062327e-324",
+	"2.4703282292062328e-324", "2.4703282292062327208828439643411068618252990130716238221279"
+	"284125033775363510437593264991818081799618989828234772285886546332835517796989819938739"
+	"800539093906315035659515570226392290858392449105184435931802849936536152500319370457678"
+	"249219365623669863658480757001585769269903706311928279558551332927834338409351978015531"
+	"246597263579574622766465272827220056374006485499977096599470454020828166226237857393450"
+	"736339007967761930577506740176324673600968951340535537458516661134223766678604162159680"
+	"461914467291840300530057530849048765391711386591646239524912623653881879636239373280423"
+	"891018672348497668235089863388587925628302755995657524455507255189313690836254779186948"
+	"6676174982e-324", "2.2250738585072011e-308", "2.2250738585072012e-308",
+	"2.2250738585072014e-308", "2.225073858507201136057409796709131975934819546351645648e-308",
+	"4.9e-324", "3e-324", "1e-323", "1.5e-323", "7.4109846876186982e-324",
+
+	/* Exactly halfway between two doubles, so they round to even */
+	"9007199254740993", "9007199254740995", "9007199254740993.0", "9.007199254740993e15",
+	"18014398509481986", "18014398509481990", "1.00000000000000011102230246251565404236316680908203125",
+	"1.00000000000000011102230246251565404236316680908203124",
+	"1.00000000000000011102230246251565404236316680908203126",
+	"0.500000000000000027755575615628913510590791702270507812500",
+	"9223372036854775808.5", "1.0000000000000002220446049250313080847263336181640625",
+
+	/* More than 19 significant digits */
+	"3.14159265358979323846264338327950288419716939937510",
+	"0.1000000000000000055511151231257827021181583404541015625",
+	"0.1000000000000000055511151231257827021181583404541015624",
+	"0.1000000000000000055511151231257827021181583404541015626",
+	"1234567890123456789012345678901234567890e-50", "12345678901234567890.1234567890",
+	"0.00000000000000000000000000000000000000000000123456789012345678901234567890",
+
+	/* Ones that give the fast paths trouble */
+	"1e23", "8.589973e9", "4.35679e-11", "9.2e-323", "1.448997445238699", "7.2057594037927933e16",
+	"5.9604644775390625e-8", "2.9802322387695312e-8", "2.9802322387695313e-8",
+	"1e22", "1e-22", "9007199254740992e22", "9007199254740993e22", "2.2250738585072013e-308",
+	"4.4501477170144023e-308", "6.9294956446009195e15", "3.0540412e5", "1.1920928955078125e-07",
+
+	/* Just syntax */
+	".5", "5.", "+.5", "-5.", "1E5", "1e+5", "1e-5", "1.5E-005", "0001.2500", "12e0",
+};
+
+/* Doubles that are integers of up to 19 digits, and the points halfway
+	between them and their neighbours, which are integers too. These go
+	through Clinger's path and Eisel-Lemire rather than strtod. */
+static void check_halfway(double d) {
+	char buf[64];
+	double next = nextafter(d, INFINITY);
+	uint64_t a = (uint64_t)d, b = (uint64_t)next;
+
+	for (int k = -1; k <= 1; k++) {
+		snprintf(buf, sizeof buf, "%llu", (unsigned long long)(a + (b - a) / 2 + k));
+		check_parse(buf);
+		snprintf(buf, sizeof buf, "-%llu", (unsigned long long)(a + (b - a) / 2 + k));
+		check_parse(buf);
+		snprintf(buf, sizeof buf, "%llu.0e-3", (unsigned long long)(a + (b - a) / 2 + k));
+		check_parse(buf);
+	}
+}
+
+/* Random digits with a point and an exponent somewhere, of up to 30
+	significant digits */
+static void random_decimal(char *buf) {
+	char *p = buf;
+	if (rng() % 2)
+		*p++ = '-';
+
+	int digits = 1 + rng() % 30;
+	int point = rng() % (digits + 1);
+	for (int j = 0; j < digits; j++) {
+		if (j == point)
+			*p++ = '.';
+		*p++ = '0' + rng() % 10;
+	}
+
+	if (rng() % 4)
+		sprintf(p, "e%d", (int)(rng() % 700) - 350);
+	else
+		*p = '\0';
+}
+
+/* Significant digits in what num_format_double() wrote */
+static int sig_digits(const char *s) {
+	int first = -1, last = -1, n = 0;
+
+	for (; *s && *s != 'e'; s++) {
+		if (*s < '0' || *s > '9')
+			continue;
+		if (*s != '0') {
+			if (first < 0)
+				first = n;
+			last = n;
+		}
+		n++;
+	}
+
+	return first < 0 ? 0 : last - first + 1;
+}
+
+static void check_format(double d) {
+	char out[NUM_BUF_SIZE];
+	num_format_double(out, d);
+
+	double back = strtod(out, NULL);
+	if (bits_of(back) != bits_of(d)) {
+		fail("%s doesn't read back", out, d, back);
+		return;
+	}
+
+	/* The nearest decimals with one digit fewer, above and below d, mustn't
+		read back as d */
+	int k = sig_digits(out);
+	if (k < 2)
+		return;
+
+	char shorter[64];
+	snprintf(shorter, sizeof shorter, "%.*e", k - 2, fabs(d));
+	char *e = strchr(shorter, 'e');
+	int exp10 = atoi(e + 1) - (k - 2);
+	*e = '\0';
+
+	uint64_t m = 0;
+	for (char *p = shorter; *p; p++) {
+		if (*p != '.')
+			m = m * 10 + (*p - '0');
+	}
+
+	for (int j = -1; j <= 1; j++) {
+		char try[64];
+		snprintf(try, sizeof try, "%s%llue%d", d < 0 ? "-" : "",
+			(unsigned long long)(m + j), exp10);
+		if (bits_of(strtod(try, NULL)) == bits_of(d)) {
+			if (failures++ < SHOW)
+				printf("  %s isn't the shortest, %s reads back too\n", out, try);
+			break;
+		}
+	}
+}
+
+int main(void) {
+	char buf[128];
+
+	for (size_t j = 0; j < sizeof hard / sizeof hard[0]; j++)
+		check_parse(hard[j]);
+
+	for (int j = 0; j < RANDOM_COUNT; j++) {
+		double d = random_double();
+		snprintf(buf, sizeof buf, "%.17g", d);
+		check_parse(buf);
+		snprintf(buf, sizeof buf, "%.*e", (int)(rng() % 20), d);
+		check_parse(buf);
+
+		random_decimal(buf);
+		check_parse(buf);
+
+		/* 2^53 up to 2^63, where neighbouring doubles are whole numbers
+			apart */
+		check_halfway(ldexp(1 + (rng() >> 12) / 0x1p52, 53 + rng() % 10));
+	}
+
+	int parse_failures = failures;
+	printf("reading: %s\n", parse_failures ? "FAILED" : "ok");
+
+	static const double special[] = { 0.0, -0.0, 1.0, 0.1, 0.2, 0.3, 1.0 / 3, 2.0 / 3, 1e-6,
+		9.999999999999999e-7, 1e21, 9.999999999999999e20, 1e22, 1e23, 5e-324, 1e-323,
+		2.2250738585072009e-308, DBL_MIN, DBL_MAX, DBL_EPSILON, 9007199254740992.0,
+		9007199254740994.0, 123456789012345680000.0, 1.7976931348623155e308 };
+	for (size_t j = 0; j < sizeof special / sizeof special[0]; j++) {
+		check_format(special[j]);
+		check_format(-special[j]);
+	}
+
+	/* Powers of two have a gap below them half the size of the one above */
+	for (int e = -1074; e <= 1023; e++) {
+		check_format(ldexp(1, e));
+		check_format(nextafter(ldexp(1, e), 0));
+	}
+
+	for (uint64_t b = 1; b < 1000; b++) {
+		check_format(from_bits(b));
+		check_format(from_bits(0x0010000000000000ULL - b));
+	}
+
+	for (int j = 0; j < RANDOM_COUNT; j++) {
+		check_format(random_double());
+		check_format((double)(rng() % 10000000) / 1000);
+		check_format(from_bits(rng() >> 12));
+	}
+
+	printf("printing: %s\n", failures > parse_failures ? "FAILED" : "ok");
+	if (failures)
+		printf("%d failed\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/* Checks that what the parser reads is what the printer writes back,
+	going through the sexprs the interpreter actually uses rather than
+	numconv.h on its own (tests/numbers.c does that). From the top of the
+	repo:
+
+	  make test-reading
+
+	Integers have to come through exactly, all the way to the edges of a
+	long, which they don't if they pass through a double anywhere on the
+	way. It says what went wrong, if anything did, and exits with a
+	failure. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../environment.h"
+#include "../parser.h"
+#include "../printer.h"
+#include "../sexpr.h"
+#include "../tokenizer.h"
+
+static int failures = 0;
+
+/* Each text and what printing it should give back */
+static const char *cases[][2] = {
+	{ "0", "0" },
+	{ "-0", "0" },
+	{ "42", "42" },
+	{ "9007199254740992", "9007199254740992" },
+	{ "9007199254740993", "9007199254740993" },
+	{ "-9007199254740993", "-9007199254740993" },
+	{ "123456789012345678", "123456789012345678" },
+	{ "9223372036854775806", "9223372036854775806" },
+	{ "9223372036854775807", "9223372036854775807" },
+	{ "-9223372036854775807", "-9223372036854775807" },
+	{ "-9223372036854775808", "-9223372036854775808" },
+	{ "'(9007199254740993 -9223372036854775808)", "(quote (9007199254740993 -9223372036854775808))" },
+	{ "0.1", "0.1" },
+	{ "1e23", "1e23" },
+	{ "-0.0", "-0.0" },
+};
+
+static void check(vm_heap *vm, const char *text, const char *want) {
+	tokenizer *tk = tokenizer_new();
+	tokenizer_feed_buffer(tk, text, strlen(text));
+	parser *p = parser_new(tk);
+
+	sexpr *v;
+	port *out = port_new_string();
+	if (parser_next(vm, p, &v) == PARSE_DATUM)
+		port_print(out, v, 0);
+	else
+		port_write(out, "<nothing>", 9);
+	char *got = port_cstr(out);
+
+	if (strcmp(got, want) != 0 && failures++ < 10)
+		printf("  %s printed as %s, wanted %s\n", text, got, want);
+
+	free(got);
+	port_free(out);
+	parser_free(p);
+	tokenizer_free(tk);
+}
+
+int main(void) {
+	vm_heap *vm = vm_new();
+
+	for (size_t j = 0; j < sizeof cases / sizeof cases[0]; j++)
+		check(vm, cases[j][0], cases[j][1]);
+
+	vm_free(vm);
+	free(vm);
+
+	printf("reading: %s\n", failures ? "FAILED" : "ok");
+	if (failures)
+		printf("%d failed\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
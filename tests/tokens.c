@@ -0,0 +1,218 @@
+/* Checks that the tokenizer gives back the same tokens however its input
+	arrives: all at once, read from a pipe a line at a time, or fed to it
+	in random pieces of 1 to 40 bytes that can stop in the middle of a
+	token. From the top of the repo:
+
+	  make test-tokens
+
+	The texts include ones whose last line has no newline and ones that
+	stop partway through a token, a string, a comment or a list, since
+	that's where the three ways of reading differ. It says what went
+	wrong, if anything did, and exits with a failure. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tokenizer.h"
+
+/* Far more than any of the texts has, so a tokenizer that never finishes
+	is caught rather than looped on for ever */
+#define MAX_TOKENS 10000
+#define FEED_RUNS 200
+#define SHOW 10
+
+static int failures = 0;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+/* Each token written out as a line, so two runs can be compared with
+	strcmp */
+typedef struct tokens {
+	char *text;
+	size_t len;
+	size_t cap;
+	int count;
+} tokens;
+
+static void add_token(tokens *out, tokenizer *tk, token *t) {
+	char line[256];
+	int n;
+
+	if (t->type == T_NUM)
+		n = snprintf(line, sizeof line, "%d %d %ld %a\n", t->type, t->is_int,
+			t->is_int ? t->i_num : 0, t->is_int ? 0 : t->d_num);
+	else if (t->type == T_ERR)
+		n = snprintf(line, sizeof line, "%d %s\n", t->type, t->err);
+	else
+		n = snprintf(line, sizeof line, "%d %.*s\n", t->type, (int)t->len,
+			token_text(tk, t));
+	if (n >= (int)sizeof line)
+		n = sizeof line - 1;
+
+	if (out->len + n + 1 > out->cap) {
+		out->cap = (out->cap + n + 1) * 2;
+		out->text = realloc(out->text, out->cap);
+	}
+	memcpy(out->text + out->len, line, n + 1);
+	out->len += n;
+	out->count++;
+}
+
+static tokens whole(const char *src) {
+	tokens out = { NULL, 0, 0, 0 };
+	tokenizer *tk = tokenizer_new();
+	tokenizer_feed_buffer(tk, src, strlen(src));
+
+	for (token t = next_token(tk); t.type != T_NULL && out.count < MAX_TOKENS; t = next_token(tk))
+		add_token(&out, tk, &t);
+	tokenizer_free(tk);
+
+	return out;
+}
+
+/* The texts are small enough to fit in a pipe, so we can write all of it
+	before reading any */
+static tokens piped(const char *src) {
+	tokens out = { NULL, 0, 0, 0 };
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	if (write(fds[1], src, strlen(src)) != (ssize_t)strlen(src)) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	close(fds[1]);
+
+	tokenizer *tk = tokenizer_new();
+	start_stream(tk, fdopen(fds[0], "r"));
+
+	for (token t = next_token(tk); t.type != T_NULL && out.count < MAX_TOKENS; t = next_token(tk))
+		add_token(&out, tk, &t);
+	tokenizer_free(tk);
+
+	return out;
+}
+
+/* Gives the tokenizer the next piece of src, or tells it there's no more */
+static void feed_piece(tokenizer *tk, const char *src, size_t len, size_t *pos) {
+	if (*pos == len) {
+		tokenizer_end_input(tk);
+		return;
+	}
+
+	size_t n = 1 + rng() % 40;
+	if (n > len - *pos)
+		n = len - *pos;
+	tokenizer_feed(tk, src + *pos, n);
+	*pos += n;
+}
+
+static tokens fed(const char *src) {
+	tokens out = { NULL, 0, 0, 0 };
+	size_t len = strlen(src), pos = 0;
+	tokenizer *tk = tokenizer_new();
+	feed_piece(tk, src, len, &pos);
+
+	while (out.count < MAX_TOKENS) {
+		token t = next_token(tk);
+		if (t.type == T_NULL)
+			break;
+		if (t.type == T_MORE)
+			feed_piece(tk, src, len, &pos);
+		else
+			add_token(&out, tk, &t);
+	}
+	tokenizer_free(tk);
+
+	return out;
+}
+
+static void compare(const char *how, const char *src, tokens *want, tokens *got) {
+	if (got->count < MAX_TOKENS && want->len == got->len
+			&& (want->len == 0 || strcmp(want->text, got->text) == 0))
+		return;
+
+	if (failures++ < SHOW) {
+		printf("  %.40s... %s:\n", src, how);
+		if (got->count == MAX_TOKENS)
+			printf("    never finished\n");
+		else
+			printf("    wanted\n%s    got\n%s", want->len ? want->text : "",
+				got->len ? got->text : "");
+	}
+}
+
+static const char *texts[] = {
+	"(define x 5)\nx",
+	"(define x 5)\nx\n",
+	"(+ 1 2",
+	"(+ 1 2)",
+	"",
+	"\n\n",
+	"abc",
+	"12",
+	"-12.5e3",
+	"+inf.0",
+	"+in",
+	"+",
+	"\"abc",
+	"\"a\\\"b\" \"c\"",
+	"\"two\nlines\"",
+	"; a comment with no newline",
+	"x ; a comment\ny",
+	"'(a (b c) . d)",
+	"(display \"hi\")\n(newline)\n(car '(1 2 3))",
+	"(define (f n) (if (< n 2) n (+ (f (- n 1)) (f (- n 2)))))\n(f 20)",
+	"#t #f 9223372036854775807 9223372036854775808 -0 .5 5.",
+};
+
+static void check(const char *src) {
+	tokens want = whole(src);
+	tokens got = piped(src);
+	compare("piped", src, &want, &got);
+	free(got.text);
+
+	for (int r = 0; r < FEED_RUNS; r++) {
+		got = fed(src);
+		compare("fed in pieces", src, &want, &got);
+		free(got.text);
+	}
+
+	free(want.text);
+}
+
+int main(void) {
+	for (size_t j = 0; j < sizeof texts / sizeof texts[0]; j++)
+		check(texts[j]);
+
+	/* A last line longer than the chunk a stream is read in, with no
+		newline on the end */
+	size_t n = 3000;
+	char *big = malloc(n * 3 + 1);
+	for (size_t j = 0; j < n; j++)
+		memcpy(big + j * 3, "ab ", 3);
+	memcpy(big + n * 3 - 3, "xyz", 4);
+	check(big);
+	free(big);
+
+	printf("tokens: %s\n", failures ? "FAILED" : "ok");
+	if (failures)
+		printf("%d failed\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
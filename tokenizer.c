@@ -1,34 +1,32 @@
-#include <ctype.h>
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "numconv.h"
+#include "scan.h"
 #include "tokenizer.h"
 #include "util.h"
 
-token* token_new(enum token_type type) {
-	token *t = malloc(sizeof(token));
-	t->type = type;
-	t->val = NULL;
-	t->next = NULL;
-
-	return t;
+const char* token_text(tokenizer *tk, token *t) {
+	return tk->buf + t->start;
 }
 
-void token_free(token *t) {
-	if (!t)
-		return;
-
-    if (t->val != NULL)
-		free(t->val);
+void print_token(tokenizer *tk, token *t) {
+	int len = t->len;
+	const char *text = token_text(tk, t);
 
-	free(t);
-}
-
-void print_token(token *t) {
 	switch (t->type) {
 		case T_ERR:
-			printf("Error: %s\n", t->val);
+			printf("Error: %s\n", t->err);
 			break;
 		case T_LIST_START:
 			puts("(");
@@ -37,22 +35,25 @@ void print_token(token *t) {
 			puts(")");
 			break;
 		case T_SYM:
-			printf("Symbol: %s\n", t->val);
+			printf("Symbol: %.*s\n", len, text);
 			break;
 		case T_NUM:
-			printf("Number: %s\n", t->val);
+			printf("Number: %.*s\n", len, text);
 			break;
 		case T_STR:
-			printf("String: %s\n", t->val);
+			printf("String: %.*s\n", len, text);
 			break;
 		case T_NULL:
 			puts("Null token");
 			break;
+		case T_MORE:
+			puts("Waiting on more input");
+			break;
 		case T_UNKNOWN:
-			printf("Unknown token: %s\n", t->val);
+			printf("Unknown token: %.*s\n", len, text);
 			break;
 		case T_CONSTANT:
-			printf("Constant: %s\n", t->val);
+			printf("Constant: %.*s\n", len, text);
 			break;
 		case T_SINGLE_QUOTE:
 			printf("Single quote\n");
@@ -62,98 +63,148 @@ void print_token(token *t) {
 	}
 }
 
-int is_valid_in_symbol(char c)
-{
-	if (isalpha(c) || isdigit(c))
-		return 1;
-
-	switch (c) {
-		case '@':
-		case '#':
-		case '$':
-		case '&':
-		case ':':
-		case '|':
-		case '?':
-		case '.':
-		case '_':
-		case '-':
-		case '+':
-		case '*':
-		case '!':
-			return 1;
-	}
-
-	return 0;
-}
-
 tokenizer* tokenizer_new(void) {
     tokenizer *t = malloc(sizeof(tokenizer));
-    t->curr_line = NULL;
-    t->pos = 0;
+	t->buf = NULL;
+	t->len = 0;
+	t->pos = 0;
+	t->kind = SRC_NONE;
+	t->map_size = 0;
+	t->cap = 0;
 	t->file = NULL;
-	t->stashed = NULL;
+	t->more = 0;
+	t->in_comment = 0;
+	t->scan = scan_kernels_get();
 
     return t;
 }
 
+/* Let go of whatever we were tokenizing */
+static void release_source(tokenizer *tk) {
+	switch (tk->kind) {
+		case SRC_OWNED:
+			free((char*)tk->buf);
+			break;
+		case SRC_MAPPED:
+#ifndef _WIN32
+			munmap((void*)tk->buf, tk->map_size);
+#endif
+			break;
+		default:
+			break;
+	}
+
+	tk->buf = NULL;
+	tk->len = 0;
+	tk->pos = 0;
+	tk->kind = SRC_NONE;
+	tk->cap = 0;
+}
+
 void tokenizer_free(tokenizer* tk) {
 	if (tk->file)
 		fclose(tk->file);
-
-	/* There shouldn't be any leftover tokens on the stash, but just in case */
-	token *t;
-	while (tk->stashed) {
-		t = tk->stashed;
-		tk->stashed = tk->stashed->next;
-		token_free(t);
-	}
+	release_source(tk);
 
     free(tk);
 }
 
-void tokenizer_feed_line(tokenizer* t, char* line) {
-    if (t->curr_line)
-        free(t->curr_line);
+/* Tokenize buf where it is. It has to stay put, and buf[len] has to be
+	'\0', until we're done with it. */
+void tokenizer_feed_buffer(tokenizer *t, const char *buf, size_t len) {
+	release_source(t);
 
-    t->curr_line = line ? n_strcpy(t->curr_line, line) : NULL;
-    t->pos = 0;
+	t->buf = buf;
+	t->len = len;
+	t->kind = SRC_BORROWED;
+	t->more = 0;
 }
 
-int skip_whitespace(char *line, int pos) {
-    int curr = pos;
+/* Make room for n more bytes on the end of the text. Only what hasn't
+	been tokenized yet is kept, which is at most a token that was cut off
+	when we last ran out, and it's moved to the front of a buffer of our
+	own. Gives back where the new bytes go. */
+static char* append_space(tokenizer *tk, size_t n) {
+	size_t keep = tk->len - tk->pos;
+	char *buf;
+
+	if (tk->kind == SRC_OWNED) {
+		buf = (char*)tk->buf;
+		memmove(buf, buf + tk->pos, keep);
+		if (keep + n + 1 > tk->cap) {
+			while (keep + n + 1 > tk->cap)
+				tk->cap *= 2;
+			buf = realloc(buf, tk->cap);
+		}
+	}
+	else {
+		size_t cap = 4096;
+		while (keep + n + 1 > cap)
+			cap *= 2;
+		buf = malloc(cap);
+		if (keep)
+			memcpy(buf, tk->buf + tk->pos, keep);
+		release_source(tk);
+		tk->cap = cap;
+	}
 
-    while (line && (line[curr] == ' ' || line[curr] == '\n'))
-		++curr;
+	tk->buf = buf;
+	tk->len = keep;
+	tk->pos = 0;
+	tk->kind = SRC_OWNED;
 
-	return curr;
+	return buf + keep;
 }
 
-int is_number_token(token *tk) {
-	char *p;
+/* Add the next piece of the input, which can stop anywhere, even in the
+	middle of a token. A token that runs up against the end of what we
+	have is held back until the next piece (or tokenizer_end_input) says
+	whether it goes on. */
+void tokenizer_feed(tokenizer *tk, const char *chunk, size_t len) {
+	char *dst = append_space(tk, len);
+	memcpy(dst, chunk, len);
+	tk->len += len;
+	dst[len] = '\0';
+	tk->more = 1;
+}
 
-	long a =strtol(tk->val, &p, 10);
-	if (strcmp(p, "") == 0) {
-		tk->is_int = 1;
-		tk->i_num = a;
-		return 1;
-	}
+/* There's no more input coming, so whatever was held back is complete
+	(or an error) */
+void tokenizer_end_input(tokenizer *tk) {
+	tk->more = 0;
+}
 
-	double b = strtod(tk->val, &p);
-	if (strcmp(p, "") == 0) {
-		tk->is_int = 0;
-		tk->d_num = b;
-		return 1;
-	}
+/* Whether there's anything held back, waiting on more input */
+int tokenizer_pending(tokenizer *tk) {
+	return tk->buf && tk->pos < tk->len;
+}
 
-	return 0;
+static int is_number_token(const char *s, token *t) {
+	return num_parse(s + t->start, t->len, &t->is_int, &t->i_num, &t->d_num);
+}
+
+static token token_err(const char *msg) {
+	token t = { T_ERR };
+	t.err = msg;
+
+	return t;
+}
+
+static token token_more(void) {
+	token t = { T_MORE };
+
+	return t;
 }
 
-token* parse_str_token(char *s, int *start) {
-	token *tk = NULL;
-	int len, x = *start + 1;
+/* The slice we give back is just the inside of the string. The parser
+	takes the escapes out when it copies it. */
+static token parse_str_token(tokenizer *tk, const char *s, size_t *start) {
+	size_t x = tk->scan->string_end(s, *start + 1, tk->len);
 
 	while (s[x] != '\0' && s[x] != '"') {
+		if (s[x] == '\\' && x + 1 == tk->len && tk->more)
+			return token_more();
+
 		if (s[x] == '\\') {
 			// The only escape characters I'm going to escape for now
 			switch (s[x+1]) {
@@ -161,198 +212,300 @@ token* parse_str_token(char *s, int *start) {
 				case '"':
 					++x;
 					break;
-					++x;
-					break;
 				default:
-					tk = token_new(T_ERR);
-					goto err;
+					/* Skip the rest of it so we don't trip over its end
+						quote as the start of another string. Other escapes
+						in it are still skipped over as pairs, the same as
+						parse_all's pre-scan does. */
+					while (s[x] != '\0' && s[x] != '"') {
+						if (s[x] == '\\' && s[x + 1] != '\0')
+							++x;
+						++x;
+					}
+					if (x == tk->len && tk->more)
+						return token_more();
+					*start = s[x] ? x + 1 : x;
+					return token_err("Invalid escape character.");
 			}
  		}
-		++x;
+		x = tk->scan->string_end(s, x + 1, tk->len);
 	}
-	++x;
 
-err:
-	if (tk && tk->type == T_ERR) {
-		tk->val = NULL;
-		tk->val = n_strcpy(tk->val, "Invalid escape character.");
-		return tk;
-	}
+	if (x == tk->len && tk->more)
+		return token_more();
 
-	tk = token_new(T_STR);
-	len = x - *start - 2; // Skip the quotes
-	tk->val = malloc(1 + len * sizeof(char));
-
-	// Copy string, skipping backslashes
-	int j, k;
-	for (j = *start + 1, k = 0; k < len; j++) {
-		if (s[j] != '\\' || (s[j] == '\\' && s[j+1] == '\\'))
-			tk->val[k++] = s[j];
-		else
-			--len;
+	if (s[x] == '\0') {
+		/* Nothing after the end to skip over */
+		*start = x;
+		return token_err("Unterminated string.");
 	}
-	tk->val[len] = '\0';
-
-	(*start) = x;
 
-	return tk;
-}
+	token t = { T_STR };
+	t.start = *start + 1;
+	t.len = x - t.start;
+	*start = x + 1;
 
-char* trim_line(char *buffer) {
-	int c = 0;
-
-	while (isspace(buffer[c]) && buffer[c] != '\0')
-		++c;
-
-	int e = strlen(buffer) - 1;
-	while (e > 0 && isspace(buffer[e]))
-		--e;
-
-	int diff = e - c + 1;
-	char *line = malloc(diff + 1);
-	memcpy(line, &buffer[c], diff );
-	line[diff] = '\0';
-
-	return line;
+	return t;
 }
 
-char* fetch_next_line(tokenizer *t) {
-	char buffer[1024];
-	buffer[0] = '\0';
-	char *line = NULL;
-
-	while (1) {
-		if (!fgets(buffer, 1024, t->file)) {
-			fclose(t->file);
+/* For a stream, add the next line (however long it is) onto whatever
+	hasn't been tokenized yet. Once the stream ends nothing more can come,
+	so what's held back is finished off, even if the last line had no
+	newline to end it. */
+#define LINE_CHUNK 4096
+
+static void refill(tokenizer *tk) {
+	while (tk->file) {
+		char *dst = append_space(tk, LINE_CHUNK);
+		if (!fgets(dst, LINE_CHUNK + 1, tk->file)) {
+			fclose(tk->file);
+			tk->file = NULL;
+			tk->more = 0;
+			*dst = '\0';
 			break;
 		}
-		line = trim_line(buffer);
-		if (strlen(line) > 0)
+
+		/* A line with a '\0' in it stops there, and one that starts with
+			one gives us nothing at all */
+		size_t n = strlen(dst);
+		tk->len += n;
+		if (n > 0 && dst[n - 1] == '\n')
 			break;
-		free(line);
+	}
+}
+
+/* Most runs of whitespace or symbol characters are only a few bytes long,
+	too short for the scan kernels to pay for the call, so we look at the
+	first few ourselves. Neither class includes '\0', so these stop at the
+	end of the text. */
+#define SHORT_RUN 8
+
+static inline size_t run_end(tokenizer *tk, const char *s, size_t x,
+			unsigned char class, scan_fn kernel) {
+	for (size_t stop = x + SHORT_RUN; x < stop; x++) {
+		if (!(scan_class[(unsigned char)s[x]] & class))
+			return x;
 	}
 
-	return line;
+	return kernel(s, x, tk->len);
 }
 
-token* next_in_line(tokenizer *tk) {
-	token *t;
-    tk->pos = skip_whitespace(tk->curr_line, tk->pos);
-    char *s = tk->curr_line;
-    int x = tk->pos;
+/* A lone + is always a symbol on its own, so that (+1 2) is (+ 1 2), but
+	+inf.0 and +nan.0 are numbers. Gives back 1 if that's what's at pos, -1
+	if it might be once more input arrives. */
+static int plus_special(tokenizer *tk, const char *s) {
+	size_t left = tk->len - tk->pos - 1;
+	const char *p = s + tk->pos + 1;
 
-	if (s[tk->pos] == '\0') {
-		free(tk->curr_line);
-		tk->curr_line = NULL;
-		tk->pos = 0;
+	if (left >= 5)
+		return memcmp(p, "inf.0", 5) == 0 || memcmp(p, "nan.0", 5) == 0;
+	if (tk->more && (memcmp(p, "inf.0", left) == 0 || memcmp(p, "nan.0", left) == 0))
+		return -1;
 
-		return NULL;
-	}
+	return 0;
+}
 
-	if (tk->curr_line[tk->pos] == '(') {
-        t = token_new(T_LIST_START);
-        t->val =  n_strcpy(t->val, "(");
-        tk->pos++;
+/* The next token, starting from somewhere that isn't whitespace or the
+	end */
+static token next_in_line(tokenizer *tk) {
+	token t = { T_UNKNOWN };
+	const char *s = tk->buf;
+	size_t x = tk->pos;
 
-        return t;
-    }
+	int special = s[tk->pos] == '+' ? plus_special(tk, s) : 0;
 
-    if (s[tk->pos] == '+' || s[tk->pos] == '*' || s[tk->pos] == '/' || s[tk->pos] == '%'
+	if (s[tk->pos] == '(') {
+		t.type = T_LIST_START;
+		x = tk->pos + 1;
+	}
+	else if (special < 0) {
+		return token_more();
+	}
+	else if (special) {
+		t.type = T_SYM;
+		x = run_end(tk, s, tk->pos + 1, SC_SYMBOL, tk->scan->symbol_end);
+	}
+	else if (s[tk->pos] == '+' || s[tk->pos] == '*' || s[tk->pos] == '/' || s[tk->pos] == '%'
 			|| s[tk->pos] == '=' || s[tk->pos] == '^'
 			|| (s[tk->pos] == '-' && s[tk->pos] == ' ')) {
-		t = token_new(T_SYM);
+		t.type = T_SYM;
 		x = tk->pos + 1;
 	}
 	else if (s[tk->pos] == '\\') {
-		t = token_new(T_ERR);
-		t->val = NULL;
-		t->val = n_strcpy(t->val, "Invalid token.");
-		return t;
+		tk->pos++;
+		return token_err("Invalid token.");
 	}
 	else if (s[tk->pos] == '"') {
-		t = parse_str_token(s, &(tk->pos));
-		return t;
+		return parse_str_token(tk, s, &(tk->pos));
 	}
 	else if (s[tk->pos] == '<' || s[tk->pos] == '>') {
-		t = token_new(T_SYM);
+		t.type = T_SYM;
 		x = tk->pos + 1;
+		if (x == tk->len && tk->more)
+			return token_more();
 		if (s[x] && s[x] == '=')
 			++x;
 	}
 	else if (s[tk->pos] == '\'') {
-		t = token_new(T_SINGLE_QUOTE);
+		t.type = T_SINGLE_QUOTE;
 		x = tk->pos + 1;
 	}
     else if (s[tk->pos] == ';') {
-        /* We're at a comment so we can just ignore the rest of the line */
-        tk->pos = strlen(tk->curr_line);
-		return token_new(T_COMMENT);
+        /* We're at a comment so we can just ignore the rest of the line.
+			Source handed over as one string (see api.c) can have more lines
+			after it. */
+		t.type = T_COMMENT;
+		x = tk->scan->line_end(s, tk->pos, tk->len);
+		tk->in_comment = x == tk->len && tk->more;
     }
 	else if(s[tk->pos] == ')') {
-		t = token_new(T_LIST_END);
+		t.type = T_LIST_END;
 		x = tk->pos + 1;
 	}
 	else if (s[tk->pos] == '#') {
-		t = token_new(T_CONSTANT);
+		t.type = T_CONSTANT;
 		x = tk->pos + 1;
-		while (s[x] != '\0' && isalpha(s[x]))
+		while (scan_class[(unsigned char)s[x]] & SC_ALPHA)
 			++x;
 	}
-	else if (is_valid_in_symbol(s[tk->pos])) {
-		t = token_new(T_SYM);
-		x = tk->pos + 1;
-		while (s[x] != '\0' && is_valid_in_symbol(s[x]))
-			++x;
+	else if (scan_class[(unsigned char)s[tk->pos]] & SC_SYMBOL) {
+		t.type = T_SYM;
+		x = run_end(tk, s, tk->pos + 1, SC_SYMBOL, tk->scan->symbol_end);
 	}
 	else {
-		t = token_new(T_UNKNOWN);
 		x = tk->pos + 1;
 	}
 
-    int len = x - tk->pos + 1;
-	t->val = malloc(len * sizeof(char));
-	memcpy(t->val, &s[tk->pos], len - 1);
-	t->val[len - 1] = '\0';
+	/* It might go on in the next piece of input */
+	if (x == tk->len && tk->more && (t.type == T_SYM || t.type == T_CONSTANT))
+		return token_more();
+
+	t.start = tk->pos;
+	t.len = x - tk->pos;
 	tk->pos = x;
 
-	if (t->type == T_SYM && is_number_token(t)) {
-		t->type = T_NUM;
+	if (t.type == T_SYM && is_number_token(s, &t)) {
+		t.type = T_NUM;
 	}
 
     return t;
 }
 
-void tokenizer_stash (tokenizer* tk, token* t) {
-	if (tk->stashed)
-		t->next = tk->stashed;
+/* Comments are dropped here, so the parser never sees a T_COMMENT. When
+	we run out of text a stream is read from again. Text that's being fed
+	to us gets a T_MORE back, and the token we were in the middle of is
+	started over when the rest of it arrives. */
+token next_token(tokenizer* tk) {
+	for (;;) {
+		if (tk->buf && tk->in_comment) {
+			tk->pos = tk->scan->line_end(tk->buf, tk->pos, tk->len);
+			tk->in_comment = tk->pos == tk->len && tk->more;
+		}
 
-	tk->stashed = t;
-}
+		if (tk->buf)
+			tk->pos = run_end(tk, tk->buf, tk->pos, SC_SPACE, tk->scan->space_end);
+
+		if (tk->buf && tk->pos < tk->len) {
+			size_t start = tk->pos;
+			token t = next_in_line(tk);
+			if (t.type == T_MORE)
+				tk->pos = start;
+			else if (t.type != T_COMMENT)
+				return t;
+			else
+				continue;
+		}
+
+		if (!tk->more) {
+			release_source(tk);
+			token t = { T_NULL };
+			return t;
+		}
+
+		if (!tk->file)
+			return token_more();
 
-token* next_token(tokenizer* tk) {
-	if (tk->stashed) {
-		token *t = tk->stashed;
-		tk->stashed = tk->stashed->next;
-		return t;
+		refill(tk);
 	}
+}
+
+/* Read from f as we go. It's closed once we get to its end or when the
+	tokenizer is freed. */
+void start_stream(tokenizer *tk, FILE *f) {
+	release_source(tk);
+	tk->file = f;
+	tk->more = 1;
+}
 
-	/* If our source is a file, do we need to read another line in? */
-	if (tk->file && (!tk->curr_line || tk->curr_line[tk->pos] == '\0')) {
-		tokenizer_feed_line(tk, fetch_next_line(tk));
+#ifndef _WIN32
+/* Read the whole of fd into a buffer of our own, for when mapping it won't
+	do */
+static int slurp_file(tokenizer *tk, int fd, size_t size) {
+	char *buf = malloc(size + 1);
+	size_t got = 0;
+	while (got < size) {
+		ssize_t n = read(fd, buf + got, size - got);
+		if (n <= 0)
+			break;
+		got += n;
 	}
+	buf[got] = '\0';
 
-	if (!tk->curr_line)
-		return NULL;
+	tk->buf = buf;
+	tk->len = got;
+	tk->pos = 0;
+	tk->kind = SRC_OWNED;
 
-	return next_in_line(tk);
+	return 1;
 }
 
-int start_file(tokenizer *tz, char *filename) {
-	tz->file = fopen(filename, "r");
+/* The tokenizer wants a '\0' after the last character. Mapping a file
+	gives us one for free when its size isn't a multiple of the page size,
+	because the rest of the last page is filled with zeros. When it is a
+	multiple there's no room, so it gets read in instead. */
+static int map_file(tokenizer *tk, int fd, size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (size % page == 0)
+		return slurp_file(tk, fd, size);
+
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return slurp_file(tk, fd, size);
+
+	tk->buf = p;
+	tk->len = size;
+	tk->pos = 0;
+	tk->kind = SRC_MAPPED;
+	tk->map_size = size;
+
+	return 1;
+}
+#endif
 
-	if (tz->file) {
+int start_file(tokenizer *tz, char *filename) {
+	release_source(tz);
+	tz->more = 0;
+
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	int mapped = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && map_file(tz, fd, st.st_size);
+	if (mapped) {
+		close(fd);
 		return 1;
 	}
 
-	return 0;
+	/* Not something we can map, so it gets read a line at a time */
+	tz->file = fdopen(fd, "r");
+	if (!tz->file)
+		close(fd);
+#else
+	tz->file = fopen(filename, "r");
+#endif
+	tz->more = tz->file != NULL;
+
+	return tz->file != NULL;
 }
@@ -1,36 +1,66 @@
 #ifndef tokenizer_h
 #define tokenizer_h
 
+#include <stddef.h>
+#include <stdio.h>
+
+#include "scan.h"
+
 enum token_type { T_NUM, T_SYM, T_STR, T_NULL, T_LIST_START, T_LIST_END,
-	T_UNKNOWN, T_CONSTANT, T_SINGLE_QUOTE, T_ERR, T_COMMENT };
+	T_UNKNOWN, T_CONSTANT, T_SINGLE_QUOTE, T_ERR, T_COMMENT, T_MORE };
+
+/* A token is a slice of the tokenizer's text, start and len, rather than
+	a copy of it. For T_STR the slice is what's between the quotes, with
+	any escapes still in it. A number has already been read into i_num or
+	d_num. It's only good until the next call to next_token(), since by
+	then a stream may have moved on to its next line, so whoever wants the
+	text has to copy it before asking for another token.
 
+	When there's nothing left next_token() gives back a T_NULL, or a T_MORE
+	if the input is being fed to us a piece at a time (tokenizer_feed) and
+	the next piece hasn't come yet. */
 typedef struct token {
 	enum token_type type;
-	char *val;
+	size_t start;
+	size_t len;
 	int is_int;
 	long i_num;
 	double d_num;
-	struct token *next;
-	struct token *top;
+	const char *err; /* For T_ERR */
 } token;
 
-token* token_new(enum token_type);
-void token_free(token *);
-void dump_tokens(char *);
+/* Where the text being tokenized lives. Whatever it is, buf is always
+	'\0' terminated and we only ever read from it. */
+enum source_kind { SRC_NONE, SRC_OWNED, SRC_BORROWED, SRC_MAPPED };
 
+/* A file is mapped in whole and tokenized where it sits, so there's no
+	copying and no limit on how long a line can be. Something that can't
+	be mapped, like a pipe, is read a line at a time (of any length) onto
+	the end of a buffer that's reused, and tokenizer_feed adds text the
+	same way. Either way only what hasn't been tokenized yet is kept. */
 typedef struct tokenizer {
-    char *curr_line;
-    int pos;
-	FILE *file;
-	struct token *stashed;
+	const char *buf;
+	size_t len;
+	size_t pos;
+	enum source_kind kind;
+	size_t map_size; /* Of the mapping, for SRC_MAPPED */
+	size_t cap; /* Of buf, for SRC_OWNED */
+	FILE *file; /* Read as we go, if it's a stream */
+	int more; /* More text may still come after len */
+	int in_comment; /* Ran out partway through one */
+	const scan_kernels *scan;
 } tokenizer;
 
 tokenizer* tokenizer_new(void);
 void tokenizer_free(tokenizer*);
-void tokenizer_feed_line(tokenizer*, char*);
-token* next_token(tokenizer*);
-void print_token(token*);
+void tokenizer_feed_buffer(tokenizer*, const char*, size_t);
+void tokenizer_feed(tokenizer*, const char*, size_t);
+void tokenizer_end_input(tokenizer*);
+int tokenizer_pending(tokenizer*);
+void start_stream(tokenizer*, FILE*);
+token next_token(tokenizer*);
+const char* token_text(tokenizer*, token*);
+void print_token(tokenizer*, token*);
 int start_file(tokenizer*, char*);
-void tokenizer_stash (tokenizer*, token*);
 
 #endif